@@ -13,6 +13,13 @@ Module Name:
 
 Abstract:
 
+    Lists the keyboard filter interfaces and prints the keyboard attributes
+    of the last one. kbftest -r then follows its event ring until a key is
+    pressed in the console, kbftest -s prints the counters of the driver,
+    kbftest -l the percentiles of its callback latency and kbftest -L the
+    same before it clears the histogram. kbftest -w prints the layer
+    switches, commands and programs of the engine as they happen, until a
+    key is pressed in the console.
 
 Environment:
 
@@ -27,6 +34,7 @@ Environment:
 #include <initguid.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <conio.h>
 #include <ntddkbd.h>
 
@@ -49,6 +57,31 @@ DEFINE_GUID(GUID_DEVINTERFACE_KBFILTER,
 0x3fb7299d, 0x6847, 0x4490, 0xb0, 0xc9, 0x99, 0xe0, 0x98, 0x6a, 0xb8, 0x86);
 // {3FB7299D-6847-4490-B0C9-99E0986AB886}
 
+#define NOTIFY_PARKED   4   // requests kbftest -w keeps waiting in the driver
+
+//
+// Returns the highest cycle count of the bucket the fraction p of the
+// samples of a latency series falls in, 0 when the series has none
+//
+ULONG64
+LatencyPercentile(
+    _In_ const ULONG64 *buckets,
+    _In_ ULONG64 samples,
+    _In_ double p
+    )
+{
+    ULONG64 rank = (ULONG64)ceil(p * samples), seen = 0;
+    ULONG b;
+
+    for (b = 0; b < KBFILTR_LATENCY_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen && seen >= rank) {
+            return (b < 4) ? b : KBFILTR_LATENCY_BUCKET_LOW(b) + (1ULL << ((b >> 2) - 2)) - 1;
+        }
+    }
+    return 0;
+}
+
 
 int
 _cdecl
@@ -65,9 +98,15 @@ main(
     HANDLE                              file;
     ULONG                               i =0;
     KEYBOARD_ATTRIBUTES                 kbdattrib;
-
-    UNREFERENCED_PARAMETER(argc);
-    UNREFERENCED_PARAMETER(argv);
+    KBFILTR_RING_MAPPING                mapping;
+    PKBFILTR_RING                       ring;
+    ULONG                               tail;
+    KBFILTR_STATS                       stats;
+    KBFILTR_LATENCY                     latency;
+    ULONG                               reset;
+    KBFILTR_NOTIFICATION                notification[NOTIFY_PARKED];
+    OVERLAPPED                          overlapped[NOTIFY_PARKED];
+    HANDLE                              events[NOTIFY_PARKED];
 
     //
     // Open a handle to the device interface information set of all
@@ -229,7 +268,188 @@ main(
            kbdattrib.NumberOfIndicators,
            kbdattrib.NumberOfKeysTotal, 
            kbdattrib.InputDataQueueLength);
-    
+
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+        //
+        // Map the event ring and follow it, reading needs no further calls
+        //
+        if (!DeviceIoControl (file,
+                              IOCTL_KBFILTR_MAP_EVENT_RING,
+                              NULL, 0,
+                              &mapping, sizeof(mapping),
+                              &bytes, NULL)) {
+            printf("Map Event Ring request failed:0x%x\n", GetLastError());
+            free (deviceInterfaceDetailData);
+            CloseHandle(file);
+            return 0;
+        }
+
+        ring = (PKBFILTR_RING)(ULONG_PTR)mapping.Address;
+        tail = ring->Head;
+        printf("\nEvent ring, press a key in this console to stop\n");
+
+        while (!_kbhit()) {
+            ULONG head = ring->Head;
+
+            for (; tail != head; tail++) {
+                PKBFILTR_RING_EVENT event = &ring->Events[tail & (ring->Entries - 1)];
+                printf("%s %02x %x unit %u at %I64d\n",
+                       event->Direction == KBFILTR_RING_INPUT ? "in " : "out",
+                       event->MakeCode, event->Flags, event->UnitId, event->Time);
+            }
+            ring->Tail = tail;
+            Sleep(10);
+        }
+        printf("%u events dropped\n", ring->Dropped);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+        //
+        // The counters of all processors, added up by the driver
+        //
+        if (!DeviceIoControl (file,
+                              IOCTL_KBFILTR_GET_STATS,
+                              NULL, 0,
+                              &stats, sizeof(stats),
+                              &bytes, NULL)) {
+            printf("Get Stats request failed:0x%x\n", GetLastError());
+            free (deviceInterfaceDetailData);
+            CloseHandle(file);
+            return 0;
+        }
+
+        printf("\nDriver Statistics:\n"
+               " PacketsIn:   %I64u\n"
+               " PacketsOut:  %I64u\n"
+               " Upcalls:     %I64u, %.1f packets each\n"
+               " Bindings:    %I64u\n"
+               " Timeouts:    %I64u\n"
+               " Dropped:     %I64u\n"
+               " Reloads:     %I64u, %.1f ms each\n",
+               stats.PacketsIn,
+               stats.PacketsOut,
+               stats.Upcalls, stats.Upcalls ? (double)stats.PacketsOut / stats.Upcalls : 0.0,
+               stats.Bindings,
+               stats.Timeouts,
+               stats.Dropped,
+               stats.Reloads, stats.Reloads ? stats.ReloadTime / 10000.0 / stats.Reloads : 0.0);
+    }
+
+    if (argc > 1 && (strcmp(argv[1], "-l") == 0 || strcmp(argv[1], "-L") == 0)) {
+        static const char *series[KBFILTR_LATENCY_SERIES] = { "pass", "remap", "chord", "command" };
+        double us;
+
+        //
+        // -L clears the histogram in the same request that reads it
+        //
+        reset = (argv[1][1] == 'L');
+        if (!DeviceIoControl (file,
+                              IOCTL_KBFILTR_GET_LATENCY,
+                              &reset, sizeof(reset),
+                              &latency, sizeof(latency),
+                              &bytes, NULL)) {
+            printf("Get Latency request failed:0x%x\n", GetLastError());
+            free (deviceInterfaceDetailData);
+            CloseHandle(file);
+            return 0;
+        }
+
+        // microseconds per cycle, from the cycles the counter ran in the interrupt time since the driver loaded
+        us = latency.Cycles ? latency.Time / 10.0 / latency.Cycles : 0.0;
+
+        printf("\nCallback Latency, us (counter at %.0f MHz):\n"
+               " %-8s %10s %8s %8s %8s %8s %8s\n",
+               us ? 1.0 / us : 0.0, "path", "callbacks", "p50", "p90", "p99", "p99.9", "max");
+
+        for (i = 0; i < KBFILTR_LATENCY_SERIES; i++) {
+            ULONG64 samples = 0;
+            ULONG b;
+
+            for (b = 0; b < KBFILTR_LATENCY_BUCKETS; b++) {
+                samples += latency.Buckets[i][b];
+            }
+            printf(" %-8s %10I64u %8.2f %8.2f %8.2f %8.2f %8.2f\n", series[i], samples,
+                   LatencyPercentile(latency.Buckets[i], samples, 0.5) * us,
+                   LatencyPercentile(latency.Buckets[i], samples, 0.9) * us,
+                   LatencyPercentile(latency.Buckets[i], samples, 0.99) * us,
+                   LatencyPercentile(latency.Buckets[i], samples, 0.999) * us,
+                   latency.Max[i] * us);
+        }
+        if (reset) {
+            printf("histogram cleared\n");
+        }
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-w") == 0) {
+        static const char *types[] = { "", "layer", "command", "program" };
+
+        //
+        // The requests are parked in the driver until an event completes
+        // them, so they are sent overlapped on a handle opened for that
+        //
+        CloseHandle(file);
+        file = CreateFile ( deviceInterfaceDetailData->DevicePath,
+                            GENERIC_READ | GENERIC_WRITE,
+                            0,
+                            NULL,
+                            OPEN_EXISTING,
+                            FILE_FLAG_OVERLAPPED,
+                            NULL);
+        if (INVALID_HANDLE_VALUE == file) {
+            printf("Error in CreateFile: %x", GetLastError());
+            free (deviceInterfaceDetailData);
+            return 0;
+        }
+
+        for (i = 0; i < NOTIFY_PARKED; i++) {
+            events[i] = CreateEvent(NULL, TRUE, FALSE, NULL);
+            memset(&overlapped[i], 0, sizeof(OVERLAPPED));
+            overlapped[i].hEvent = events[i];
+            if (!DeviceIoControl (file, IOCTL_KBFILTR_WAIT_NOTIFICATION, NULL, 0,
+                                  &notification[i], sizeof(notification[i]), NULL, &overlapped[i]) &&
+                GetLastError() != ERROR_IO_PENDING) {
+                printf("Wait Notification request failed:0x%x\n", GetLastError());
+                CloseHandle(file);
+                free (deviceInterfaceDetailData);
+                return 0;
+            }
+        }
+
+        printf("\nEngine notifications, press a key in this console to stop\n");
+
+        while (!_kbhit()) {
+            DWORD wait = WaitForMultipleObjects(NOTIFY_PARKED, events, FALSE, 100);
+            PKBFILTR_NOTIFICATION n;
+
+            if (wait < WAIT_OBJECT_0 || wait >= WAIT_OBJECT_0 + NOTIFY_PARKED) {
+                continue;
+            }
+            i = wait - WAIT_OBJECT_0;
+            n = &notification[i];
+            if (GetOverlappedResult(file, &overlapped[i], &bytes, FALSE)) {
+                printf("#%u %s %02x %u in layer %u at %I64d\n", n->Sequence,
+                       n->Type < 4 ? types[n->Type] : "?", n->Command, n->Arg, n->Layer, n->Time);
+            }
+
+            // park it again for the next event
+            ResetEvent(events[i]);
+            if (!DeviceIoControl (file, IOCTL_KBFILTR_WAIT_NOTIFICATION, NULL, 0,
+                                  n, sizeof(*n), NULL, &overlapped[i]) &&
+                GetLastError() != ERROR_IO_PENDING) {
+                printf("Wait Notification request failed:0x%x\n", GetLastError());
+                SetEvent(events[i]); // nothing pending on it to wait for below
+                break;
+            }
+        }
+
+        // the buffers of the requests still parked must outlive them
+        CancelIo(file);
+        for (i = 0; i < NOTIFY_PARKED; i++) {
+            GetOverlappedResult(file, &overlapped[i], &bytes, TRUE);
+            CloseHandle(events[i]);
+        }
+    }
+
     free (deviceInterfaceDetailData);
     CloseHandle(file);
     return 0;
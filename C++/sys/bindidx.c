@@ -0,0 +1,194 @@
+/*--
+
+Module Name:
+
+    bindidx.c
+
+Abstract: Builds the sparse per-layer binding index used by the service
+          callback. LoadConfig records every binding line into a builder,
+          which is sorted once and compiled into one non-paged block per
+          layer, sized to the bindings actually present.
+
+Environment:
+
+    Kernel mode, or user mode on the host with KBF_HOST.
+
+--*/
+
+#include "kbtypes.h"
+#include "kbkeys.h"
+#include "bindidx.h"
+
+#define BUILDER_GROW	256
+
+const struct_binding NoBinding = { 0, 0, 0, 0, 0 };
+
+VOID BindingBuilderInit(PBINDING_BUILDER builder) {
+	builder->records = NULL;
+	builder->count = 0;
+	builder->capacity = 0;
+	builder->failed = FALSE;
+}
+
+BOOLEAN BindingBuilderSet(PBINDING_BUILDER builder, USHORT layer, USHORT key1, USHORT key2, USHORT mask, const struct_binding *value) {
+	if (layer >= MAX_LAYERS || key1 >= MAX_KEYS || key2 >= MAX_KEYS) return FALSE;
+
+	if (builder->count == builder->capacity) {
+		ULONG capacity = builder->capacity ? builder->capacity * 2 : BUILDER_GROW;
+		PBINDING_RECORD records = KbAllocatePaged(capacity * sizeof(BINDING_RECORD));
+		if (records == NULL) {
+			builder->failed = TRUE;
+			return FALSE;
+		}
+		if (builder->records) {
+			memcpy(records, builder->records, builder->count * sizeof(BINDING_RECORD));
+			KbFree(builder->records);
+		}
+		builder->records = records;
+		builder->capacity = capacity;
+	}
+
+	PBINDING_RECORD record = &builder->records[builder->count];
+	record->layer = (UCHAR)layer;
+	record->key1 = (UCHAR)key1;
+	record->key2 = (UCHAR)key2;
+	record->mask = (UCHAR)mask;
+	record->seq = builder->count++;
+	record->value = *value;
+	return TRUE;
+}
+
+static __inline BOOLEAN RecordLess(const BINDING_RECORD *a, const BINDING_RECORD *b) {
+	if (a->layer != b->layer) return a->layer < b->layer;
+	if (a->key1 != b->key1) return a->key1 < b->key1;
+	if (a->key2 != b->key2) return a->key2 < b->key2;
+	return a->seq < b->seq;
+}
+
+static VOID SiftDown(PBINDING_RECORD records, ULONG root, ULONG count) {
+	for (;;) {
+		ULONG child = root * 2 + 1;
+		if (child >= count) return;
+		if (child + 1 < count && RecordLess(&records[child], &records[child + 1])) child++;
+		if (!RecordLess(&records[root], &records[child])) return;
+		BINDING_RECORD t = records[root];
+		records[root] = records[child];
+		records[child] = t;
+		root = child;
+	}
+}
+
+//
+// Sorts the records by layer, key1, key2 and parse order, then folds repeated
+// chords into one record so later lines override earlier ones field by field.
+//
+VOID BindingBuilderFinish(PBINDING_BUILDER builder) {
+	PBINDING_RECORD records = builder->records;
+	ULONG count = builder->count;
+	ULONG i, out;
+
+	if (count < 2) return;
+
+	// heap sort, the record count of a large config makes insertion sort too slow
+	for (i = count / 2; i-- > 0;) SiftDown(records, i, count);
+	for (i = count - 1; i > 0; i--) {
+		BINDING_RECORD t = records[0];
+		records[0] = records[i];
+		records[i] = t;
+		SiftDown(records, 0, i);
+	}
+
+	out = 0;
+	for (i = 1; i < count; i++) {
+		PBINDING_RECORD last = &records[out];
+		PBINDING_RECORD next = &records[i];
+		if (last->layer == next->layer && last->key1 == next->key1 && last->key2 == next->key2) {
+			if (next->mask & BIND_OUT1) last->value.out1 = next->value.out1;
+			if (next->mask & BIND_OUT2) last->value.out2 = next->value.out2;
+			if (next->mask & BIND_OUT3) last->value.out3 = next->value.out3;
+			if (next->mask & BIND_FLAG1) last->value.flag1 = next->value.flag1;
+			if (next->mask & BIND_ARG1) last->value.arg1 = next->value.arg1;
+			last->mask |= next->mask;
+		} else {
+			records[++out] = *next;
+		}
+	}
+	builder->count = out + 1;
+}
+
+//
+// Compiles the records of one layer into a non-paged BINDING_LAYER block.
+// BindingBuilderFinish must have been called. Returns NULL for an empty layer,
+// and sets failed when the layer has more bindings than the index holds.
+//
+PBINDING_LAYER BindingBuilderCompile(PBINDING_BUILDER builder, USHORT layer) {
+	ULONG start = 0, end, i, entries, size;
+	PBINDING_LAYER bindinglayer;
+	USHORT *keys;
+	struct_binding *values;
+
+	while (start < builder->count && builder->records[start].layer < layer) start++;
+	end = start;
+	while (end < builder->count && builder->records[end].layer == layer) end++;
+
+	entries = end - start;
+	if (entries == 0) return NULL;
+	if (entries > MAX_LAYER_BINDINGS) {
+		ErrorPrint(("kbfiltr: layer %u has %u bindings, the index holds %u\n", layer, entries, MAX_LAYER_BINDINGS));
+		builder->failed = TRUE;
+		return NULL;
+	}
+
+	size = sizeof(BINDING_LAYER) + ((entries * sizeof(USHORT) + 3) & ~3) + entries * sizeof(struct_binding);
+	bindinglayer = KbAllocateNonPaged(size);
+	if (bindinglayer == NULL) {
+		builder->failed = TRUE;
+		return NULL;
+	}
+	memset(bindinglayer, 0, size);
+
+	bindinglayer->Size = size;
+	bindinglayer->EntryCount = (USHORT)entries;
+	keys = BindingLayerKeys(bindinglayer);
+	values = BindingLayerValues(bindinglayer);
+
+	// records are sorted by key1, so the directory is a running count
+	ULONG key1 = 0;
+	for (i = 0; i < entries; i++) {
+		PBINDING_RECORD record = &builder->records[start + i];
+		while (key1 <= record->key1) bindinglayer->First[key1++] = (USHORT)i;
+		keys[i] = record->key2;
+		values[i] = record->value;
+	}
+	while (key1 <= MAX_KEYS) bindinglayer->First[key1++] = (USHORT)entries;
+
+	return bindinglayer;
+}
+
+VOID BindingBuilderFree(PBINDING_BUILDER builder) {
+	if (builder->records) KbFree(builder->records);
+	BindingBuilderInit(builder);
+}
+
+VOID BindingLayerFree(PBINDING_LAYER bindinglayer) {
+	if (bindinglayer) KbFree(bindinglayer);
+}
+
+//
+// Records the memory each layer actually uses into footprint[] and prints it
+// next to the dense table it replaces. Returns the total.
+//
+ULONG BindingIndexReport(PBINDING_LAYER layers[MAX_LAYERS], ULONG footprint[MAX_LAYERS]) {
+	ULONG total = 0;
+
+	for (USHORT i = 0; i < MAX_LAYERS; i++) {
+		footprint[i] = layers[i] ? layers[i]->Size : 0;
+		total += footprint[i];
+		DebugPrint(("kbfiltr: layer %u: %u bindings in %u bytes\n", i,
+			layers[i] ? layers[i]->EntryCount : 0, footprint[i]));
+	}
+	DebugPrint(("kbfiltr: binding index %u bytes, dense table was %u bytes\n",
+		total, (ULONG)(MAX_LAYERS * MAX_KEYS * MAX_KEYS * sizeof(struct_binding))));
+
+	return total;
+}
@@ -0,0 +1,99 @@
+/*++
+
+Module Name:
+
+    bindidx.h
+
+Abstract:
+
+    Sparse binding index. Each layer is compiled into one contiguous block:
+    a key1 directory followed by the sorted key2 column and the bindings
+    themselves, so a chord lookup touches the directory line, one line of
+    key2 values and the binding it finds, instead of a random line of the
+    old dense [MAX_LAYERS][MAX_KEYS][MAX_KEYS] table.
+
+    Block layout (all offsets relative to the start of the block):
+
+        BINDING_LAYER               header and key1 directory
+        USHORT Key2[EntryCount]     sorted per key1, padded to 4 bytes
+        struct_binding [EntryCount] binding for the key2 at the same index
+
+Environment:
+
+    kernel mode, or user mode on the host with KBF_HOST
+
+--*/
+
+#ifndef BINDIDX_H
+#define BINDIDX_H
+
+#define MAX_LAYER_BINDINGS	0xFFFF
+
+typedef struct _BINDING_LAYER {
+	ULONG  Size;					// bytes used by the whole block
+	USHORT EntryCount;
+	USHORT Reserved;
+	USHORT First[MAX_KEYS + 1];		// bindings of key1 are [First[key1], First[key1 + 1])
+} BINDING_LAYER, *PBINDING_LAYER;
+
+#define BindingLayerKeys(_l_) ((USHORT *)((UCHAR *)(_l_) + sizeof(BINDING_LAYER)))
+#define BindingLayerValues(_l_) ((struct_binding *)((UCHAR *)(_l_) + sizeof(BINDING_LAYER) + \
+	(((ULONG)(_l_)->EntryCount * sizeof(USHORT) + 3) & ~3)))
+
+// fields assigned by a builder record, unassigned fields keep the value of earlier records
+#define BIND_OUT1		0x01
+#define BIND_OUT2		0x02
+#define BIND_OUT3		0x04
+#define BIND_FLAG1		0x08
+#define BIND_ARG1		0x10
+
+typedef struct _BINDING_RECORD {
+	UCHAR  layer;
+	UCHAR  key1;
+	UCHAR  key2;
+	UCHAR  mask;
+	ULONG  seq;
+	struct_binding value;
+} BINDING_RECORD, *PBINDING_RECORD;
+
+// collects bindings in parse order, LoadConfig compiles one BINDING_LAYER per layer from it
+typedef struct _BINDING_BUILDER {
+	PBINDING_RECORD records;
+	ULONG count;
+	ULONG capacity;
+	BOOLEAN failed;
+} BINDING_BUILDER, *PBINDING_BUILDER;
+
+extern const struct_binding NoBinding;
+
+VOID BindingBuilderInit(PBINDING_BUILDER builder);
+BOOLEAN BindingBuilderSet(PBINDING_BUILDER builder, USHORT layer, USHORT key1, USHORT key2, USHORT mask, const struct_binding *value);
+VOID BindingBuilderFinish(PBINDING_BUILDER builder);
+PBINDING_LAYER BindingBuilderCompile(PBINDING_BUILDER builder, USHORT layer);
+VOID BindingBuilderFree(PBINDING_BUILDER builder);
+VOID BindingLayerFree(PBINDING_LAYER bindinglayer);
+ULONG BindingIndexReport(PBINDING_LAYER layers[MAX_LAYERS], ULONG footprint[MAX_LAYERS]);
+
+//
+// Returns the binding for key1 + key2, or NoBinding (all zero) when there is none
+//
+FORCEINLINE const struct_binding *BindingLookup(const BINDING_LAYER *bindinglayer, USHORT key1, USHORT key2) {
+	const USHORT *keys;
+	ULONG lo, hi;
+
+	if (bindinglayer == NULL || key1 >= MAX_KEYS) return &NoBinding;
+
+	lo = bindinglayer->First[key1];
+	hi = bindinglayer->First[key1 + 1];
+	keys = BindingLayerKeys(bindinglayer);
+
+	while (lo < hi) {
+		ULONG mid = (lo + hi) >> 1;
+		if (keys[mid] == key2) return &BindingLayerValues(bindinglayer)[mid];
+		if (keys[mid] < key2) lo = mid + 1;
+		else hi = mid;
+	}
+	return &NoBinding;
+}
+
+#endif  // BINDIDX_H
@@ -0,0 +1,266 @@
+/*--
+
+Module Name:
+
+    chordtrie.c
+
+Abstract: Builds the per-layer trie of chords of three or more keys. The
+          parser records every long chord line into a builder, which is
+          sorted once and compiled breadth first into one non-paged block
+          per layer, so the children of every node end up side by side in
+          key order and can be found by rank.
+
+Environment:
+
+    Kernel mode, or user mode on the host with KBF_HOST.
+
+--*/
+
+#include "kbtypes.h"
+#include "kbkeys.h"
+#include "bindidx.h"
+#include "chordtrie.h"
+
+#define BUILDER_GROW	64
+
+// records of the prefix a node stands for, while the layer is compiled
+typedef struct _CHORD_SPAN {
+	ULONG lo, hi;
+	ULONG depth;
+} CHORD_SPAN, *PCHORD_SPAN;
+
+VOID ChordBuilderInit(PCHORD_BUILDER builder) {
+	builder->records = NULL;
+	builder->count = 0;
+	builder->capacity = 0;
+	builder->failed = FALSE;
+}
+
+BOOLEAN ChordBuilderSet(PCHORD_BUILDER builder, USHORT layer, const USHORT *keys, ULONG length, USHORT mask, const struct_binding *value) {
+	if (layer >= MAX_LAYERS || length < 3 || length > CHORD_MAX) return FALSE;
+	for (ULONG i = 0; i < length; i++) if (keys[i] >= MAX_KEYS) return FALSE;
+
+	if (builder->count == builder->capacity) {
+		ULONG capacity = builder->capacity ? builder->capacity * 2 : BUILDER_GROW;
+		PCHORD_RECORD records = KbAllocatePaged(capacity * sizeof(CHORD_RECORD));
+		if (records == NULL) {
+			builder->failed = TRUE;
+			return FALSE;
+		}
+		if (builder->records) {
+			memcpy(records, builder->records, builder->count * sizeof(CHORD_RECORD));
+			KbFree(builder->records);
+		}
+		builder->records = records;
+		builder->capacity = capacity;
+	}
+
+	PCHORD_RECORD record = &builder->records[builder->count];
+	memset(record, 0, sizeof(CHORD_RECORD));
+	record->layer = (UCHAR)layer;
+	record->length = (UCHAR)length;
+	record->mask = (UCHAR)mask;
+	for (ULONG i = 0; i < length; i++) record->keys[i] = (UCHAR)keys[i];
+	record->seq = builder->count++;
+	record->value = *value;
+	return TRUE;
+}
+
+// layer, then the keys in order with a prefix before its extensions, then parse order
+static LONG RecordCompare(const CHORD_RECORD *a, const CHORD_RECORD *b) {
+	if (a->layer != b->layer) return (LONG)a->layer - b->layer;
+	for (ULONG i = 0; i < a->length && i < b->length; i++) {
+		if (a->keys[i] != b->keys[i]) return (LONG)a->keys[i] - b->keys[i];
+	}
+	if (a->length != b->length) return (LONG)a->length - b->length;
+	return 0;
+}
+
+static __inline BOOLEAN RecordLess(const CHORD_RECORD *a, const CHORD_RECORD *b) {
+	LONG order = RecordCompare(a, b);
+	return order ? order < 0 : a->seq < b->seq;
+}
+
+static VOID SiftDown(PCHORD_RECORD records, ULONG root, ULONG count) {
+	for (;;) {
+		ULONG child = root * 2 + 1;
+		if (child >= count) return;
+		if (child + 1 < count && RecordLess(&records[child], &records[child + 1])) child++;
+		if (!RecordLess(&records[root], &records[child])) return;
+		CHORD_RECORD t = records[root];
+		records[root] = records[child];
+		records[child] = t;
+		root = child;
+	}
+}
+
+//
+// Sorts the records and folds repeated chords into one record, later lines
+// override earlier ones field by field as they do for two key chords.
+//
+VOID ChordBuilderFinish(PCHORD_BUILDER builder) {
+	PCHORD_RECORD records = builder->records;
+	ULONG count = builder->count;
+	ULONG i, out;
+
+	if (count < 2) return;
+
+	for (i = count / 2; i-- > 0;) SiftDown(records, i, count);
+	for (i = count - 1; i > 0; i--) {
+		CHORD_RECORD t = records[0];
+		records[0] = records[i];
+		records[i] = t;
+		SiftDown(records, 0, i);
+	}
+
+	out = 0;
+	for (i = 1; i < count; i++) {
+		PCHORD_RECORD last = &records[out];
+		PCHORD_RECORD next = &records[i];
+		if (RecordCompare(last, next) == 0) {
+			if (next->mask & BIND_OUT1) last->value.out1 = next->value.out1;
+			if (next->mask & BIND_OUT2) last->value.out2 = next->value.out2;
+			if (next->mask & BIND_OUT3) last->value.out3 = next->value.out3;
+			if (next->mask & BIND_FLAG1) last->value.flag1 = next->value.flag1;
+			if (next->mask & BIND_ARG1) last->value.arg1 = next->value.arg1;
+			last->mask |= next->mask;
+		} else {
+			records[++out] = *next;
+		}
+	}
+	builder->count = out + 1;
+}
+
+// TRUE when a and b share their first depth keys
+static BOOLEAN SamePrefix(const CHORD_RECORD *a, const CHORD_RECORD *b, ULONG depth) {
+	if (a->length < depth || b->length < depth) return FALSE;
+	for (ULONG i = 0; i < depth; i++) if (a->keys[i] != b->keys[i]) return FALSE;
+	return TRUE;
+}
+
+//
+// Compiles the chords of one layer into a non-paged CHORD_TRIE block.
+// ChordBuilderFinish must have been called. Returns NULL for a layer without
+// long chords.
+//
+PCHORD_TRIE ChordBuilderCompile(PCHORD_BUILDER builder, USHORT layer) {
+	PCHORD_RECORD records = builder->records;
+	ULONG start = 0, end, i, nodecount, next, size;
+	PCHORD_SPAN spans;
+	PCHORD_TRIE trie;
+	PCHORD_NODE nodes;
+
+	while (start < builder->count && records[start].layer < layer) start++;
+	end = start;
+	while (end < builder->count && records[end].layer == layer) end++;
+	if (end == start) return NULL;
+
+	// one node per distinct prefix, plus the root
+	nodecount = 1;
+	for (i = start; i < end; i++) {
+		for (ULONG depth = 1; depth <= records[i].length; depth++) {
+			if (i == start || !SamePrefix(&records[i - 1], &records[i], depth)) nodecount++;
+		}
+	}
+
+	size = sizeof(CHORD_TRIE) + nodecount * sizeof(CHORD_NODE);
+	trie = KbAllocateNonPaged(size);
+	spans = KbAllocatePaged(nodecount * sizeof(CHORD_SPAN));
+	if (trie == NULL || spans == NULL) {
+		if (trie) KbFree(trie);
+		if (spans) KbFree(spans);
+		builder->failed = TRUE;
+		return NULL;
+	}
+	memset(trie, 0, size);
+	trie->Size = size;
+	trie->NodeCount = nodecount;
+	nodes = ChordTrieNodes(trie);
+
+	// breadth first: the children of a node are appended together, in key order
+	spans[0].lo = start;
+	spans[0].hi = end;
+	spans[0].depth = 0;
+	next = 1;
+	for (ULONG node = 0; node < next; node++) {
+		ULONG lo = spans[node].lo, hi = spans[node].hi, depth = spans[node].depth;
+		ULONG rank = 0;
+
+		// the chord ending here sorts before its extensions
+		while (lo < hi && records[lo].length == depth) nodes[node].Binding = records[lo++].value;
+
+		if (lo < hi) nodes[node].FirstChild = next;
+		while (lo < hi) {
+			UCHAR key = records[lo].keys[depth];
+			ULONG j = lo;
+
+			while (j < hi && records[j].keys[depth] == key) j++;
+			nodes[node].Next[key >> 5] |= 1UL << (key & 31);
+			spans[next].lo = lo;
+			spans[next].hi = j;
+			spans[next].depth = depth + 1;
+			next++;
+			lo = j;
+		}
+
+		for (ULONG w = 0; w < CHORD_WORDS; w++) {
+			nodes[node].Rank[w] = (UCHAR)rank;
+			rank += ChordBits(nodes[node].Next[w]);
+		}
+	}
+	KbFree(spans);
+
+	return trie;
+}
+
+VOID ChordBuilderFree(PCHORD_BUILDER builder) {
+	if (builder->records) KbFree(builder->records);
+	ChordBuilderInit(builder);
+}
+
+VOID ChordTrieFree(PCHORD_TRIE trie) {
+	if (trie) KbFree(trie);
+}
+
+//
+// A trie from an image is only walked after every child index is known to
+// stay inside the block. Children always come after their parent, so a walk
+// can neither leave the block nor loop.
+//
+BOOLEAN ChordTrieValid(const CHORD_TRIE *trie, ULONG size) {
+	const CHORD_NODE *nodes = ChordTrieNodes(trie);
+
+	if (size < sizeof(CHORD_TRIE) || trie->Size != size || trie->NodeCount == 0) return FALSE;
+	if (trie->NodeCount > (size - sizeof(CHORD_TRIE)) / sizeof(CHORD_NODE)) return FALSE;
+	if (size != sizeof(CHORD_TRIE) + trie->NodeCount * sizeof(CHORD_NODE)) return FALSE;
+
+	for (ULONG n = 0; n < trie->NodeCount; n++) {
+		ULONG children = 0;
+
+		for (ULONG w = 0; w < CHORD_WORDS; w++) {
+			if (nodes[n].Rank[w] != children) return FALSE;
+			children += ChordBits(nodes[n].Next[w]);
+		}
+		if (children == 0) {
+			if (nodes[n].FirstChild != CHORD_NONE) return FALSE;
+		} else if (nodes[n].FirstChild <= n || nodes[n].FirstChild > trie->NodeCount - children) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+//
+// Adds the memory of each layer's trie to footprint[] and returns the total
+//
+ULONG ChordTrieReport(PCHORD_TRIE tries[MAX_LAYERS], ULONG footprint[MAX_LAYERS]) {
+	ULONG total = 0;
+
+	for (USHORT i = 0; i < MAX_LAYERS; i++) {
+		if (tries[i] == NULL) continue;
+		footprint[i] += tries[i]->Size;
+		total += tries[i]->Size;
+		DebugPrint(("kbfiltr: layer %u: chord trie of %u nodes in %u bytes\n", i, tries[i]->NodeCount, tries[i]->Size));
+	}
+	return total;
+}
@@ -0,0 +1,122 @@
+/*++
+
+Module Name:
+
+    chordtrie.h
+
+Abstract:
+
+    Chords of three or more keys. Each layer's long chords are compiled
+    into one trie keyed by the successive held keys: node 0 is the empty
+    prefix, the children of a node are stored next to each other in key
+    order, and a 256 bit set per node tells whether a key continues the
+    prefix. The rank of the key within that set is the offset of its child,
+    so one step is a bit test and a population count, and a lookup costs
+    the same for every chord of the same length however many are bound.
+
+    Block layout (all offsets relative to the start of the block):
+
+        CHORD_TRIE                  header
+        CHORD_NODE [NodeCount]      breadth first, a node's children after it
+
+    Two key chords stay in the binding index; the trie only holds their
+    prefix nodes, so a two key prefix that can go on is known in one walk.
+
+Environment:
+
+    kernel mode, or user mode on the host with KBF_HOST
+
+--*/
+
+#ifndef CHORDTRIE_H
+#define CHORDTRIE_H
+
+#define CHORD_MAX			4		// keys in the longest chord
+#define CHORD_NONE			0		// the root is never a child, so its index means no node
+#define CHORD_WORDS			(MAX_KEYS / 32)
+
+typedef struct _CHORD_NODE {
+	ULONG  Next[CHORD_WORDS];		// keys that continue this prefix
+	UCHAR  Rank[CHORD_WORDS];		// children for the keys of the words before each word
+	ULONG  FirstChild;				// CHORD_NONE for a leaf
+	struct_binding Binding;			// output of the chord ending here, out1 == 0 on a plain prefix
+	USHORT Reserved;
+} CHORD_NODE, *PCHORD_NODE;
+
+typedef struct _CHORD_TRIE {
+	ULONG Size;						// bytes used by the whole block
+	ULONG NodeCount;
+} CHORD_TRIE, *PCHORD_TRIE;
+
+#define ChordTrieNodes(_t_) ((CHORD_NODE *)((UCHAR *)(_t_) + sizeof(CHORD_TRIE)))
+
+typedef struct _CHORD_RECORD {
+	UCHAR  layer;
+	UCHAR  length;
+	UCHAR  mask;
+	UCHAR  keys[CHORD_MAX];
+	ULONG  seq;
+	struct_binding value;
+} CHORD_RECORD, *PCHORD_RECORD;
+
+// collects chords of three or more keys in parse order, like the binding builder
+typedef struct _CHORD_BUILDER {
+	PCHORD_RECORD records;
+	ULONG count;
+	ULONG capacity;
+	BOOLEAN failed;
+} CHORD_BUILDER, *PCHORD_BUILDER;
+
+VOID ChordBuilderInit(PCHORD_BUILDER builder);
+BOOLEAN ChordBuilderSet(PCHORD_BUILDER builder, USHORT layer, const USHORT *keys, ULONG length, USHORT mask, const struct_binding *value);
+VOID ChordBuilderFinish(PCHORD_BUILDER builder);
+PCHORD_TRIE ChordBuilderCompile(PCHORD_BUILDER builder, USHORT layer);
+VOID ChordBuilderFree(PCHORD_BUILDER builder);
+VOID ChordTrieFree(PCHORD_TRIE trie);
+BOOLEAN ChordTrieValid(const CHORD_TRIE *trie, ULONG size);
+ULONG ChordTrieReport(PCHORD_TRIE tries[MAX_LAYERS], ULONG footprint[MAX_LAYERS]);
+
+FORCEINLINE ULONG ChordBits(ULONG v) {
+	v = v - ((v >> 1) & 0x55555555);
+	v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+	return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+//
+// Returns the child of node for key, or CHORD_NONE when key does not continue the prefix
+//
+FORCEINLINE ULONG ChordStep(const CHORD_TRIE *trie, ULONG node, USHORT key) {
+	const CHORD_NODE *n;
+	ULONG word, bit;
+
+	if (key >= MAX_KEYS) return CHORD_NONE;
+
+	n = &ChordTrieNodes(trie)[node];
+	word = n->Next[key >> 5];
+	bit = 1UL << (key & 31);
+	if ((word & bit) == 0) return CHORD_NONE;
+
+	return n->FirstChild + n->Rank[key >> 5] + ChordBits(word & (bit - 1));
+}
+
+//
+// Returns the node of the chord keys[0..length), or CHORD_NONE when no bound chord starts with it
+//
+FORCEINLINE ULONG ChordWalk(const CHORD_TRIE *trie, const USHORT *keys, ULONG length) {
+	ULONG node = CHORD_NONE;
+
+	if (trie == NULL) return CHORD_NONE;
+
+	for (ULONG i = 0; i < length; i++) {
+		node = ChordStep(trie, node, keys[i]);
+		if (node == CHORD_NONE) break;
+	}
+	return node;
+}
+
+// TRUE when a longer chord starts with the prefix of node
+FORCEINLINE BOOLEAN ChordContinues(const CHORD_TRIE *trie, ULONG node) {
+	return ChordTrieNodes(trie)[node].FirstChild != CHORD_NONE;
+}
+
+#endif  // CHORDTRIE_H
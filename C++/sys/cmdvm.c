@@ -0,0 +1,194 @@
+/*--
+
+Module Name:
+
+    cmdvm.c
+
+Abstract: Compiles the ~Q command programs. The parser hands the steps of
+          every ~Q line to a builder, and once the binding index is built
+          each layer's programs are resolved against its Q bindings into
+          one non-paged block of instructions per layer.
+
+Environment:
+
+    Kernel mode, or user mode on the host with KBF_HOST.
+
+--*/
+
+#include "kbtypes.h"
+#include "kbkeys.h"
+#include "bindidx.h"
+#include "chordtrie.h"
+#include "cmdvm.h"
+
+#define BUILDER_GROW	256
+
+VOID CmdBuilderInit(PCMD_BUILDER builder) {
+	memset(builder, 0, sizeof(CMD_BUILDER));
+}
+
+// Starts the steps of name over, for a ~Q line
+VOID CmdBuilderBegin(PCMD_BUILDER builder, USHORT name) {
+	if (name >= MAX_KEYS) name = 0;
+	builder->name = name;
+	builder->start[name] = builder->length;
+	builder->steps[name] = 0;
+}
+
+// Appends a step to the program the last CmdBuilderBegin started
+BOOLEAN CmdBuilderStep(PCMD_BUILDER builder, CHAR c) {
+	if (builder->length == builder->capacity) {
+		ULONG capacity = builder->capacity ? builder->capacity * 2 : BUILDER_GROW;
+		CHAR *text = KbAllocatePaged(capacity);
+		if (text == NULL) {
+			builder->failed = TRUE;
+			return FALSE;
+		}
+		if (builder->text) {
+			memcpy(text, builder->text, builder->length);
+			KbFree(builder->text);
+		}
+		builder->text = text;
+		builder->capacity = capacity;
+	}
+	builder->text[builder->length++] = c;
+	builder->steps[builder->name]++;
+	return TRUE;
+}
+
+//
+// Resolves the steps of name for a program starting in layer, into ops when
+// it isn't NULL. Returns the instructions, not counting the CMD_END.
+//
+static ULONG CompileProgram(PCMD_BUILDER builder, PBINDING_LAYER layers[MAX_LAYERS], const USHORT keymap[MAX_KEYS], USHORT layer, USHORT name, PCMD_OP ops) {
+	const CHAR *steps = builder->text + builder->start[name];
+	ULONG count = 0;
+
+	for (ULONG i = 0; i < builder->steps[name]; i++) {
+		USHORT key = keymap[(UCHAR)steps[i]];
+		const struct_binding *binding = BindingLookup(layers[layer], K_COMMAND, key);
+		CMD_OP op;
+
+		if (key == 0 || binding->out1 == 0) continue; // a step bound to nothing does nothing
+
+		memset(&op, 0, sizeof(CMD_OP));
+		if (binding->out1 == K_COMMAND) {
+			op.Op = CMD_CALL;
+			op.Arg = layer;
+			op.Binding.out2 = binding->out2;
+		} else if (binding->out1 == K_VARIABLE && binding->out2 == K_W) {
+			op.Op = CMD_WAIT;
+			op.Arg = binding->arg1;
+		} else {
+			op.Op = CMD_KEYS;
+			op.Binding = *binding;
+			if (binding->out1 == K_VARIABLE && binding->out2 == K_L && binding->arg1 < MAX_LAYERS) layer = binding->arg1;
+		}
+		if (ops) ops[count] = op;
+		count++;
+	}
+	return count;
+}
+
+//
+// Compiles the programs that start in layer into a non-paged CMD_PROGRAMS
+// block. The binding index of every layer must be built. Returns NULL for a
+// layer in which no program has a step bound to anything.
+//
+PCMD_PROGRAMS CmdBuilderCompile(PCMD_BUILDER builder, PBINDING_LAYER layers[MAX_LAYERS], const USHORT keymap[MAX_KEYS], USHORT layer) {
+	ULONG programcount = 0, opcount = 0, size, rank = 0;
+	PCMD_PROGRAMS programs;
+	ULONG *entries;
+	PCMD_OP ops;
+	USHORT name;
+
+	for (name = 0; name < MAX_KEYS; name++) {
+		ULONG count = CompileProgram(builder, layers, keymap, layer, name, NULL);
+		if (count == 0) continue;
+		programcount++;
+		opcount += count + 1;
+	}
+	if (programcount == 0) return NULL;
+
+	size = CmdProgramsSize(programcount, opcount);
+	programs = KbAllocateNonPaged(size);
+	if (programs == NULL) {
+		builder->failed = TRUE;
+		return NULL;
+	}
+	memset(programs, 0, size);
+	programs->Size = size;
+	programs->ProgramCount = programcount;
+	programs->OpCount = opcount;
+	ops = CmdOps(programs);
+	entries = CmdEntries(programs);
+
+	programcount = opcount = 0;
+	for (name = 0; name < MAX_KEYS; name++) {
+		ULONG count = CompileProgram(builder, layers, keymap, layer, name, &ops[opcount]);
+		if (count == 0) continue;
+		programs->Names[name >> 5] |= 1UL << (name & 31);
+		entries[programcount++] = opcount;
+		opcount += count;
+		ops[opcount++].Op = CMD_END;
+	}
+
+	for (ULONG w = 0; w < CHORD_WORDS; w++) {
+		programs->Rank[w] = (UCHAR)rank;
+		rank += ChordBits(programs->Names[w]);
+	}
+	return programs;
+}
+
+VOID CmdBuilderFree(PCMD_BUILDER builder) {
+	if (builder->text) KbFree(builder->text);
+	CmdBuilderInit(builder);
+}
+
+VOID CmdProgramsFree(PCMD_PROGRAMS programs) {
+	if (programs) KbFree(programs);
+}
+
+//
+// Programs from an image are only run once every entry and call is known to
+// stay inside the block. The last instruction is a CMD_END, so a program
+// can't run past the end of the block either.
+//
+BOOLEAN CmdProgramsValid(const CMD_PROGRAMS *programs, ULONG size) {
+	const CMD_OP *ops = CmdOps(programs);
+	ULONG count = 0;
+
+	if (size < sizeof(CMD_PROGRAMS) || programs->Size != size || programs->OpCount == 0) return FALSE;
+	if (programs->OpCount > size / sizeof(CMD_OP) || programs->ProgramCount > MAX_KEYS) return FALSE;
+	if (size != CmdProgramsSize(programs->ProgramCount, programs->OpCount)) return FALSE;
+
+	for (ULONG w = 0; w < CHORD_WORDS; w++) {
+		if (programs->Rank[w] != count) return FALSE;
+		count += ChordBits(programs->Names[w]);
+	}
+	if (count != programs->ProgramCount) return FALSE;
+
+	for (ULONG p = 0; p < programs->ProgramCount; p++) {
+		if (CmdEntries(programs)[p] >= programs->OpCount) return FALSE;
+	}
+	for (ULONG n = 0; n < programs->OpCount; n++) {
+		if (ops[n].Op > CMD_CALL || (ops[n].Op == CMD_CALL && ops[n].Arg >= MAX_LAYERS)) return FALSE;
+	}
+	return ops[programs->OpCount - 1].Op == CMD_END;
+}
+
+//
+// Adds the memory of each layer's programs to footprint[] and returns the total
+//
+ULONG CmdProgramsReport(PCMD_PROGRAMS programs[MAX_LAYERS], ULONG footprint[MAX_LAYERS]) {
+	ULONG total = 0;
+
+	for (USHORT i = 0; i < MAX_LAYERS; i++) {
+		if (programs[i] == NULL) continue;
+		footprint[i] += programs[i]->Size;
+		total += programs[i]->Size;
+		DebugPrint(("kbfiltr: layer %u: %u command programs of %u instructions in %u bytes\n",
+			i, programs[i]->ProgramCount, programs[i]->OpCount, programs[i]->Size));
+	}
+	return total;
+}
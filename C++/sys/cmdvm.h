@@ -0,0 +1,110 @@
+/*++
+
+Module Name:
+
+    cmdvm.h
+
+Abstract:
+
+    ~Q command programs. A ~Q line names a program and lists its steps,
+    each step a key whose Q binding (Qe IA1) is what it does. Instead of
+    looking every step up again each time the program runs, the steps of
+    every program are resolved at load time, for each layer the program
+    may start in, into a short run of fixed size instructions: the keys of
+    a binding, a ~ command, a wait or a call of another program. The
+    engine runs them a few at a time, so a program has no step limit and
+    never holds up the callback.
+
+    A ~l step changes the layer the steps after it are resolved in, as it
+    changes the layer the engine is in when the program runs.
+
+    Block layout (all offsets relative to the start of the block):
+
+        CMD_PROGRAMS                header, with the set of program names
+        CMD_OP [OpCount]            the programs one after another, each ending in CMD_END
+        ULONG Entries[ProgramCount] first instruction of each program, in name order
+
+Environment:
+
+    kernel mode, or user mode on the host with KBF_HOST
+
+--*/
+
+#ifndef CMDVM_H
+#define CMDVM_H
+
+#define CMD_NONE			0xFFFFFFFF	// no program of that name
+#define CMD_DEPTH			8		// nested calls, a call deeper than that is skipped
+#define CMD_STEPS_MAX		4096	// instructions one run may take, ends a program that calls itself
+#define CMD_BUDGET			16		// instructions per engine call, the rest waits for the next one
+
+// instructions
+#define CMD_END				0		// back to the caller, or the end of the program
+#define CMD_KEYS			1		// Binding typed out like any other binding, or its ~ command run
+#define CMD_WAIT			2		// Arg ms before the next instruction, a ~w step
+#define CMD_CALL			3		// the program Binding.out2 of layer Arg, a step bound to another Q program
+
+typedef struct _CMD_OP {
+	USHORT Op;
+	USHORT Arg;
+	struct_binding Binding;
+	USHORT Reserved;
+} CMD_OP, *PCMD_OP;
+
+typedef struct _CMD_PROGRAMS {
+	ULONG Size;						// bytes used by the whole block
+	ULONG ProgramCount;
+	ULONG OpCount;
+	ULONG Reserved;
+	ULONG Names[CHORD_WORDS];		// keys that name a program
+	UCHAR Rank[CHORD_WORDS];		// programs named by the keys of the words before each word
+} CMD_PROGRAMS, *PCMD_PROGRAMS;
+
+#define CmdOps(_p_) ((CMD_OP *)((UCHAR *)(_p_) + sizeof(CMD_PROGRAMS)))
+#define CmdEntries(_p_) ((ULONG *)((UCHAR *)(_p_) + sizeof(CMD_PROGRAMS) + (_p_)->OpCount * sizeof(CMD_OP)))
+#define CmdProgramsSize(_programs_, _ops_) \
+	(sizeof(CMD_PROGRAMS) + (_ops_) * sizeof(CMD_OP) + (((_programs_) * sizeof(ULONG) + 7) & ~7))
+
+// where a running program is, one per nested call
+typedef struct _CMD_FRAME {
+	USHORT Layer;					// the block Pc is in
+	USHORT Reserved;
+	ULONG Pc;
+} CMD_FRAME, *PCMD_FRAME;
+
+// the step text of the ~Q lines, a later line for a name replaces the earlier one
+typedef struct _CMD_BUILDER {
+	CHAR *text;
+	ULONG length;
+	ULONG capacity;
+	ULONG start[MAX_KEYS];			// of each name's steps in text
+	ULONG steps[MAX_KEYS];			// 0 for a name no ~Q line defined
+	USHORT name;					// of the line being read
+	BOOLEAN failed;
+} CMD_BUILDER, *PCMD_BUILDER;
+
+VOID CmdBuilderInit(PCMD_BUILDER builder);
+VOID CmdBuilderBegin(PCMD_BUILDER builder, USHORT name);
+BOOLEAN CmdBuilderStep(PCMD_BUILDER builder, CHAR c);
+PCMD_PROGRAMS CmdBuilderCompile(PCMD_BUILDER builder, PBINDING_LAYER layers[MAX_LAYERS], const USHORT keymap[MAX_KEYS], USHORT layer);
+VOID CmdBuilderFree(PCMD_BUILDER builder);
+VOID CmdProgramsFree(PCMD_PROGRAMS programs);
+BOOLEAN CmdProgramsValid(const CMD_PROGRAMS *programs, ULONG size);
+ULONG CmdProgramsReport(PCMD_PROGRAMS programs[MAX_LAYERS], ULONG footprint[MAX_LAYERS]);
+
+//
+// Returns the first instruction of the program name, or CMD_NONE when the layer has none of that name
+//
+FORCEINLINE ULONG CmdProgram(const CMD_PROGRAMS *programs, USHORT name) {
+	ULONG word, bit;
+
+	if (programs == NULL || name >= MAX_KEYS) return CMD_NONE;
+
+	word = programs->Names[name >> 5];
+	bit = 1UL << (name & 31);
+	if ((word & bit) == 0) return CMD_NONE;
+
+	return CmdEntries(programs)[programs->Rank[name >> 5] + ChordBits(word & (bit - 1))];
+}
+
+#endif  // CMDVM_H
@@ -0,0 +1,767 @@
+/*--
+
+Module Name:
+
+    kbconfig.c
+
+Abstract: Parses kbfiltr.txt into a KB_TABLES set. Used by LoadConfig when
+          no compiled image is installed and by the host compiler, so both
+          produce the same tables from the same text.
+
+Environment:
+
+    Kernel mode, or user mode on the host with KBF_HOST.
+
+--*/
+
+#include "kbtypes.h"
+#include "kbkeys.h"
+#include "bindidx.h"
+#include "chordtrie.h"
+#include "seqdfa.h"
+#include "cmdvm.h"
+#include "kbconfig.h"
+
+#define ConfigError(_parser_, _x_) do { (_parser_)->errors++; ErrorPrint(_x_); } while (0)
+
+#define MAX_TIME		0xFFFFFFFF	// us, the longest time KbParseTime reads
+
+// bytes of a phrase in a PHRASE_BLOCK: its length, its text and a 0, kept USHORT aligned
+#define PhraseEntrySize(_length_) ((sizeof(USHORT) + (_length_) + 2) & ~1)
+
+// character classes of the tokenizer
+#define CC_TEXT			0	// a key, or part of a binding
+#define CC_SPACE		1
+#define CC_SKIP			2	// dropped wherever it is
+#define CC_EOL			3
+#define CC_COMMENT		4	// " up to the end of the line
+#define CC_SEQUENCE		5	// > in column 0 starts a sequence
+
+static const UCHAR CharClass[256] = {
+	/* 00 */ CC_EOL, 0, 0, 0, 0, 0, 0, 0, 0, CC_SKIP, CC_EOL, 0, 0, CC_SKIP, 0, 0,
+	/* 10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 20 */ CC_SPACE, 0, CC_COMMENT, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 30 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, CC_SEQUENCE, 0,
+	// the rest is CC_TEXT
+};
+
+// tokenizer states
+#define PS_START		0	// column 0
+#define PS_KEYS			1	// key positions of a binding or ~ line
+#define PS_SEQUENCE		2	// keys of a > line
+#define PS_BINDING		3	// the rest of the line, collected into cmd
+#define PS_COMMENT		4	// nothing more to read on this line
+#define PS_PHRASE		5	// number of a ~i line
+#define PS_PHRASE_TEXT	6	// the rest of a ~i line, " included
+#define PS_PHRASE_ESCAPE	7	// the character after a \ in the text
+#define PS_PROGRAM		8	// name of a ~Q line
+#define PS_PROGRAM_STEPS	9	// the steps of a ~Q line, as many as it has
+
+static ULONG ParseNumber(const CHAR *str) {
+	ULONG value = 0;
+
+	while (*str == ' ') str++;
+	while (*str >= '0' && *str <= '9') value = value * 10 + (*str++ - '0');
+
+	return value;
+}
+
+//
+// Returns a configured time in microseconds, the number is in ms unless
+// followed by u. A time past what a ULONG of microseconds holds, about 71
+// minutes, is reported and read as the longest one.
+//
+ULONG KbParseTime(PKB_PARSER parser, const CHAR *str) {
+	ULONG value = 0;
+	BOOLEAN overflow = FALSE;
+
+	while (*str == ' ') str++;
+	while (*str >= '0' && *str <= '9') {
+		ULONG digit = *str++ - '0';
+
+		if (value > (MAX_TIME - digit) / 10) overflow = TRUE;
+		else value = value * 10 + digit;
+	}
+	if (*str != 'u') {
+		if (value > MAX_TIME / 1000) overflow = TRUE;
+		else value *= 1000;
+	}
+
+	if (overflow) {
+		ConfigError(parser, ("kbfiltr.txt(%u): time too long, the longest is %u ms\n", parser->line, MAX_TIME / 1000));
+		return MAX_TIME;
+	}
+	return value;
+}
+
+static USHORT HexDigit(PKB_PARSER parser, USHORT c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 0x0A;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 0x0A;
+
+	ConfigError(parser, ("kbfiltr.txt(%u): '%c' is not a hex digit\n", parser->line, (char)c));
+	return 0;
+}
+
+// keymap lookup for a key or output position, reports characters that map to no key
+static USHORT KeyCode(PKB_PARSER parser, USHORT c) {
+	USHORT key = parser->tables->keymap[(UCHAR)c];
+
+	if (key == 0) ConfigError(parser, ("kbfiltr.txt(%u): '%c' is not a key\n", parser->line, (char)c));
+	return key;
+}
+
+VOID KbDefaultKeymap(USHORT keymap[MAX_KEYS]) {
+	memset(keymap, 0, MAX_KEYS * sizeof(USHORT));
+
+	// some special characters for system settings
+	// settings in the config file overrides the default
+	keymap['~'] = K_VARIABLE; // Or for command it means internal command/function call
+
+	keymap[' '] = ' ';
+
+	// Non-obvious keys
+	keymap['A'] = K_LALT;
+	keymap['B'] = K_BACKSPACE;
+	keymap['C'] = K_LCTRL;
+	keymap['D'] = K_DEL;
+	keymap['E'] = K_ESC;
+	keymap['F'] = K_CAPSLOCK;
+	keymap['G'] = K_RSHIFT;
+	keymap['I'] = K_LSHIFT;
+	keymap['H'] = K_LEFT;
+	keymap['J'] = K_DOWN;
+	keymap['K'] = K_UP;
+	keymap['L'] = K_RIGHT;
+	keymap['M'] = K_INS;
+	keymap['N'] = K_ENTER;
+	keymap['O'] = K_HOME;
+	keymap['P'] = K_END;
+	keymap['Q'] = K_COMMAND;
+	keymap['R'] = K_RSHIFT;
+	keymap['S'] = K_SPACE;
+	keymap['T'] = K_TAB;
+	keymap['U'] = K_PGUP;
+	keymap['V'] = K_PGDN;
+	keymap['W'] = K_LWIN;
+	keymap['X'] = K_NUMLOCK;
+	keymap['Z'] = K_SCROLLLOCK;
+	//keymap[' '] = K_SPACE;
+	//keymap['\n'] = K_ENTER;
+
+	// F keys
+	keymap['!'] = K_F1;
+	keymap['@'] = K_F2;
+	keymap['#'] = K_F3;
+	keymap['$'] = K_F4;
+	keymap['%'] = K_F5;
+	keymap['^'] = K_F6;
+	keymap['&'] = K_F7;
+	keymap['*'] = K_F8;
+	keymap['('] = K_F9;
+	keymap[')'] = K_F10;
+	keymap['_'] = K_F11;
+	keymap['+'] = K_F12;
+
+
+	// alphas
+	keymap['a'] = K_A;
+	keymap['b'] = K_B;
+	keymap['c'] = K_C;
+	keymap['d'] = K_D;
+	keymap['e'] = K_E;
+	keymap['f'] = K_F;
+	keymap['g'] = K_G;
+	keymap['h'] = K_H;
+	keymap['i'] = K_I;
+	keymap['j'] = K_J;
+	keymap['k'] = K_K;
+	keymap['l'] = K_L;
+	keymap['m'] = K_M;
+	keymap['n'] = K_N;
+	keymap['o'] = K_O;
+	keymap['p'] = K_P;
+	keymap['q'] = K_Q;
+	keymap['r'] = K_R;
+	keymap['s'] = K_S;
+	keymap['t'] = K_T;
+	keymap['u'] = K_U;
+	keymap['v'] = K_V;
+	keymap['w'] = K_W;
+	keymap['x'] = K_X;
+	keymap['y'] = K_Y;
+	keymap['z'] = K_Z;
+
+	// numerics
+	keymap['0'] = K_0;
+	keymap['1'] = K_1;
+	keymap['2'] = K_2;
+	keymap['3'] = K_3;
+	keymap['4'] = K_4;
+	keymap['5'] = K_5;
+	keymap['6'] = K_6;
+	keymap['7'] = K_7;
+	keymap['8'] = K_8;
+	keymap['9'] = K_9;
+
+	// punctuations
+	keymap['`'] = K_TILDA;
+	keymap['-'] = K_MINUS;
+	keymap['='] = K_EQUAL;
+	keymap['['] = K_SQUARE_L;
+	keymap[']'] = K_SQUARE_R;
+	keymap['\\'] = K_BACKSLASH;
+	keymap[';'] = K_SEMICOLON;
+	keymap['\''] = K_QUOTE;
+	keymap[','] = K_COMMA;
+	keymap['.'] = K_PERIOD;
+	keymap['/'] = K_SLASH;
+}
+
+VOID KbDefaultSettings(PKB_SETTINGS settings) {
+	settings->key_bind_time = 156000; // us
+	settings->longkey_time = 156000; 
+	settings->key_bind_timeout = 781000;  
+	settings->key_repeat_time = 469000;
+	settings->safe_mode = SETTING_ON;
+	settings->capslock_to_lshift = SETTING_OFF;
+}
+
+PKB_TABLES KbTablesAllocate() {
+	PKB_TABLES tables = KbAllocateNonPaged(sizeof(KB_TABLES));
+
+	if (tables == NULL) return NULL;
+
+	memset(tables, 0, sizeof(KB_TABLES));
+	KbDefaultKeymap(tables->keymap);
+	KbDefaultSettings(&tables->Settings);
+	return tables;
+}
+
+//
+// The blocks of a table set by slot: the binding layers, then the chord
+// tries, the sequence DFAs and the ~Q programs of each layer, and last the
+// phrases. Every block starts with its ULONG Size.
+//
+#define TABLE_BLOCKS	(4 * MAX_LAYERS + 1)
+#define PHRASE_SLOT		(4 * MAX_LAYERS)
+
+static PVOID *TablesBlock(PKB_TABLES tables, ULONG slot) {
+	if (slot < MAX_LAYERS) return (PVOID *)&tables->Layers[slot];
+	if (slot < 2 * MAX_LAYERS) return (PVOID *)&tables->Chords[slot - MAX_LAYERS];
+	if (slot < 3 * MAX_LAYERS) return (PVOID *)&tables->Sequences[slot - 2 * MAX_LAYERS];
+	if (slot < 4 * MAX_LAYERS) return (PVOID *)&tables->Programs[slot - 3 * MAX_LAYERS];
+	return (PVOID *)&tables->Phrases;
+}
+
+VOID KbTablesFree(PKB_TABLES tables) {
+	if (tables == NULL) return;
+
+	if (tables->Image) {
+		KbFree(tables->Image);
+	} else {
+		for (ULONG slot = 0; slot < TABLE_BLOCKS; slot++) {
+			PVOID block = *TablesBlock(tables, slot);
+			if (block && (tables->Borrowed & (1UL << slot)) == 0) KbFree(block);
+		}
+	}
+	KbFree(tables);
+}
+
+//
+// Profiles are often copies of one config with a few layers changed. Every
+// block of tables that is byte for byte the same as a block of the same kind
+// in others[0..count) is replaced by that one and its own copy freed. An
+// image is first moved into separate blocks, it can only go once nothing
+// points into it. The profiles must be freed together, KbTablesFree leaves
+// the borrowed blocks to their owner. Returns the bytes saved.
+//
+ULONG KbTablesShare(PKB_TABLES tables, PKB_TABLES others[], ULONG count) {
+	PVOID found[TABLE_BLOCKS];
+	PVOID image;
+	ULONG slot, saved = 0;
+
+	for (slot = 0; slot < TABLE_BLOCKS; slot++) {
+		PVOID block = *TablesBlock(tables, slot);
+		ULONG first = slot - slot % MAX_LAYERS, last = (slot < PHRASE_SLOT) ? first + MAX_LAYERS : TABLE_BLOCKS;
+
+		found[slot] = NULL;
+		if (block == NULL) continue;
+		for (ULONG i = 0; i < count && found[slot] == NULL; i++) {
+			if (others[i] == NULL) continue;
+			for (ULONG n = first; n < last; n++) {
+				PVOID other = *TablesBlock(others[i], n);
+				if (other && *(PULONG)other == *(PULONG)block && memcmp(other, block, *(PULONG)block) == 0) {
+					found[slot] = other;
+					saved += *(PULONG)block;
+					break;
+				}
+			}
+		}
+	}
+	if (saved == 0) return 0;
+
+	// the shared blocks of an image go with it
+	image = tables->Image;
+	if (image) {
+		PVOID copies[TABLE_BLOCKS];
+
+		for (slot = 0; slot < TABLE_BLOCKS; slot++) {
+			PVOID block = *TablesBlock(tables, slot);
+
+			copies[slot] = NULL;
+			if (block == NULL || found[slot]) continue;
+			copies[slot] = KbAllocateNonPaged(*(PULONG)block);
+			if (copies[slot] == NULL) { // keeps the image, nothing shared
+				while (slot-- > 0) if (copies[slot]) KbFree(copies[slot]);
+				return 0;
+			}
+			memcpy(copies[slot], block, *(PULONG)block);
+		}
+		for (slot = 0; slot < TABLE_BLOCKS; slot++) {
+			if (copies[slot]) *TablesBlock(tables, slot) = copies[slot];
+		}
+		tables->Image = NULL;
+	}
+
+	for (slot = 0; slot < TABLE_BLOCKS; slot++) {
+		if (found[slot] == NULL) continue;
+		if (image == NULL && (tables->Borrowed & (1UL << slot)) == 0) KbFree(*TablesBlock(tables, slot));
+		*TablesBlock(tables, slot) = found[slot];
+		tables->Borrowed |= 1UL << slot;
+	}
+	if (image) KbFree(image);
+	return saved;
+}
+
+static VOID PhraseBuilderFree(PPHRASE_BUILDER builder) {
+	if (builder->text) KbFree(builder->text);
+	builder->text = NULL;
+}
+
+BOOLEAN KbConfigBegin(PKB_PARSER parser) {
+	memset(parser, 0, sizeof(KB_PARSER));
+	BindingBuilderInit(&parser->builder);
+	ChordBuilderInit(&parser->chords);
+	SeqBuilderInit(&parser->sequences);
+	CmdBuilderInit(&parser->programs);
+	parser->line = 1;
+	parser->seqtimeout = SEQ_DEFAULT_TIMEOUT;
+
+	parser->tables = KbTablesAllocate();
+	return parser->tables != NULL;
+}
+
+VOID KbConfigAbort(PKB_PARSER parser) {
+	BindingBuilderFree(&parser->builder);
+	ChordBuilderFree(&parser->chords);
+	SeqBuilderFree(&parser->sequences);
+	CmdBuilderFree(&parser->programs);
+	PhraseBuilderFree(&parser->phrases);
+	KbTablesFree(parser->tables);
+	parser->tables = NULL;
+}
+
+// TRUE when the binding of the line is given as HEX codes
+static BOOLEAN HexBinding(PKB_PARSER parser) {
+	return parser->cmdlen >= 4 && parser->cmd[0] != '~';
+}
+
+//
+// Reads the output part of a binding line from cmd, returns the fields it assigns
+//
+static USHORT ParseBinding(PKB_PARSER parser, struct_binding *binding) {
+	CHAR *cmd = parser->cmd;
+	USHORT mask = 0;
+
+	if (HexBinding(parser)) { // key binding by HEX codes 
+		// 2 byte HEX codes = 4 characters
+		//example E05B = LWIN
+		binding->out1 = (HexDigit(parser, cmd[2]) << 4) + HexDigit(parser, cmd[3]);
+		binding->flag1 = (HexDigit(parser, cmd[0]) << 4) + HexDigit(parser, cmd[1]);
+		return BIND_OUT1 | BIND_FLAG1 | BIND_OUT2;
+	}
+
+	if (cmd[0]) {
+		binding->out1 = KeyCode(parser, cmd[0]);
+		mask |= BIND_OUT1 | BIND_FLAG1;
+	}
+	if (cmd[1]) {
+		binding->out2 = KeyCode(parser, cmd[1]);
+		mask |= BIND_OUT2;
+	}
+	if (cmd[2]) {
+		binding->out3 = KeyCode(parser, cmd[2]);
+		mask |= BIND_OUT3;
+	}
+	if (cmd[3] && cmd[3] != ' ') { // the number of a ~ command, ~w 250
+		binding->arg1 = (USHORT)ParseNumber(&cmd[3]);
+		mask |= BIND_ARG1;
+	}
+	return mask;
+}
+
+//
+// Records a > sequence line for every layer it applies to
+//
+static VOID ParseSequence(PKB_PARSER parser) {
+	int start_layer = 0, end_layer = MAX_LAYERS - 1;
+	struct_binding binding = { 0, 0, 0, 0, 0 };
+	USHORT mask;
+
+	if (parser->seqlen < 2) {
+		ConfigError(parser, ("kbfiltr.txt(%u): a sequence needs at least 2 keys\n", parser->line));
+		return;
+	}
+
+	mask = ParseBinding(parser, &binding);
+	if (mask == 0) return;
+
+	if (parser->layer != ALL_LAYERS) start_layer = end_layer = parser->layer;
+	for (int i = start_layer; i <= end_layer; i++) {
+		SeqBuilderSet(&parser->sequences, i, parser->seq, parser->seqlen, parser->seqtimeout, mask, &binding);
+	}
+}
+
+//
+// Handles one complete line, the characters after the key positions are in cmd
+//
+static VOID ParseLine(PKB_PARSER parser) {
+	PKB_TABLES tables = parser->tables;
+	PBINDING_BUILDER builder = &parser->builder;
+	CHAR *cmd = parser->cmd;
+	USHORT key1 = parser->key1, key2 = parser->key2;
+
+	if (parser->sequence) {
+		ParseSequence(parser);
+		return;
+	}
+
+	if (key1 == 0) return;
+
+	if (key1 == K_VARIABLE) { // ~ 
+		// use the file to set some system variables
+		// numbers are read straight out of cmd
+		const char *str = cmd;
+
+		// Key bind time, times are in ms or in us with a u suffix: ~t 12 or ~t 800u
+		if (key2 == K_T) {
+			tables->Settings.key_bind_time = KbParseTime(parser, str);
+		} else if (key2 == K_D) { // longkey time
+			tables->Settings.longkey_time = KbParseTime(parser, str);
+		} else if (key2 == K_R) {// key repeat time
+			tables->Settings.key_repeat_time = KbParseTime(parser, str);
+		} else if (key2 == K_O) {// key timeout
+			tables->Settings.key_bind_timeout = KbParseTime(parser, str);
+		} else if (key2 == K_E) {// time allowed between the keys of the sequences that follow
+			parser->seqtimeout = KbParseTime(parser, str);
+		} else if (key2 == K_S) {// safe mode during config load 1 = on 0 = off 
+			tables->Settings.safe_mode = ParseNumber(str);
+		} else if (key2 == K_C) {// 1 capslock works as left shift, 0 use capslock as normal 
+			tables->Settings.capslock_to_lshift = ParseNumber(str);
+		} else if (key2 == K_L) { // set binding layer 
+		 // all layers
+			if (str[0] == '*') {
+				parser->layer = ALL_LAYERS;
+			} else {
+				ULONG value = ParseNumber(str);
+				if (value >= MAX_LAYERS) ConfigError(parser, ("kbfiltr.txt(%u): layer %u, the last layer is %u\n", parser->line, value, MAX_LAYERS - 1));
+				parser->layer = (INT)((value < MAX_LAYERS - 1) ? value : MAX_LAYERS - 1);
+			}
+		} else if (key2 == K_COMMAND) {// command program, the tokenizer has stored its steps
+		} else if (key2 == K_I) {// phrase, the tokenizer has stored its text
+		} else {
+			// TODO control mouse buttons and movement
+		}
+	} else {
+		int start_layer = 0, end_layer = MAX_LAYERS - 1;
+		if (parser->layer != ALL_LAYERS) start_layer = end_layer = parser->layer;
+		struct_binding enabled = { K_BOUND, 0, 0, 0, 0 };
+		struct_binding binding = { 0, 0, 0, 0, 0 };
+		USHORT mask = ParseBinding(parser, &binding);
+
+		if (key2 == K_UNDEFINED && !HexBinding(parser)) key2 = K_SINGLE; // HEX codes keep key2 as it is
+
+		for (int i = start_layer; i <= end_layer; i++) {
+			if (mask & BIND_OUT1) BindingBuilderSet(builder, i, key1, K_ENABLED, BIND_OUT1, &enabled);
+			if (mask == 0) continue;
+
+			if (parser->keys > 2) ChordBuilderSet(&parser->chords, i, parser->chord, parser->keys, mask, &binding); // 3+ key chord
+			else BindingBuilderSet(builder, i, key1, key2, mask, &binding);
+		}
+	}
+}
+
+//
+// Handles the line that just ended and starts the next one. Only the part of
+// cmd the line wrote is cleared.
+//
+static VOID EndLine(PKB_PARSER parser) {
+	ParseLine(parser);
+	memset(parser->cmd, 0, ((parser->cmdlen < CMD_LEN - 1) ? parser->cmdlen : CMD_LEN - 1) * sizeof(CHAR));
+
+	parser->cmdlen = parser->keys = parser->seqlen = 0;
+	parser->phrase = parser->phraselen = 0;
+	parser->key2 = parser->key1 = K_UNDEFINED;
+	parser->sequence = FALSE;
+	parser->line++;
+}
+
+// Starts the text of a ~i line, a later definition replaces an earlier one
+static VOID PhraseBegin(PKB_PARSER parser) {
+	PPHRASE_BUILDER builder = &parser->phrases;
+
+	if (builder->text == NULL && !builder->failed) {
+		builder->text = KbAllocatePaged(PHRASE_MAX * PHRASE_LEN);
+		if (builder->text == NULL) builder->failed = TRUE;
+	}
+	if (builder->text == NULL) return;
+
+	memset(builder->text + parser->phrase * PHRASE_LEN, 0, PHRASE_LEN);
+	builder->defined |= 1UL << parser->phrase;
+}
+
+// Appends a character to the text of the ~i line being read
+static VOID PhraseChar(PKB_PARSER parser, CHAR c) {
+	if (parser->phraselen < PHRASE_LEN - 1) {
+		if (parser->phrases.text) parser->phrases.text[parser->phrase * PHRASE_LEN + parser->phraselen] = c;
+	} else if (parser->phraselen == PHRASE_LEN - 1) {
+		ConfigError(parser, ("kbfiltr.txt(%u): a phrase has at most %u characters\n", parser->line, PHRASE_LEN - 1));
+	}
+	parser->phraselen++;
+}
+
+//
+// Parses the next piece of the file, a line may be split over any number of calls.
+// One pass, one class lookup per character: the tokenizer state carries over
+// between calls, so a chunk may end anywhere in a line.
+//
+// syntax: 
+// " signifies start of comment
+// # hold <a> then <;> to trigger <enter>
+// a; N	" hold a + ; = enter
+// af E " hold a + f = esc 
+// ~l 1	" set layer to 1, subsequent bindings will be for this layer 1
+// ~l 2	" set layer to 2, subsequent bindings will be for this layer 2
+// ~l 0	" set layer to 0, subsequent bindings will be for this layer 0
+// ~l * " set for all layers 
+// vj ~l 0 " ~ = function call, l = change layer, 0 = argument (layer 0)
+// j  2	" single key binding: key<space><space>binding
+// jj e " key hold binding: hold j for long key time for 'e' binding
+// qwe CIE " 3+ key chord: hold q, then w, then e, up to CHORD_MAX keys
+// >Zgt Ct " sequence: tap ScrollLock, g, t one after another, up to SEQ_MAX keys
+// ~e 800 " time allowed between the keys of the sequences that follow, in ms
+// ~i 3 Dear Sir or Madam,\n " phrase 3 is the rest of the line, \n for Enter and \t for Tab
+// Zp ~i 3 " types out phrase 3
+// ~Q e0we " command program e: the Q bindings of its steps (Q0 ~l 0, Qw ~w 100), one after another
+// cj Qe " runs program e, a step bound to Qx calls program x
+//
+VOID KbConfigParse(PKB_PARSER parser, const CHAR *text, ULONG length) {
+	UCHAR state = parser->state;
+
+	for (ULONG i = 0; i < length; i++) {
+		CHAR c = text[i];
+		UCHAR cc = CharClass[(UCHAR)c];
+
+		if (cc == CC_SKIP) continue;
+		if (cc == CC_EOL) {
+			EndLine(parser);
+			state = PS_START;
+			continue;
+		}
+
+		switch (state) {
+		case PS_START:
+			if (cc == CC_TEXT) {
+				parser->key1 = parser->chord[0] = KeyCode(parser, c);
+				parser->keys = 1;
+				state = PS_KEYS;
+			} else if (cc == CC_SEQUENCE) {
+				parser->sequence = TRUE;
+				state = PS_SEQUENCE;
+			} else { // a comment, or a line starting with a space which has no keys
+				state = PS_COMMENT;
+			}
+			break;
+
+		case PS_KEYS: // key positions run up to the first space
+			if (cc == CC_COMMENT) {
+				state = PS_COMMENT;
+			} else if (cc == CC_SPACE) {
+				if (parser->key1 == K_VARIABLE && parser->key2 == K_I) state = PS_PHRASE;
+				else if (parser->key1 == K_VARIABLE && parser->key2 == K_COMMAND) state = PS_PROGRAM;
+				else state = PS_BINDING;
+			} else if (parser->keys < CHORD_MAX && (parser->keys < 2 || parser->key1 != K_VARIABLE)) {
+				USHORT key = KeyCode(parser, c);
+				parser->chord[parser->keys++] = key;
+				if (parser->keys == 2) parser->key2 = key;
+			} else { // the column after the last key position separates, whatever it holds
+				state = PS_BINDING;
+			}
+			break;
+
+		case PS_SEQUENCE: // >keys<space>binding
+			if (cc == CC_COMMENT) {
+				state = PS_COMMENT;
+			} else if (cc == CC_SPACE) {
+				state = PS_BINDING;
+			} else if (parser->seqlen < SEQ_MAX) {
+				parser->seq[parser->seqlen++] = KeyCode(parser, c);
+			} else { // drop the line
+				ConfigError(parser, ("kbfiltr.txt(%u): a sequence has at most %u keys\n", parser->line, SEQ_MAX));
+				parser->sequence = FALSE;
+				state = PS_COMMENT;
+			}
+			break;
+
+		case PS_BINDING:
+			if (cc == CC_COMMENT) {
+				state = PS_COMMENT;
+			} else {
+				if (parser->cmdlen < CMD_LEN - 1) parser->cmd[parser->cmdlen] = c;
+				parser->cmdlen++;
+			}
+			break;
+
+		case PS_PHRASE: // ~i number<space>text
+			if (c >= '0' && c <= '9' && parser->phrase < PHRASE_MAX) {
+				parser->phrase = parser->phrase * 10 + (c - '0');
+			} else if (cc == CC_SPACE && parser->phrase < PHRASE_MAX) {
+				PhraseBegin(parser);
+				state = PS_PHRASE_TEXT;
+			} else {
+				ConfigError(parser, ("kbfiltr.txt(%u): ~i takes a phrase number below %u and its text\n", parser->line, PHRASE_MAX));
+				state = PS_COMMENT;
+			}
+			break;
+
+		case PS_PHRASE_TEXT:
+			if (c == '\\') state = PS_PHRASE_ESCAPE;
+			else PhraseChar(parser, c);
+			break;
+
+		case PS_PHRASE_ESCAPE:
+			PhraseChar(parser, (c == 'n') ? '\n' : (c == 't') ? '\t' : c);
+			state = PS_PHRASE_TEXT;
+			break;
+
+		case PS_PROGRAM: // ~Q name steps
+			if (cc == CC_COMMENT) {
+				state = PS_COMMENT;
+			} else if (cc == CC_TEXT) {
+				CmdBuilderBegin(&parser->programs, KeyCode(parser, c));
+				state = PS_PROGRAM_STEPS;
+			}
+			break;
+
+		case PS_PROGRAM_STEPS: // spaces only separate
+			if (cc == CC_COMMENT) {
+				state = PS_COMMENT;
+			} else if (cc == CC_TEXT) {
+				KeyCode(parser, c);
+				CmdBuilderStep(&parser->programs, c);
+			}
+			break;
+
+		case PS_COMMENT:
+			break;
+		}
+	}
+	parser->state = state;
+}
+
+// Packs the defined phrases into a block sized to their text, NULL when there are none
+static PPHRASE_BLOCK PhraseBuilderCompile(PPHRASE_BUILDER builder) {
+	PPHRASE_BLOCK block;
+	ULONG size = sizeof(PHRASE_BLOCK), p;
+
+	if (builder->text == NULL || builder->defined == 0) return NULL;
+
+	for (p = 0; p < PHRASE_MAX; p++) {
+		if (builder->defined & (1UL << p)) size += PhraseEntrySize(strlen(builder->text + p * PHRASE_LEN));
+	}
+
+	block = KbAllocateNonPaged(size);
+	if (block == NULL) {
+		builder->failed = TRUE;
+		return NULL;
+	}
+	memset(block, 0, size);
+	block->Size = size;
+
+	size = sizeof(PHRASE_BLOCK);
+	for (p = 0; p < PHRASE_MAX; p++) {
+		const CHAR *text = builder->text + p * PHRASE_LEN;
+		USHORT length = (USHORT)strlen(text);
+
+		if ((builder->defined & (1UL << p)) == 0) continue;
+		block->Offset[p] = (USHORT)size;
+		memcpy((PUCHAR)block + size, &length, sizeof(USHORT));
+		memcpy((PUCHAR)block + size + sizeof(USHORT), text, length);
+		size += PhraseEntrySize(length);
+	}
+	return block;
+}
+
+//
+// A phrase block from an image is only used once every phrase is known to
+// be a length and a 0 terminated text inside the block.
+//
+BOOLEAN PhraseBlockValid(const PHRASE_BLOCK *block, ULONG size) {
+	if (size < sizeof(PHRASE_BLOCK) || block->Size != size) return FALSE;
+
+	for (ULONG p = 0; p < PHRASE_MAX; p++) {
+		ULONG offset = block->Offset[p];
+		USHORT length;
+
+		if (offset == 0) continue;
+		if (offset < sizeof(PHRASE_BLOCK) || offset % sizeof(USHORT) || offset + sizeof(USHORT) > size) return FALSE;
+
+		length = *(const USHORT *)((const UCHAR *)block + offset);
+		if (length >= PHRASE_LEN || offset + sizeof(USHORT) + length >= size) return FALSE;
+		if (((const UCHAR *)block)[offset + sizeof(USHORT) + length] != 0) return FALSE;
+	}
+	return TRUE;
+}
+
+//
+// Ends the last line and compiles the binding index, the chord tries, the
+// sequence DFAs, the ~Q programs and the phrases. Returns the finished
+// tables, or NULL (with the parser cleaned up) when memory ran out.
+//
+PKB_TABLES KbConfigEnd(PKB_PARSER parser) {
+	PKB_TABLES tables = parser->tables;
+
+	KbConfigParse(parser, "\n", 1); // end the last line even when the file doesn't
+
+	BindingBuilderFinish(&parser->builder);
+	ChordBuilderFinish(&parser->chords);
+	SeqBuilderFinish(&parser->sequences);
+	for (USHORT n = 0; n < MAX_LAYERS; n++) {
+		tables->Layers[n] = BindingBuilderCompile(&parser->builder, n);
+		tables->Chords[n] = ChordBuilderCompile(&parser->chords, n);
+		tables->Sequences[n] = SeqBuilderCompile(&parser->sequences, n);
+	}
+	for (USHORT n = 0; n < MAX_LAYERS; n++) { // steps are resolved in whatever layer a ~l step leads to
+		tables->Programs[n] = CmdBuilderCompile(&parser->programs, tables->Layers, tables->keymap, n);
+	}
+	tables->Phrases = PhraseBuilderCompile(&parser->phrases);
+
+	if (parser->builder.failed || parser->chords.failed || parser->sequences.failed || parser->programs.failed ||
+		parser->phrases.failed) {
+		KbConfigAbort(parser);
+		return NULL;
+	}
+	BindingBuilderFree(&parser->builder);
+	ChordBuilderFree(&parser->chords);
+	SeqBuilderFree(&parser->sequences);
+	CmdBuilderFree(&parser->programs);
+	PhraseBuilderFree(&parser->phrases);
+
+	BindingIndexReport(tables->Layers, tables->Footprint);
+	ChordTrieReport(tables->Chords, tables->Footprint);
+	SeqDfaReport(tables->Sequences, tables->Footprint);
+	CmdProgramsReport(tables->Programs, tables->Footprint);
+	parser->tables = NULL;
+	return tables;
+}
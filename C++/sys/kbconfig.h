@@ -0,0 +1,110 @@
+/*++
+
+Module Name:
+
+    kbconfig.h
+
+Abstract:
+
+    kbfiltr.txt parser shared by the driver (fallback when no compiled
+    image is installed) and the host compiler. Text is fed in chunks of
+    any size, the parser keeps its line state between them, and the
+    result is a complete KB_TABLES set.
+
+Environment:
+
+    kernel mode, or user mode on the host with KBF_HOST
+
+--*/
+
+#ifndef KBCONFIG_H
+#define KBCONFIG_H
+
+// ~ settings of the config file, times in microseconds
+typedef struct _KB_SETTINGS {
+	ULONG key_bind_time;
+	ULONG longkey_time;
+	ULONG key_repeat_time;
+	ULONG key_bind_timeout;
+	ULONG safe_mode;
+	ULONG capslock_to_lshift;
+} KB_SETTINGS, *PKB_SETTINGS;
+
+// everything built from one config, published as a whole with one pointer swap
+//
+// The ~i phrases of a table set in one block sized to their text. Each
+// defined phrase is a USHORT length followed by its characters and a 0.
+//
+typedef struct _PHRASE_BLOCK {
+	ULONG Size;						// bytes used by the whole block
+	USHORT Offset[PHRASE_MAX];		// of each phrase from the start of the block, 0 when it isn't defined
+} PHRASE_BLOCK, *PPHRASE_BLOCK;
+
+// ~i text while the config is parsed, a PHRASE_LEN slot per phrase allocated at the first ~i line
+typedef struct _PHRASE_BUILDER {
+	PCHAR text;
+	ULONG defined;					// a bit per phrase a ~i line set
+	BOOLEAN failed;
+} PHRASE_BUILDER, *PPHRASE_BUILDER;
+
+typedef struct _KB_TABLES {
+	PBINDING_LAYER Layers[MAX_LAYERS];		// sparse binding index, one block per layer
+	PCHORD_TRIE Chords[MAX_LAYERS];			// chords of three or more keys, NULL when a layer has none
+	PSEQ_DFA Sequences[MAX_LAYERS];			// > sequences, NULL when a layer has none
+	PCMD_PROGRAMS Programs[MAX_LAYERS];		// ~Q programs starting in each layer, NULL when a layer has none
+	PPHRASE_BLOCK Phrases;					// ~i phrases, NULL when there are none
+	ULONG Footprint[MAX_LAYERS];			// bytes used by each layer of the index, its trie, DFA and programs
+	PVOID Image;							// image the layers point into, NULL when built from text
+	ULONG Borrowed;							// blocks owned by another profile, a bit per slot, see KbTablesShare
+	KB_SETTINGS Settings;
+	USHORT keymap[MAX_KEYS];				// config character to scan code
+} KB_TABLES, *PKB_TABLES;
+
+typedef struct _KB_PARSER {
+	PKB_TABLES tables;
+	BINDING_BUILDER builder;
+	CHORD_BUILDER chords;
+	SEQ_BUILDER sequences;
+	CMD_BUILDER programs;
+	PHRASE_BUILDER phrases;
+	CHAR cmd[CMD_LEN];		// binding part of the line, always 0 terminated
+	ULONG cmdlen;
+	ULONG line;				// line number for error messages
+	ULONG errors;
+	INT layer;				// layer set by the last ~l, or ALL_LAYERS
+	USHORT key1, key2;
+	USHORT chord[CHORD_MAX];	// key positions of the line, key1 and key2 are the first two
+	ULONG keys;					// key positions read so far
+	USHORT seq[SEQ_MAX];		// keys of a > sequence line
+	ULONG seqlen;
+	ULONG seqtimeout;			// us, set by the last ~e
+	BOOLEAN sequence;			// the line started with >
+	ULONG phrase;				// number of a ~i line
+	ULONG phraselen;			// characters of its text so far
+	UCHAR state;				// tokenizer state at the end of the last chunk
+} KB_PARSER, *PKB_PARSER;
+
+BOOLEAN KbConfigBegin(PKB_PARSER parser);
+VOID KbConfigParse(PKB_PARSER parser, const CHAR *text, ULONG length);
+PKB_TABLES KbConfigEnd(PKB_PARSER parser);
+VOID KbConfigAbort(PKB_PARSER parser);
+
+PKB_TABLES KbTablesAllocate();
+VOID KbTablesFree(PKB_TABLES tables);
+ULONG KbTablesShare(PKB_TABLES tables, PKB_TABLES others[], ULONG count);
+VOID KbDefaultKeymap(USHORT keymap[MAX_KEYS]);
+VOID KbDefaultSettings(PKB_SETTINGS settings);
+ULONG KbParseTime(PKB_PARSER parser, const CHAR *str);
+BOOLEAN PhraseBlockValid(const PHRASE_BLOCK *block, ULONG size);
+
+// Text of a phrase and its length, NULL when the phrase isn't defined
+FORCEINLINE const CHAR *PhraseText(const PHRASE_BLOCK *block, ULONG phrase, PULONG length) {
+	const UCHAR *entry;
+
+	if (block == NULL || phrase >= PHRASE_MAX || block->Offset[phrase] == 0) return NULL;
+	entry = (const UCHAR *)block + block->Offset[phrase];
+	*length = *(const USHORT *)entry;
+	return (const CHAR *)entry + sizeof(USHORT);
+}
+
+#endif  // KBCONFIG_H
@@ -0,0 +1,572 @@
+/*--
+
+Module Name:
+
+    kbengine.c
+
+Abstract: The binding engine: single key remaps, key1 + key2 chords, longer
+          chords from the chord trie, > sequences from the sequence DFA,
+          hold bindings, key repeat, the internal ~ commands and the
+          interpreter of the ~Q programs. Called by the
+          service callback and the hold timer in the driver and by the
+          host tools, with the caller's time in 100ns units.
+
+Environment:
+
+    Kernel mode, or user mode on the host with KBF_HOST.
+
+--*/
+
+#include "kbtypes.h"
+#include "kbkeys.h"
+#include "bindidx.h"
+#include "chordtrie.h"
+#include "seqdfa.h"
+#include "cmdvm.h"
+#include "kbconfig.h"
+#include "kbengine.h"
+
+keydata Keydata(USHORT k, USHORT f) {
+	keydata o;
+	o.key = k;
+	o.flag = f;
+	return o;
+}
+
+static __inline VOID Emit(PKB_ENGINE engine, USHORT key, USHORT flag) {
+	if (engine->kcount < MAX_KEYOUT) engine->keyout[engine->kcount++] = Keydata(key, flag);
+}
+
+// characters of the main block on a US layout by row, plain and with shift, from the row's first key
+static const struct {
+	USHORT first;
+	const char *plain;
+	const char *shifted;
+} TextRows[] = {
+	{ K_1, "1234567890-=", "!@#$%^&*()_+" },
+	{ K_Q, "qwertyuiop[]", "QWERTYUIOP{}" },
+	{ K_A, "asdfghjkl;'`", "ASDFGHJKL:\"~" },
+	{ K_BACKSLASH, "\\zxcvbnm,./", "|ZXCVBNM<>?" },
+};
+
+//
+// Writes the packets that type c into out, shift around the key when the
+// character needs it. Returns how many, 0 for a character no key types.
+//
+ULONG KbTextKeys(CHAR c, keydata out[4]) {
+	USHORT key = 0;
+	BOOLEAN shift = FALSE;
+	ULONG n = 0;
+
+	if (c == ' ') key = K_SPACE;
+	else if (c == '\n') key = K_ENTER;
+	else if (c == '\t') key = K_TAB;
+
+	for (ULONG row = 0; key == 0 && row < sizeof(TextRows) / sizeof(TextRows[0]); row++) {
+		for (ULONG i = 0; TextRows[row].plain[i]; i++) {
+			if (TextRows[row].plain[i] == c || TextRows[row].shifted[i] == c) {
+				key = TextRows[row].first + (USHORT)i;
+				shift = TextRows[row].shifted[i] == c;
+				break;
+			}
+		}
+	}
+	if (key == 0) return 0;
+
+	if (shift) out[n++] = Keydata(K_LSHIFT, KEY_MAKE);
+	out[n++] = Keydata(key, KEY_MAKE);
+	out[n++] = Keydata(key, KEY_BREAK);
+	if (shift) out[n++] = Keydata(K_LSHIFT, KEY_BREAK);
+	return n;
+}
+
+VOID KbEngineInit(PKB_ENGINE engine, const KB_SETTINGS *settings) {
+	memset(engine, 0, sizeof(KB_ENGINE));
+	engine->pause = FALSE;
+	KbEngineSettings(engine, settings);
+}
+
+// Takes over the thresholds of a table set, the settings are in microseconds
+VOID KbEngineSettings(PKB_ENGINE engine, const KB_SETTINGS *settings) {
+	engine->key_bind_time = (LONGLONG)settings->key_bind_time * 10;
+	engine->longkey_time = (LONGLONG)settings->longkey_time * 10;
+	engine->key_repeat_time = (LONGLONG)settings->key_repeat_time * 10;
+	engine->key_bind_timeout = (LONGLONG)settings->key_bind_timeout * 10;
+}
+
+// Leaves an event for the driver to pass on, the newest are lost when the caller doesn't keep up
+static VOID Notice(PKB_ENGINE engine, USHORT type, USHORT command, USHORT arg) {
+	PKB_NOTICE notice;
+
+	if (engine->ncount == MAX_NOTICES) return;
+
+	notice = &engine->notices[engine->ncount++];
+	notice->type = type;
+	notice->layer = engine->layer;
+	notice->command = command;
+	notice->arg = arg;
+}
+
+static VOID Command(PKB_ENGINE engine, USHORT cmd, struct_binding binding) {
+	switch (cmd) {
+	case K_L: // layer change
+		if (binding.arg1 < MAX_LAYERS) engine->layer = binding.arg1;
+		break;
+
+	case K_P: // pause keyboard
+		if (engine->pause == FALSE) engine->pause = TRUE;
+		else engine->pause = FALSE;
+		break;
+
+	case K_R: // Reload config file
+		engine->reload = TRUE;
+		break;
+
+	case K_F: // switch to another profile, a config file loaded next to this one
+		if (binding.arg1 < MAX_PROFILES) {
+			engine->profile = binding.arg1;
+			engine->profilechange = TRUE;
+		}
+		break;
+
+	case K_I: // type out a phrase, the driver plays it a chunk at a time
+		if (binding.arg1 < PHRASE_MAX) {
+			engine->phrase = binding.arg1;
+			engine->play = TRUE;
+		}
+		break;
+
+	case K_W: // a wait between the steps of a ~Q program, compiled into the program
+		return;
+	}
+	Notice(engine, (cmd == K_L) ? NOTICE_LAYER : NOTICE_COMMAND, cmd, binding.arg1);
+}
+
+static VOID Keyoutput(PKB_ENGINE engine, const struct_binding *binding) {
+	if (binding->out1 == K_VARIABLE) { // binding starting with ~ is an internal command
+		Command(engine, binding->out2, *binding);
+	} else if (binding->out3) { // 3 key output
+		Emit(engine, binding->out1, KEY_MAKE);
+		Emit(engine, binding->out2, KEY_MAKE);
+		Emit(engine, binding->out3, KEY_MAKE);
+		Emit(engine, binding->out3, KEY_BREAK);
+		Emit(engine, binding->out2, KEY_BREAK);
+		Emit(engine, binding->out1, KEY_BREAK);
+	} else if (binding->out2) { // 2 key output
+		Emit(engine, binding->out1, KEY_MAKE);
+		Emit(engine, binding->out2, KEY_MAKE);
+		Emit(engine, binding->out2, KEY_BREAK);
+		Emit(engine, binding->out1, KEY_BREAK);
+	} else { // 1 key output
+		Emit(engine, binding->out1, KEY_MAKE | binding->flag1);
+		Emit(engine, binding->out1, KEY_BREAK | binding->flag1);
+	}
+}
+
+// Enters the program name of layer, skipped when there is none or the calls are too deep
+static VOID CmdCall(PKB_ENGINE engine, PKB_TABLES tables, USHORT layer, USHORT name) {
+	ULONG entry = CmdProgram(tables->Programs[layer], name);
+
+	if (entry == CMD_NONE || engine->cmddepth == CMD_DEPTH) return;
+
+	engine->cmdstack[engine->cmddepth].Layer = layer;
+	engine->cmdstack[engine->cmddepth].Pc = entry;
+	engine->cmddepth++;
+}
+
+//
+// Runs the ~Q program until it ends, waits, or has taken CMD_BUDGET
+// instructions in this call; the rest runs from KbEngineTimeout at cmdresume.
+// An instruction emits at most six keys, so a call's worth fits in keyout.
+//
+static VOID CmdRun(PKB_ENGINE engine, PKB_TABLES tables) {
+	engine->cmdresume = 0;
+
+	for (ULONG budget = 0; engine->cmddepth; budget++) {
+		PCMD_FRAME frame = &engine->cmdstack[engine->cmddepth - 1];
+		const CMD_PROGRAMS *programs = tables->Programs[frame->Layer];
+		const CMD_OP *op;
+
+		// the tables were replaced while the program waited, or it ran too long
+		if (programs == NULL || frame->Pc >= programs->OpCount || engine->cmdsteps == CMD_STEPS_MAX) {
+			engine->cmddepth = 0;
+			return;
+		}
+		if (budget == CMD_BUDGET) {
+			engine->cmdresume = engine->now;
+			return;
+		}
+
+		op = &CmdOps(programs)[frame->Pc++];
+		engine->cmdsteps++;
+		switch (op->Op) {
+		case CMD_END:
+			engine->cmddepth--;
+			break;
+
+		case CMD_KEYS:
+			Keyoutput(engine, &op->Binding);
+			break;
+
+		case CMD_WAIT:
+			engine->cmdresume = engine->now + (LONGLONG)op->Arg * 10000;
+			return;
+
+		case CMD_CALL:
+			CmdCall(engine, tables, op->Arg, op->Binding.out2);
+			break;
+		}
+	}
+}
+
+// Emits a binding into keyout, FALSE for an internal command which has no output
+static BOOLEAN Chordoutput(PKB_ENGINE engine, PKB_TABLES tables, const struct_binding *binding) {
+	engine->fired++;
+	if (binding->out1 == K_VARIABLE || binding->out1 == K_COMMAND) engine->path = PATH_COMMAND;
+	if (binding->out1 == K_VARIABLE) { // binding starting with ~ is an internal command
+		Command(engine, binding->out2, *binding);
+		return FALSE;
+	} else if (binding->out1 == K_COMMAND) { // ~Q program out2, replaces one still running
+		engine->cmddepth = 0;
+		engine->cmdsteps = 0;
+		CmdCall(engine, tables, engine->layer, binding->out2);
+		if (engine->cmddepth) Notice(engine, NOTICE_PROGRAM, binding->out2, 0);
+		CmdRun(engine, tables);
+	} else {
+		Keyoutput(engine, binding);
+	}
+	return TRUE;
+}
+
+// Emits the binding for key1 + key2 into keyout, FALSE for an internal command which has no output
+static BOOLEAN Bindingoutput(PKB_ENGINE engine, PKB_TABLES tables, USHORT key1, USHORT key2) {
+	return Chordoutput(engine, tables, BINDING(tables, engine->layer, key1, key2));
+}
+
+//
+// Starts waiting for a longer chord when key1 + keyp is the prefix of one
+//
+static BOOLEAN ChordOpen(PKB_ENGINE engine, PKB_TABLES tables, USHORT keyp) {
+	engine->chord[0] = engine->key1;
+	engine->chord[1] = keyp;
+	if (ChordWalk(tables->Chords[engine->layer], engine->chord, 2) == CHORD_NONE) return FALSE;
+
+	engine->chordlen = 2;
+	engine->key2 = keyp;
+	engine->outputed = 1;
+	engine->deadline = 0;
+	return TRUE;
+}
+
+//
+// Ends the pending chord with the binding of the keys held so far, the
+// key1 + key2 binding for a two key prefix. A prefix bound to nothing is
+// typed out as the keys it was made of, like an unbound key1 + key2.
+// The trie is walked again from the keys, the tables may have been
+// replaced since the chord was opened.
+//
+static VOID ChordResolve(PKB_ENGINE engine, PKB_TABLES tables) {
+	const struct_binding *binding = &NoBinding;
+
+	if (engine->chordlen == 2) {
+		binding = BINDING(tables, engine->layer, engine->chord[0], engine->chord[1]);
+	} else {
+		ULONG node = ChordWalk(tables->Chords[engine->layer], engine->chord, engine->chordlen);
+		if (node != CHORD_NONE) binding = &ChordTrieNodes(tables->Chords[engine->layer])[node].Binding;
+	}
+
+	if (binding->out1) {
+		Chordoutput(engine, tables, binding);
+	} else {
+		for (USHORT i = 0; i < engine->chordlen; i++) {
+			Emit(engine, engine->chord[i], KEY_MAKE); Emit(engine, engine->chord[i], KEY_BREAK);
+		}
+		engine->key1 = 0;
+	}
+	engine->key2 = 0;
+	engine->chordlen = 0;
+}
+
+//
+// Feeds an event to the pending chord. Returns TRUE when the chord took it,
+// with any output in keyout, FALSE when the event is to be handled as usual
+// after the chord, which may have ended and left its output in keyout.
+//
+static BOOLEAN ChordInput(PKB_ENGINE engine, PKB_TABLES tables, USHORT keyp, USHORT keystate) {
+	if ((keystate & KEY_BREAK) == KEY_BREAK) {
+		for (USHORT i = 0; i < engine->chordlen; i++) {
+			if (engine->chord[i] == keyp) { // releasing any key of the chord ends it
+				ChordResolve(engine, tables);
+				return keyp != engine->key1; // a key1 release still has to clear key1
+			}
+		}
+		return FALSE;
+	}
+
+	if (keyp == engine->chord[engine->chordlen - 1]) return TRUE; // key repeat of the newest key
+
+	if (engine->chordlen < CHORD_MAX) {
+		const CHORD_TRIE *trie = tables->Chords[engine->layer];
+		ULONG node;
+
+		engine->chord[engine->chordlen] = keyp;
+		node = ChordWalk(trie, engine->chord, engine->chordlen + 1);
+		if (node != CHORD_NONE) {
+			engine->chordlen++;
+			if (!ChordContinues(trie, node)) ChordResolve(engine, tables); // nothing longer to wait for
+			return TRUE;
+		}
+	}
+
+	// keyp is not part of the chord, which ends where it is
+	ChordResolve(engine, tables);
+	return FALSE;
+}
+
+//
+// Ends the running sequence with the binding of its state, or types out the
+// keys it took when it stopped short of one.
+//
+static VOID SequenceEnd(PKB_ENGINE engine, PKB_TABLES tables) {
+	const SEQ_DFA *dfa = tables->Sequences[engine->layer];
+	const struct_binding *binding = &NoBinding;
+
+	if (dfa && engine->seqstate < dfa->StateCount) binding = &SeqDfaStates(dfa)[engine->seqstate].Binding;
+
+	if (binding->out1) {
+		Chordoutput(engine, tables, binding);
+	} else {
+		for (USHORT i = 0; i < engine->seqlen; i++) {
+			Emit(engine, engine->seq[i], KEY_MAKE); Emit(engine, engine->seq[i], KEY_BREAK);
+		}
+	}
+	engine->seqlen = 0;
+	engine->seqstate = SEQ_NONE;
+	engine->deadline = 0;
+}
+
+//
+// Feeds an event to the sequence DFA, one transition per key press. Returns
+// TRUE when the DFA took the event, with any output in keyout. A key without
+// a transition ends the running sequence and may start the next one, it is
+// never matched against the keys that came before it.
+//
+static BOOLEAN SequenceInput(PKB_ENGINE engine, PKB_TABLES tables, USHORT keyp, USHORT keystate, LONGLONG time) {
+	const SEQ_DFA *dfa = tables->Sequences[engine->layer];
+	ULONG state = SEQ_NONE;
+
+	if ((keystate & KEY_BREAK) == KEY_BREAK) { // the releases of the taps it took
+		for (USHORT i = 0; i < engine->seqlen; i++) if (engine->seq[i] == keyp) return TRUE;
+		return FALSE;
+	}
+
+	// the tables were replaced while the sequence ran
+	if (engine->seqlen && (dfa == NULL || engine->seqstate >= dfa->StateCount)) SequenceEnd(engine, tables);
+
+	if (dfa && engine->seqlen < SEQ_MAX) state = SeqStep(dfa, engine->seqstate, keyp);
+	if (state != SEQ_NONE) {
+		const SEQ_STATE *s = &SeqDfaStates(dfa)[state];
+
+		engine->seq[engine->seqlen++] = keyp;
+		engine->seqstate = state;
+		if (s->Timeout) engine->deadline = time + (LONGLONG)s->Timeout * 10;
+		else SequenceEnd(engine, tables); // a final state, nothing longer to wait for
+		return TRUE;
+	}
+
+	if (engine->seqlen == 0) return FALSE;
+
+	SequenceEnd(engine, tables);
+	return SequenceInput(engine, tables, keyp, keystate, time);
+}
+
+//
+// Runs one input event through the engine. Returns TRUE when the event is to
+// be passed on as it is in *event (a single key remap rewrites it), FALSE when
+// it is replaced by keyout[0..kcount), which may be empty.
+//
+BOOLEAN KbEngineInput(PKB_ENGINE engine, PKB_TABLES tables, keydata *event, LONGLONG time) {
+	USHORT processbinding = FALSE, longkeybinding = 0;
+	USHORT keyp = event->key;
+	USHORT keystate = event->flag;
+	USHORT layer = engine->layer;
+	ULONG flushed;
+
+	engine->kcount = 0;
+	engine->now = time;
+	engine->path = PATH_PASS;
+
+	if (keyp == 0) return FALSE;
+
+	if (layer == 0) {
+		if (BINDING(tables, layer, keyp, K_SINGLE)->out1) {
+			// single key pre-filters
+			engine->path = PATH_REMAP;
+			event->key = keyp = BINDING(tables, layer, keyp, K_SINGLE)->out1;
+			event->flag = event->flag | ((keyp >= K_HOME) ? KEY_E0 : 0);
+		}
+	}
+
+	// sequences start from an idle engine, no hold or chord under way
+	if ((engine->seqlen || (engine->key1 == 0 && engine->chordlen == 0)) &&
+		SequenceInput(engine, tables, keyp, keystate, time)) {
+		if (engine->pause == TRUE) engine->kcount = 0;
+		return FALSE;
+	}
+	flushed = engine->kcount; // the keys of a sequence this one ended
+
+	if (engine->chordlen && ChordInput(engine, tables, keyp, keystate)) {
+		if (engine->kcount == 0) return FALSE; // the chord is still open
+	} else if ((keystate & KEY_BREAK) == KEY_BREAK) {
+		if (keyp == engine->key1) { // at this point keyp is non-zero, key1 pressed and being released
+			if (engine->key2 == 0) { // at this point key1 is non-zero, no binding started
+				if (0 && BINDING(tables, layer, engine->key1, engine->key1)->out1) { // long hold key binding
+					if ((time - engine->khold) >= engine->longkey_time) {
+						engine->key1 = engine->key2 = keyp;
+						processbinding = TRUE;
+						longkeybinding = TRUE;
+					}
+				}
+
+				if (engine->outputed == 0) {
+					Emit(engine, engine->key1, KEY_MAKE);
+					Emit(engine, engine->key1, KEY_BREAK);
+				}
+			}
+
+			engine->key1 = 0;
+			engine->khold = 0;
+			engine->outputed = 0;
+		}
+
+	} else if ((keystate & KEY_MAKE) == KEY_MAKE) {
+		if (engine->key1 == 0) {
+
+			// no key binding when starting with shift key
+			if ((keyp != K_LSHIFT) && (keyp != K_RSHIFT)) {
+				if (BINDING(tables, layer, keyp, K_ENABLED)->out1) { // binding found, start the wait
+					engine->key1 = keyp;
+					if (BINDING(tables, layer, engine->key1, K_SINGLE)->out1) { // check if it's a key combo or a single-single key binding
+						engine->key2 = K_SINGLE;
+						processbinding = TRUE;
+						engine->outputed = 1;
+					} else { // hold key1 and wait for key2 press
+						engine->khold = time;
+						engine->deadline = time + engine->key_bind_timeout;
+						return FALSE;
+					}
+				} else {
+					engine->key2 = 0;
+					engine->khold = 0;
+				}
+			}
+
+		} else { // key1 != 0
+			if (keyp == engine->key1) { // key holding
+				if (!BINDING(tables, layer, engine->key1, engine->key1)->out1) { // long key binding not found
+					if ((time - engine->khold) >= engine->key_repeat_time) {
+						// if key has been held for longer than repeat time then do nothing and let the key through for native repeating
+						engine->outputed = 1;
+						engine->deadline = 0;
+						Emit(engine, engine->key1, KEY_MAKE); Emit(engine, engine->key1, KEY_BREAK);
+					} else {
+						return FALSE;
+					}
+				}
+
+				if (engine->kcount == 0) {
+					if ((time - engine->khold) >= engine->key_bind_time) {
+						engine->outputed = 1;
+					}
+					return FALSE; // key1 is still holding waiting for long hold key binding
+				}
+
+			} else if ((time - engine->khold) >= engine->key_bind_time && ChordOpen(engine, tables, keyp)) {
+				return FALSE; // key1 + keyp may go on to a longer chord, wait for the next key
+			} else { // key_bind_time has been read, binding matched for key1 + key2
+				if (BINDING(tables, layer, engine->key1, keyp)->out1) { // have out1 for 2 key binding
+					if ((time - engine->khold) >= engine->key_bind_time) {
+						engine->key2 = keyp;
+						processbinding = TRUE;
+						engine->outputed = 1;
+					} else { // key_bind_time has not ellapsed, no binding registered, output the held keys as normal keypresses
+						Emit(engine, engine->key1, KEY_MAKE); Emit(engine, engine->key1, KEY_BREAK);
+						Emit(engine, keyp, KEY_MAKE); Emit(engine, keyp, KEY_BREAK);
+						engine->key1 = 0;
+						engine->key2 = 0;
+						engine->outputed = 1;
+					}
+				} else { // no binding found, output keyp
+					if (engine->key2) { // binding has already been triggered once
+						Emit(engine, keyp, KEY_MAKE); Emit(engine, keyp, KEY_BREAK);
+						engine->outputed = 1;
+					} else { // if no binding has started just treat it as quick sequential keystrokes
+						Emit(engine, engine->key1, KEY_MAKE); Emit(engine, engine->key1, KEY_BREAK);
+						Emit(engine, keyp, KEY_MAKE); Emit(engine, keyp, KEY_BREAK);
+						engine->outputed = 1;
+						engine->key1 = 0;
+					}
+				}
+			}
+		}
+	}
+
+	// a released or chorded key1 has nothing left to time out
+	if (engine->key1 == 0 || engine->key2 != 0 || processbinding) engine->deadline = 0;
+
+	if (processbinding) {
+		engine->path = (engine->key2 == K_SINGLE) ? PATH_REMAP : PATH_CHORD; // a command makes it PATH_COMMAND
+		if (!Bindingoutput(engine, tables, engine->key1, engine->key2)) return FALSE; // internal command, no output
+
+		if (longkeybinding) longkeybinding = engine->key1 = engine->key2 = 0;
+		engine->key2 = 0;
+	}
+
+	if (engine->pause == TRUE) { // pause command
+		engine->kcount = 0;
+		return FALSE;
+	}
+
+	// a binding always replaces the event, even a ~Q program with nothing to type yet
+	if (processbinding) return FALSE;
+
+	// passed on as it is, but behind the keys of the sequence it ended
+	if (engine->kcount && engine->kcount == flushed) Emit(engine, event->key, event->flag);
+
+	return engine->kcount == 0;
+}
+
+//
+// Resolves a hold that reached its deadline without a key2 press or a release:
+// the key1 + key1 hold binding when there is one, otherwise key1 itself.
+// Goes on with a ~Q program whose cmdresume has come.
+//
+VOID KbEngineTimeout(PKB_ENGINE engine, PKB_TABLES tables, LONGLONG time) {
+	engine->kcount = 0;
+	engine->now = time;
+
+	if (engine->cmdresume && time >= engine->cmdresume) CmdRun(engine, tables);
+
+	if (engine->deadline == 0 || time < engine->deadline) {
+		if (engine->pause == TRUE) engine->kcount = 0;
+		return;
+	}
+	engine->deadline = 0;
+
+	if (engine->seqlen) { // the running sequence waited long enough for its next key
+		SequenceEnd(engine, tables);
+		if (engine->pause == TRUE) engine->kcount = 0;
+		return;
+	}
+
+	if (engine->key1 == 0 || engine->key2 != 0) return;
+
+	if (BINDING(tables, engine->layer, engine->key1, engine->key1)->out1) { // long hold key binding
+		Bindingoutput(engine, tables, engine->key1, engine->key1);
+	} else if (engine->outputed == 0) {
+		Emit(engine, engine->key1, KEY_MAKE); Emit(engine, engine->key1, KEY_BREAK);
+	}
+	engine->outputed = 1;
+
+	if (engine->pause == TRUE) engine->kcount = 0;
+}
@@ -0,0 +1,109 @@
+/*++
+
+Module Name:
+
+    kbengine.h
+
+Abstract:
+
+    The chord and layer engine, free of WDF and of any clock. The driver
+    feeds it the packets of the service callback and the expiry of its hold
+    timer, the host tools feed it recorded or generated events. Times are
+    in 100ns units of whatever monotonic clock the caller uses.
+
+    For each input event the engine either asks for the event to be passed
+    on (possibly remapped in place) or replaces it with keyout[0..kcount).
+    While a chord is pending, deadline is the time at which KbEngineTimeout
+    should be called. A key1 + key2 chord that a longer chord could extend
+    waits without a deadline for its next key or a release. A running
+    sequence has the deadline of its DFA state. A ~Q program that waits, or
+    used up its instructions for one call, goes on at cmdresume;
+    KbEngineWake is the earlier of the two.
+
+Environment:
+
+    kernel mode, or user mode on the host with KBF_HOST
+
+--*/
+
+#ifndef KBENGINE_H
+#define KBENGINE_H
+
+#define MAX_KEYOUT			128
+
+// paths an event takes through KbEngineInput, a later one involves more
+#define PATH_PASS			0	// passed on as it came
+#define PATH_REMAP			1	// replaced by a single key binding
+#define PATH_CHORD			2	// taken by a hold, chord or sequence
+#define PATH_COMMAND		3	// fired a ~ command or ~Q program
+
+// engine events the driver passes on to user mode, the caller reports and clears them
+#define MAX_NOTICES			32	// more than a ~Q program can run commands in one call
+#define NOTICE_LAYER		1	// a ~l command
+#define NOTICE_COMMAND		2	// any other ~ command
+#define NOTICE_PROGRAM		3	// a ~Q program started
+
+typedef struct _KB_NOTICE {
+	USHORT type;
+	USHORT layer;						// the engine is in after the event
+	USHORT command;						// key of the command, or the program's name
+	USHORT arg;
+} KB_NOTICE, *PKB_NOTICE;
+
+#define BINDING(_tables_, _layer_, _key1_, _key2_) BindingLookup((_tables_)->Layers[_layer_], _key1_, _key2_)
+
+typedef struct _KB_ENGINE {
+	USHORT key1, key2, outputed;
+	USHORT layer;
+	BOOLEAN pause;
+	BOOLEAN reload;						// a ~r binding asked for the config to be reloaded
+	BOOLEAN profilechange;				// a ~f binding asked for profile to be used
+	USHORT profile;
+	BOOLEAN play;						// a ~i binding asked for phrase to be typed out
+	USHORT phrase;
+	LONGLONG khold;						// time key1 started its hold
+	LONGLONG deadline;					// when the pending hold times out, 0 when none is pending
+	USHORT chord[CHORD_MAX];			// keys of a pending chord that a longer one may still extend
+	USHORT chordlen;					// 0 when no such chord is pending
+	USHORT seq[SEQ_MAX];				// keys taken by a running sequence
+	USHORT seqlen;						// 0 when no sequence is running
+	ULONG seqstate;						// DFA state of the running sequence
+	CMD_FRAME cmdstack[CMD_DEPTH];		// the running ~Q program on top of the programs that called it
+	USHORT cmddepth;					// 0 when no program runs
+	ULONG cmdsteps;						// instructions the program has taken, up to CMD_STEPS_MAX
+	LONGLONG cmdresume;					// when the program goes on, 0 when it isn't waiting
+	LONGLONG now;						// time of the event being handled
+	ULONG fired;						// bindings output so far, the caller counts and clears them
+	USHORT path;						// how the last KbEngineInput handled its event, a PATH_ value
+	ULONG ncount;
+	KB_NOTICE notices[MAX_NOTICES];
+
+	// thresholds from the ~ settings, in 100ns
+	LONGLONG key_bind_time;
+	LONGLONG longkey_time;
+	LONGLONG key_repeat_time;
+	LONGLONG key_bind_timeout;
+
+	// output of the last KbEngineInput or KbEngineTimeout
+	ULONG kcount;
+	keydata keyout[MAX_KEYOUT];
+} KB_ENGINE, *PKB_ENGINE;
+
+keydata Keydata(USHORT k, USHORT f);
+
+VOID KbEngineInit(PKB_ENGINE engine, const KB_SETTINGS *settings);
+VOID KbEngineSettings(PKB_ENGINE engine, const KB_SETTINGS *settings);
+BOOLEAN KbEngineInput(PKB_ENGINE engine, PKB_TABLES tables, keydata *event, LONGLONG time);
+VOID KbEngineTimeout(PKB_ENGINE engine, PKB_TABLES tables, LONGLONG time);
+ULONG KbTextKeys(CHAR c, keydata out[4]);
+
+//
+// Returns when KbEngineTimeout is next due, 0 when nothing waits for it
+//
+FORCEINLINE LONGLONG KbEngineWake(const KB_ENGINE *engine) {
+	if (engine->cmdresume == 0) return engine->deadline;
+	if (engine->deadline == 0 || engine->cmdresume < engine->deadline) return engine->cmdresume;
+	return engine->deadline;
+}
+
+#endif  // KBENGINE_H
@@ -47,6 +47,7 @@ Environment:
 
 ULONG InstanceNo = 0;
 UINT8 KeyEnabled = KEY_MODE_BINDING_ON; 
+BOOLEAN ModeKeyDown = FALSE;	// a ScrollLock press reached KbFilter_ModeKey, its release steps the mode
 
 NTSTATUS
 DriverEntry(
@@ -91,6 +92,7 @@ STATUS_UNSUCCESSFUL otherwise.
 	//
 
 	WDF_DRIVER_CONFIG_INIT( &config, KbFilter_EvtDeviceAdd);
+	config.EvtDriverUnload = KbFilter_EvtDriverUnload;
 
 	//
 	// Create a framework driver object to represent our driver.
@@ -98,18 +100,61 @@ STATUS_UNSUCCESSFUL otherwise.
 	status = WdfDriverCreate(DriverObject, RegistryPath, WDF_NO_OBJECT_ATTRIBUTES, &config, WDF_NO_HANDLE); // hDriver optional
 	if (!NT_SUCCESS(status)) {
 		DebugPrint(("WdfDriverCreate failed with status 0x%x\n", status));
+		return status;
 	}
 
+	// the worker loads the config for the first time as soon as it runs
 	Initialize();
-	outputed = 0;
-	key1 = 0;
-	key2 = 0;
-	khold = 0;
-	ThreadLoadConfig();
+	status = ConfigWorkerStart();
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("ConfigWorkerStart failed with status 0x%x\n", status));
+	}
 
 	return status;
 }
 
+VOID
+KbFilter_EvtDriverUnload(
+IN WDFDRIVER Driver
+)
+/*++
+Routine Description:
+
+Called by the framework before the driver image is unloaded. Stops the
+config worker, the devices and their queues are gone by now, then frees
+the published profiles, the reader counts and the counters nothing can
+use any more.
+
+Arguments:
+
+Driver - Handle to the framework driver object created in DriverEntry
+
+Return Value:
+
+None
+
+--*/
+{
+	UNREFERENCED_PARAMETER(Driver);
+
+	ConfigWorkerStop();
+
+	ProfilesFree(ActiveProfiles);
+	ActiveProfiles = &EmptyProfiles;
+
+	if (TableReaders != &SharedReaders) {
+		ExFreePoolWithTag(TableReaders, KBFILTER_POOL_TAG);
+	}
+	TableReaders = &SharedReaders;
+	TableReaderSlots = 1;
+
+	if (CpuStats != &SharedStats) {
+		ExFreePoolWithTag(CpuStats, KBFILTER_POOL_TAG);
+	}
+	CpuStats = &SharedStats;
+	CpuStatSlots = 1;
+}
+
 NTSTATUS
 KbFilter_EvtDeviceAdd(
 IN WDFDRIVER        Driver,
@@ -141,11 +186,13 @@ NTSTATUS
 --*/
 {
 	WDF_OBJECT_ATTRIBUTES   deviceAttributes;
+	WDF_OBJECT_ATTRIBUTES   attributes;
 	NTSTATUS                status;
 	WDFDEVICE               hDevice;
 	WDFQUEUE                hQueue;
 	PDEVICE_EXTENSION       filterExt;
 	WDF_IO_QUEUE_CONFIG     ioQueueConfig;
+	WDF_TIMER_CONFIG        timerConfig;
 
 	UNREFERENCED_PARAMETER(Driver);
 
@@ -163,6 +210,7 @@ NTSTATUS
 	WdfDeviceInitSetDeviceType(DeviceInit, FILE_DEVICE_KEYBOARD);
 
 	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&deviceAttributes, DEVICE_EXTENSION);
+	deviceAttributes.EvtCleanupCallback = KbFilter_EvtDeviceCleanup;
 
 	//
 	// Create a framework device object.  This call will in turn create
@@ -219,6 +267,107 @@ NTSTATUS
 
 	filterExt->rawPdoQueue = hQueue;
 
+	//
+	// IOCTL_KBFILTR_WAIT_NOTIFICATION requests forwarded from the rawPDO wait
+	// here until KbFilter_EngineNotify takes them. The framework cancels one
+	// whose handle is closed while it waits.
+	//
+	WDF_IO_QUEUE_CONFIG_INIT(&ioQueueConfig, WdfIoQueueDispatchManual);
+
+	status = WdfIoQueueCreate(hDevice, &ioQueueConfig, WDF_NO_OBJECT_ATTRIBUTES, &filterExt->NotifyQueue);
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfIoQueueCreate failed 0x%x\n", status));
+		return status;
+	}
+
+	//
+	// The service callback and the hold timer both run the binding engine
+	// at DISPATCH_LEVEL, the spinlock keeps them from interleaving.
+	//
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = hDevice;
+
+	status = WdfSpinLockCreate(&attributes, &filterExt->EngineLock);
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfSpinLockCreate failed 0x%x\n", status));
+		return status;
+	}
+
+	WDF_TIMER_CONFIG_INIT(&timerConfig, KbFilter_EvtHoldTimer);
+	timerConfig.UseHighResolutionTimer = WdfTrue; // key_bind_timeout may be finer than a clock tick
+
+	status = WdfTimerCreate(&timerConfig, &attributes, &filterExt->HoldTimer);
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfTimerCreate failed 0x%x\n", status));
+		return status;
+	}
+
+	//
+	// Output kbdclass had no room for is sent again from this timer
+	//
+	WDF_TIMER_CONFIG_INIT(&timerConfig, KbFilter_EvtDrainTimer);
+
+	status = WdfTimerCreate(&timerConfig, &attributes, &filterExt->DrainTimer);
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfTimerCreate failed 0x%x\n", status));
+		return status;
+	}
+
+	//
+	// Phrases are typed out a chunk per run of this timer
+	//
+	WDF_TIMER_CONFIG_INIT(&timerConfig, KbFilter_EvtPlaybackTimer);
+
+	status = WdfTimerCreate(&timerConfig, &attributes, &filterExt->PlaybackTimer);
+	if (!NT_SUCCESS(status)) {
+		DebugPrint(("WdfTimerCreate failed 0x%x\n", status));
+		return status;
+	}
+
+	//
+	// Each keyboard runs its own engine, see DEVICE_EXTENSION
+	//
+	filterExt->Engine = ExAllocatePoolWithTag(NonPagedPoolNxCacheAligned, ENGINE_ALLOCATION, KBFILTER_POOL_TAG);
+	if (filterExt->Engine == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	KbEngineInit(filterExt->Engine, &EmptyTables.Settings);
+
+	filterExt->Output = KbAllocateNonPaged(sizeof(OUTPUT_QUEUE));
+	if (filterExt->Output == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(filterExt->Output, sizeof(OUTPUT_QUEUE));
+
+	filterExt->Playback = KbAllocateNonPaged(sizeof(PHRASE_PLAYBACK));
+	if (filterExt->Playback == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(filterExt->Playback, sizeof(PHRASE_PLAYBACK));
+
+	filterExt->Latency = KbAllocateNonPaged(sizeof(KBFILTR_LATENCY));
+	if (filterExt->Latency == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(filterExt->Latency, sizeof(KBFILTR_LATENCY));
+
+	//
+	// The event ring is mapped into monitoring applications, so it gets
+	// pages of its own. It's freed in KbFilter_EvtDeviceCleanup.
+	//
+	filterExt->Ring = KbAllocateNonPaged(RING_ALLOCATION);
+	if (filterExt->Ring == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(filterExt->Ring, RING_ALLOCATION);
+	filterExt->Ring->Entries = KBFILTR_RING_ENTRIES;
+
+	filterExt->RingMdl = IoAllocateMdl(filterExt->Ring, RING_ALLOCATION, FALSE, FALSE, NULL);
+	if (filterExt->RingMdl == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	MmBuildMdlForNonPagedPool(filterExt->RingMdl);
+
 	//
 	// Create a RAW pdo so we can provide a sideband communication with
 	// the application. Please note that not filter drivers desire to
@@ -233,6 +382,60 @@ NTSTATUS
 	return status;
 }
 
+VOID
+KbFilter_EvtDeviceCleanup(
+IN WDFOBJECT Device
+)
+/*++
+Routine Description:
+
+Frees the engine, the output queue, the phrase playback and the event
+ring when the filter device goes away.
+The ring is left allocated while a raw PDO handle still has it mapped,
+freeing it would leave a process with the pages mapped.
+
+Arguments:
+
+Device - Handle to the filter device
+
+Return Value:
+
+None
+
+--*/
+{
+	PDEVICE_EXTENSION filterExt = FilterGetData((WDFDEVICE)Device);
+
+	if (filterExt->RingReaders != 0) {
+		ErrorPrint(("kbfiltr: event ring still mapped by %d handles, not freed\n", filterExt->RingReaders));
+	} else {
+		if (filterExt->RingMdl) {
+			IoFreeMdl(filterExt->RingMdl);
+			filterExt->RingMdl = NULL;
+		}
+		if (filterExt->Ring) {
+			KbFree(filterExt->Ring);
+			filterExt->Ring = NULL;
+		}
+	}
+	if (filterExt->Engine) {
+		KbFree(filterExt->Engine);
+		filterExt->Engine = NULL;
+	}
+	if (filterExt->Output) {
+		KbFree(filterExt->Output);
+		filterExt->Output = NULL;
+	}
+	if (filterExt->Playback) {
+		KbFree(filterExt->Playback);
+		filterExt->Playback = NULL;
+	}
+	if (filterExt->Latency) {
+		KbFree(filterExt->Latency);
+		filterExt->Latency = NULL;
+	}
+}
+
 VOID
 KbFilter_EvtIoDeviceControlFromRawPdo(
 IN WDFQUEUE      Queue,
@@ -715,7 +918,6 @@ Status is returned.
 
 	*TurnTranslationOn = TRUE;
 
-	//if (KeyEnabled == 0 || reload_config == SETTING_ON) ThreadLoadConfig();
 	return status;
 }
 
@@ -828,212 +1030,72 @@ Status is returned.
 	WDFDEVICE hDevice = WdfWdmDeviceGetWdfDeviceHandle(DeviceObject);
 	PDEVICE_EXTENSION devExt = FilterGetData(hDevice);
 	size_t length = InputDataEnd - InputDataStart;
-	KEYBOARD_INPUT_DATA data[MAX_KB_INPUT_DATA];
-	USHORT keyrepeat = 0, processbinding, longkeybinding = 0;
-	LARGE_INTEGER tickcount;
-
-	kcount = 0;
-	*InputDataConsumed = InputDataEnd - InputDataStart;
-
-	last_packet_length = length;
-
-	for (size_t i = 0; i < length; i++) {
-		processbinding = FALSE;
+	size_t i;
+	PKB_ENGINE engine = devExt->Engine;
+	LONGLONG now, deadline, wake;
+	PKB_TABLES tables;
+	ULONG64 entry = ReadTimeStampCounter();
+	ULONG series = KBFILTR_LATENCY_PASS;
+
+	devExt->LastPacketLength = (ULONG)length;
+	now = KbFilter_Now();
+	WdfSpinLockAcquire(devExt->EngineLock);
+	tables = TablesAcquire();
+	KbEngineSettings(engine, &tables->Settings); // follows a reload, costs next to nothing
+	deadline = KbEngineWake(engine);
+
+	for (i = 0; i < length; i++) {
+
+		// a packet is only taken once its output is sure to fit, the rest is left to the port driver
+		if (!KbFilter_ReserveOutput(devExt, MAX_PACKET_OUTPUT)) {
+			DebugPrint(("kbfiltr: output queue full, %u packets not consumed\n", (ULONG)(length - i)));
+			break;
+		}
 
-		// SCROLLOCK to cycle through modes
-		if (InputDataStart[i].MakeCode == K_SCROLLLOCK) {
-			if ((InputDataStart[i].Flags & KEY_BREAK) == KEY_BREAK) {
-				if (++KeyEnabled > 3) KeyEnabled = KEY_MODE_KEYBOARD_OFF;
-			}
+		// SCROLLOCK to cycle through modes, with bindings on only once the engine passed it on, a sequence may start with it
+		if (InputDataStart[i].MakeCode == K_SCROLLLOCK && KeyEnabled != KEY_MODE_BINDING_ON) {
+			KbFilter_ModeKey(InputDataStart[i].Flags);
 			continue;
 		}
 
 		if (KeyEnabled == KEY_MODE_BINDING_ON) {
-			USHORT keyp = InputDataStart[i].MakeCode;	
-			if (keyp == 0) {
-				//key1 = 0;
-				//key2 = 0;
-				continue;
-			}
-
-			USHORT keystate = InputDataStart[i].Flags;
-			kcount = 0;
-
-			if (layer == 0) {
-				if (bindings[layer][keyp][K_SINGLE].out1) { 
-					// single key pre-filters 
-					InputDataStart[i].MakeCode = keyp = bindings[layer][keyp][K_SINGLE].out1;
-					InputDataStart[i].Flags = InputDataStart[i].Flags | ((keyp >= K_HOME) ? KEY_E0 : 0);
-				}
-			}
-
-			if ((keystate & KEY_BREAK) == KEY_BREAK) {
-				if (keyp == key1) { // at this point keyp is non-zero, key1 pressed and being released
-					if (key2 == 0) { // at this point key1 is non-zero, no binding started
-						if (0 && bindings[layer][key1][key1].out1) { // long hold key binding
-							KeQueryTickCount(&tickcount);
-							if ((tickcount.QuadPart - khold) >= longkey_time) {
-								key1 = key2 = keyp;
-								processbinding = TRUE;
-								longkeybinding = TRUE;
-							}
-						}
-
-						if (outputed == 0) {
-							keyout[kcount++] = Keydata(key1, KEY_MAKE); 
-							keyout[kcount++] = Keydata(key1, KEY_BREAK);
-						}
-					}
-
-					//if (!processbinding) key1 = 0;
-					key1 = 0; 
-					khold = 0;
-					outputed = 0;
-				}
-
-				//if (outputed == 0) {
-				//key1 = 0;
-				keyrepeat = 0;
-
-			 } else if (((keystate & KEY_MAKE) == KEY_MAKE) && (keyrepeat == 0)) {
-				if (key1 == 0) {
-
-					// no key binding when starting with shift key
-					if ((keyp != K_LSHIFT) && (keyp != K_RSHIFT)) {
-						if (bindings[layer][keyp][K_ENABLED].out1) { // binding found, start the wait
-							key1 = keyp;
-							if (bindings[layer][key1][K_SINGLE].out1) { // check if it's a key combo or a single-single key binding
-								key2 = K_SINGLE;
-								processbinding = TRUE;
-								outputed = 1;
-							} else { // hold key1 and wait for key2 press
-								KeQueryTickCount(&tickcount);
-								khold = tickcount.QuadPart;
-								continue;
-							}
-						} else {
-							key2 = 0;
-							khold = 0;
-						}
-					}
-
-
-				} else { // key1 != 0
-					if (keyp == key1) { // key holding
-						if (!bindings[layer][key1][key1].out1) { // long key binding not found
-							KeQueryTickCount(&tickcount);
-							if ((tickcount.QuadPart - khold) >= key_repeat_time) {
-								// if key has been held for longer than repeat time then do nothing and let the key through for native repeating
-								//keyrepeat = 1; 
-								outputed = 1;
-								keyout[kcount++] = Keydata(key1, KEY_MAKE); keyout[kcount++] = Keydata(key1, KEY_BREAK);
-							}
-							else {
-								continue;
-							}
-						}
-
-						if (kcount == 0) {
-							KeQueryTickCount(&tickcount);
-							if ((tickcount.QuadPart - khold) >= key_bind_time) {
-								outputed = 1;
-								continue; // key1 is still holding waiting for long hold key binding
-							}
-							else {
-								continue; // key1 is still holding waiting for long hold key binding
-							}
-						}
-						
-					} else { // key_bind_time has been read, binding matched for key1 + key2
-						if (bindings[layer][key1][keyp].out1) { // have out1 for 2 key binding
-							KeQueryTickCount(&tickcount);
-							if ((tickcount.QuadPart - khold) >= key_bind_time) {
-								key2 = keyp;
-								processbinding = TRUE;
-								outputed = 1;
-							} else { // key_bind_time has not ellapsed, no binding registered, output the held keys as normal keypresses
-								keyout[kcount++] = Keydata(key1, KEY_MAKE); keyout[kcount++] = Keydata(key1, KEY_BREAK);
-								keyout[kcount++] = Keydata(keyp, KEY_MAKE); keyout[kcount++] = Keydata(keyp, KEY_BREAK);
-								key1 = 0;
-								key2 = 0;
-								outputed = 1;
-							}
-						} else { // no binding found, output keyp
-							if (key2) { // binding has already been triggered once  
-								keyout[kcount++] = Keydata(keyp, KEY_MAKE); keyout[kcount++] = Keydata(keyp, KEY_BREAK);
-								outputed = 1;
-							} else { // if no binding has started just treat it as quick sequential keystrokes
-								keyout[kcount++] = Keydata(key1, KEY_MAKE); keyout[kcount++] = Keydata(key1, KEY_BREAK);
-								keyout[kcount++] = Keydata(keyp, KEY_MAKE); keyout[kcount++] = Keydata(keyp, KEY_BREAK);
-								outputed = 1;
-								key1 = 0;
-							}
-						}
-					}
-				}
+			keydata event = Keydata(InputDataStart[i].MakeCode, InputDataStart[i].Flags);
+
+			if (KbEngineInput(engine, tables, &event, now)) {
+				KEYBOARD_INPUT_DATA packet = InputDataStart[i];
+				packet.MakeCode = event.key;
+				packet.Flags = event.flag;
+				if (packet.MakeCode == K_SCROLLLOCK) KbFilter_ModeKey(packet.Flags);
+				else KbFilter_QueuePacket(devExt, &packet);
+				series = MAX(series, engine->path);
+			} else {
+				KbFilter_QueueEngineKeyout(devExt, InputDataStart[i].UnitId);
+				// held back or replaced by what a hold, chord or sequence made of it
+				series = MAX(series, (engine->path == PATH_PASS) ? PATH_CHORD : engine->path);
 			}
 
-
-
-			if (processbinding) {
-				if (bindings[layer][key1][key2].out1 == K_VARIABLE) { // binding starting with ~ is an internal command
-					Command(bindings[layer][key1][key2].out2, key1, key2, bindings[layer][key1][key2]);
-					continue; // no output
-
-				} else if (bindings[layer][key1][key2].out1 == K_COMMAND) { // stored command(s) 
-					char *command = commands[bindings[layer][key1][key2].out2]; // out2 => command sequence name 
-					for (int ci = 0; ci < COMMAND_LEN; ci++) {
-						char command_name = command[ci];
-						if (command_name == 0) continue;
-						Keyoutput(layer, K_COMMAND, keymap[command_name]);
-					}
-				} else {
-					Keyoutput(layer, key1, key2);
-				}
-				processbinding = FALSE;
-				
-				if (key2 == K_SINGLE) keyrepeat = 0;
-				if (longkeybinding) longkeybinding = key1 = key2 = 0;
-				key2 = 0;
+			// a hold that just started gets resolved by the timer if nothing else comes, a waiting program goes on
+			wake = KbEngineWake(engine);
+			if (wake && wake != deadline) {
+				KbFilter_ArmHoldTimer(devExt, wake - now, InputDataStart[i].UnitId);
 			}
+			deadline = wake;
 
-			if (pause == TRUE) continue; // pause command
-
-			if (kcount) {
-				for (USHORT j = 0; j < kcount; j++) {
-					USHORT key = keyout[j].key;
-					data[j].MakeCode = key;
-					data[j].Flags = keyout[j].flag | ((key >= K_HOME) ? KEY_E0 : 0);
-				}
-				ULONG _consumed = kcount;
-				PULONG consumed = &_consumed;
-
-				(*(PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR)devExt->UpperConnectData.ClassService)(
-					devExt->UpperConnectData.ClassDeviceObject, &data[0], &data[kcount], consumed);
-
-			} else {
-				ULONG _consumed = 1;
-				PULONG consumed = &_consumed;
-				(*(PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR)devExt->UpperConnectData.ClassService)(
-					devExt->UpperConnectData.ClassDeviceObject, &InputDataStart[i], &InputDataStart[i+1], consumed);
+			// after a ~f the rest of the packets look their keys up in the new profile
+			if (KbFilter_EngineRequests(devExt, tables, InputDataStart[i].UnitId)) {
+				TablesRelease();
+				tables = TablesAcquire();
+				KbEngineSettings(engine, &tables->Settings);
 			}
 
-
-
 		} else if (KeyEnabled == KEY_MODE_BINDING_OFF) {
-			ULONG _consumed = 1;
-			PULONG consumed = &_consumed;
-			(*(PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR)devExt->UpperConnectData.ClassService)(
-				devExt->UpperConnectData.ClassDeviceObject, &InputDataStart[i], &InputDataStart[i+1], consumed);
+			KbFilter_QueuePacket(devExt, &InputDataStart[i]);
 		} else {
 			// diagnostic mode
 			// no keys will register
 			// but certain command keys will output setting values
 			USHORT keyp = InputDataStart[i].MakeCode;
 			USHORT keystate = InputDataStart[i].Flags;
-			ULONG _consumed = 0;
-			PULONG consumed = &_consumed;
-			kcount = 0;
 			char message[MSG_LEN];
 			memset(message, 0, MSG_LEN);
 
@@ -1042,431 +1104,1017 @@ Status is returned.
 					key_bind_time, longkey_time, key_repeat_time, key_bind_timeout, safe_mode, capslock_to_lshift);
 			} else if (keystate == KEY_MAKE && keyp == K_J) {
 				sprintf(message, "l=%luScl=%luSr=%luSlc=%luSpl=%luS1=%luSk=%lu",
-					layer, config_loaded, reload_config, loading_config, last_packet_length, key1, krelease);
+					engine->layer, ConfigLoaded, ConfigRequests, ConfigLoads, devExt->LastPacketLength, engine->key1, krelease);
+			} else if (keystate == KEY_MAKE && keyp == K_K) { // ClassService batching: upcalls and packets sent up
+				sprintf(message, "u=%luSp=%luSq=%luSd=%luSw=%luS", devExt->UpcallCount, devExt->UpcallPackets,
+					devExt->Output->HighWater, devExt->Output->Dropped, devExt->Output->Retries);
+			} else if (keystate == KEY_MAKE && keyp == K_M) { // binding index footprint per layer
+				sprintf(message, "m0=%luSm1=%luSm2=%luSm3=%luSm4=%luS",
+					tables->Footprint[0], tables->Footprint[1], tables->Footprint[2], tables->Footprint[3], tables->Footprint[4]);
 			}
 
 			int c = 0;
 			char k = message[c++];
 			while (k && (c < MSG_LEN)) {
-				USHORT key = keymap[k];
-				keyout[kcount++] = Keydata(key, KEY_MAKE);
-				keyout[kcount++] = Keydata(key, KEY_BREAK);
+				USHORT key = keymap[(UCHAR)k];
+				keydata keys[2];
+				keys[0] = Keydata(key, KEY_MAKE);
+				keys[1] = Keydata(key, KEY_BREAK);
+				KbFilter_QueueKeyout(devExt, keys, 2, InputDataStart[i].UnitId);
 				k = message[c++];
 			}
+		}
+	}
 
-			if (kcount) {
-				for (USHORT j = 0; j < kcount; j++) {
-					USHORT key = keyout[j].key;
-					data[j].MakeCode = key;
-					data[j].Flags = keyout[j].flag | ((key >= K_HOME) ? KEY_E0 : 0);
-				}
+	*InputDataConsumed = (ULONG)i;
+	KbFilter_RingWrite(devExt, InputDataStart, (ULONG)i, KBFILTR_RING_INPUT);
+	StatAdd(PacketsIn, i);
+	StatAdd(Bindings, engine->fired);
+	engine->fired = 0;
 
-				*consumed = kcount;
-				(*(PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR)devExt->UpperConnectData.ClassService)(
-					devExt->UpperConnectData.ClassDeviceObject, &data[0], &data[kcount], consumed);
-			}
+	// everything produced for InputDataStart..InputDataEnd goes up in one call
+	KbFilter_DrainOutput(devExt);
+	LatencyRecord(devExt->Latency, series, ReadTimeStampCounter() - entry);
+
+	TablesRelease();
+	WdfSpinLockRelease(devExt->EngineLock);
+}
+
+// The engine clock: interrupt time in 100ns units, precise to the performance counter
+LONGLONG KbFilter_Now() {
+	ULONG64 qpc;
+
+	return (LONGLONG)KeQueryInterruptTimePrecise(&qpc);
+}
+
+VOID KbFilter_ArmHoldTimer(PDEVICE_EXTENSION devExt, LONGLONG due, USHORT unitId) {
+	devExt->HoldUnitId = unitId;
+	WdfTimerStart(devExt->HoldTimer, (due > 1) ? -due : -1); // relative, in 100ns
+}
+
+//
+// Carries out what the engine's ~r, ~f and ~i commands asked for, under EngineLock.
+// TRUE when a ~f switched the profile, the tables the caller holds are then
+// those of the old one until it acquires them again.
+//
+BOOLEAN KbFilter_EngineRequests(PDEVICE_EXTENSION devExt, PKB_TABLES tables, USHORT unitId) {
+	PKB_ENGINE engine = devExt->Engine;
+	BOOLEAN switched = FALSE;
+
+	if (engine->reload) {
+		engine->reload = FALSE;
+		ConfigRequestReload();
+	}
+	if (engine->profilechange) {
+		engine->profilechange = FALSE;
+		switched = ProfileSelect(engine->profile);
+	}
+	if (engine->play) {
+		engine->play = FALSE;
+		KbFilter_PlayPhrase(devExt, tables, engine->phrase, unitId);
+	}
+	if (engine->ncount) {
+		KbFilter_EngineNotify(devExt);
+	}
+	return switched;
+}
+
+// Completes a parked IOCTL_KBFILTR_WAIT_NOTIFICATION request per engine event, under EngineLock
+VOID KbFilter_EngineNotify(PDEVICE_EXTENSION devExt) {
+	PKB_ENGINE engine = devExt->Engine;
+	PKBFILTR_NOTIFICATION notification;
+	WDFREQUEST request;
+	NTSTATUS status;
+
+	for (ULONG n = 0; n < engine->ncount; n++) {
+		devExt->NotifySequence++;
+
+		// nobody waiting, the app sees the gap in Sequence
+		if (!NT_SUCCESS(WdfIoQueueRetrieveNextRequest(devExt->NotifyQueue, &request))) continue;
+
+		status = WdfRequestRetrieveOutputBuffer(request, sizeof(KBFILTR_NOTIFICATION), &notification, NULL);
+		if (!NT_SUCCESS(status)) { // checked before it was parked
+			WdfRequestComplete(request, status);
+			continue;
 		}
+		RtlZeroMemory(notification, sizeof(KBFILTR_NOTIFICATION));
+		notification->Time = engine->now;
+		notification->Sequence = devExt->NotifySequence;
+		notification->Type = engine->notices[n].type;
+		notification->Layer = engine->notices[n].layer;
+		notification->Command = engine->notices[n].command;
+		notification->Arg = engine->notices[n].arg;
+		WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, sizeof(KBFILTR_NOTIFICATION));
 	}
+	engine->ncount = 0;
 }
 
-VOID Keyoutput(USHORT layer, USHORT key1, USHORT key2) {
-	if (bindings[layer][key1][key2].out1 == K_VARIABLE) { // binding starting with ~ is an internal command
-		Command(bindings[layer][key1][key2].out2, key1, key2, bindings[layer][key1][key2]);
-	} else if (bindings[layer][key1][key2].out3) { // 3 key output	
-		keyout[kcount++] = Keydata(bindings[layer][key1][key2].out1, KEY_MAKE);
-		keyout[kcount++] = Keydata(bindings[layer][key1][key2].out2, KEY_MAKE);
-		keyout[kcount++] = Keydata(bindings[layer][key1][key2].out3, KEY_MAKE);
-		keyout[kcount++] = Keydata(bindings[layer][key1][key2].out3, KEY_BREAK);
-		keyout[kcount++] = Keydata(bindings[layer][key1][key2].out2, KEY_BREAK);
-		keyout[kcount++] = Keydata(bindings[layer][key1][key2].out1, KEY_BREAK);
-	} else if (bindings[layer][key1][key2].out2) { // 2 key output	
-		keyout[kcount++] = Keydata(bindings[layer][key1][key2].out1, KEY_MAKE);
-		keyout[kcount++] = Keydata(bindings[layer][key1][key2].out2, KEY_MAKE);
-		keyout[kcount++] = Keydata(bindings[layer][key1][key2].out2, KEY_BREAK);
-		keyout[kcount++] = Keydata(bindings[layer][key1][key2].out1, KEY_BREAK);
-	} else { // 1 key output
-		keyout[kcount++] = Keydata(bindings[layer][key1][key2].out1, KEY_MAKE | bindings[layer][key1][key2].flag1);
-		keyout[kcount++] = Keydata(bindings[layer][key1][key2].out1, KEY_BREAK | bindings[layer][key1][key2].flag1);
-	}
-
-	// return the original key releases
-	//keyout[kcount++] = Keydata(key2, KEY_BREAK);
-	//keyout[kcount++] = Keydata(key1, KEY_BREAK);
+VOID
+KbFilter_EvtHoldTimer(
+IN WDFTIMER Timer
+)
+/*++
+
+Routine Description:
+
+Called at DISPATCH_LEVEL when the deadline of a pending hold comes up.
+If no key2 press or key1 release has resolved the hold since, the engine
+resolves it here: the hold binding (key1 + key1) when there is one,
+otherwise key1 itself, so the output doesn't wait for the next keystroke.
+A ~Q program that waits or ran out of instructions goes on here too, the
+timer is armed again for as long as it runs.
+
+Arguments:
+
+Timer - the HoldTimer of the device
+
+Return Value:
+
+None
+
+--*/
+{
+	WDFDEVICE hDevice = (WDFDEVICE)WdfTimerGetParentObject(Timer);
+	PDEVICE_EXTENSION devExt = FilterGetData(hDevice);
+	PKB_ENGINE engine = devExt->Engine;
+	LONGLONG now = KbFilter_Now();
+	LONGLONG wake;
+	PKB_TABLES tables;
+
+	WdfSpinLockAcquire(devExt->EngineLock);
+	tables = TablesAcquire();
+	KbEngineSettings(engine, &tables->Settings);
+	wake = KbEngineWake(engine);
+
+	// a resolved hold clears the deadline, so a stale expiry does nothing
+	if (KeyEnabled == KEY_MODE_BINDING_ON && wake && devExt->UpperConnectData.ClassService) {
+		if (now < wake) { // fired a little early, wait out the rest
+			KbFilter_ArmHoldTimer(devExt, wake - now, devExt->HoldUnitId);
+		} else if (!KbFilter_ReserveOutput(devExt, MAX_KEYOUT)) { // no room yet, try again shortly
+			KbFilter_ArmHoldTimer(devExt, OUTPUT_RETRY_INTERVAL, devExt->HoldUnitId);
+		} else {
+			// only a hold or sequence deadline counts, not a ~Q program going on
+			if (engine->deadline && now >= engine->deadline) StatAdd(Timeouts, 1);
+			KbEngineTimeout(engine, tables, now);
+			StatAdd(Bindings, engine->fired);
+			engine->fired = 0;
+			KbFilter_QueueEngineKeyout(devExt, devExt->HoldUnitId);
+			KbFilter_DrainOutput(devExt);
+			KbFilter_EngineRequests(devExt, tables, devExt->HoldUnitId); // the next run acquires the tables again
+
+			wake = KbEngineWake(engine); // the rest of a ~Q program
+			if (wake) KbFilter_ArmHoldTimer(devExt, wake - now, devExt->HoldUnitId);
+		}
+	}
+
+	TablesRelease();
+	WdfSpinLockRelease(devExt->EngineLock);
 }
 
+VOID
+KbFilter_EvtDrainTimer(
+IN WDFTIMER Timer
+)
+/*++
 
-VOID Command(USHORT cmd, USHORT key1, USHORT key2, struct_binding binding) {
-	key1;
-	key2;
-	switch (cmd) {
-	case K_L: // layer change
-		layer = binding.arg1;
-		break;
+Routine Description:
 
-	case K_P: // pause keyboard
-		if (pause == FALSE) pause = TRUE;
-		else pause = FALSE;
-		break;
+Called at DISPATCH_LEVEL after kbdclass consumed only part of the output,
+hands the rest up again. Keeps rearming itself while kbdclass is full.
 
-	case K_R: // Reload config file 
-		reload_config = SETTING_ON;
-		break;
+Arguments:
 
-	case K_C: // command combo
-		// call one by one up to 
-		break;
+Timer - the DrainTimer of the device
+
+Return Value:
+
+None
+
+--*/
+{
+	WDFDEVICE hDevice = (WDFDEVICE)WdfTimerGetParentObject(Timer);
+	PDEVICE_EXTENSION devExt = FilterGetData(hDevice);
+
+	WdfSpinLockAcquire(devExt->EngineLock);
+	if (devExt->UpperConnectData.ClassService) KbFilter_DrainOutput(devExt);
+	WdfSpinLockRelease(devExt->EngineLock);
+}
+
+VOID
+KbFilter_EvtPlaybackTimer(
+IN WDFTIMER Timer
+)
+/*++
+
+Routine Description:
+
+Called at DISPATCH_LEVEL while a phrase is being typed out, queues its
+next chunk.
+
+Arguments:
+
+Timer - the PlaybackTimer of the device
+
+Return Value:
+
+None
+
+--*/
+{
+	WDFDEVICE hDevice = (WDFDEVICE)WdfTimerGetParentObject(Timer);
+	PDEVICE_EXTENSION devExt = FilterGetData(hDevice);
+
+	WdfSpinLockAcquire(devExt->EngineLock);
+	if (devExt->UpperConnectData.ClassService) KbFilter_PlaybackChunk(devExt);
+	WdfSpinLockRelease(devExt->EngineLock);
+}
+
+// Returns how many packets kbdclass took, fewer than count when its queue is full
+ULONG KbFilter_Upcall(PDEVICE_EXTENSION devExt, PKEYBOARD_INPUT_DATA data, ULONG count) {
+	ULONG consumed = 0;
+
+	if (count == 0) return 0;
+
+	(*(PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR)devExt->UpperConnectData.ClassService)(
+		devExt->UpperConnectData.ClassDeviceObject, &data[0], &data[count], &consumed);
+	if (consumed > count) consumed = count;
+
+	InterlockedIncrement(&devExt->UpcallCount);
+	InterlockedExchangeAdd(&devExt->UpcallPackets, (LONG)consumed);
+	StatAdd(Upcalls, 1);
+	StatAdd(PacketsOut, consumed);
+	KbFilter_RingWrite(devExt, data, consumed, KBFILTR_RING_OUTPUT);
+	return consumed;
+}
+
+// Appends packets to the event ring, called with EngineLock held so there is a single producer
+VOID KbFilter_RingWrite(PDEVICE_EXTENSION devExt, PKEYBOARD_INPUT_DATA data, ULONG count, USHORT direction) {
+	PKBFILTR_RING ring = devExt->Ring;
+	ULONG head = devExt->RingHead;
+	ULONG tail;
+	LONGLONG now;
+
+	if (devExt->RingReaders == 0 || count == 0) return;
+
+	// Tail is the reader's, it only decides how much room there is
+	tail = ring->Tail;
+	now = KbFilter_Now();
+
+	for (ULONG j = 0; j < count; j++) {
+		PKBFILTR_RING_EVENT event;
+
+		if (head - tail >= KBFILTR_RING_ENTRIES) { // reader is a full ring behind
+			ring->Dropped++;
+			continue;
+		}
+
+		event = &ring->Events[head & (KBFILTR_RING_ENTRIES - 1)];
+		event->Time = now;
+		event->MakeCode = data[j].MakeCode;
+		event->Flags = data[j].Flags;
+		event->UnitId = data[j].UnitId;
+		event->Direction = direction;
+		head++;
 	}
+
+	// the events are in place before the reader can see the new Head
+	devExt->RingHead = head;
+	InterlockedExchange((volatile LONG *)&ring->Head, (LONG)head);
 }
 
-keydata Keydata(USHORT k, USHORT f) {
-	keydata o;
-	o.key = k;
-	o.flag = f;
-	return o;
+// Makes room for n more packets in the output queue, sending queued ones up if needed
+BOOLEAN KbFilter_ReserveOutput(PDEVICE_EXTENSION devExt, ULONG n) {
+	POUTPUT_QUEUE queue = devExt->Output;
+
+	if (OUTPUT_QUEUE_LENGTH - queue->Count >= n) return TRUE;
+
+	KbFilter_DrainOutput(devExt);
+	return OUTPUT_QUEUE_LENGTH - queue->Count >= n;
 }
 
-VOID ThreadLoadConfig() {
-	if (loading_config == 1) return;
-	if (loading_config == 2) {
-		reload_config = SETTING_OFF;
-		KeyEnabled = KEY_MODE_BINDING_ON;
-		loading_config = 0; 
+VOID KbFilter_QueuePacket(PDEVICE_EXTENSION devExt, PKEYBOARD_INPUT_DATA packet) {
+	POUTPUT_QUEUE queue = devExt->Output;
+
+	// only a burst that outgrows the queue costs an extra upcall
+	if (queue->Count == OUTPUT_QUEUE_LENGTH) KbFilter_DrainOutput(devExt);
+	if (queue->Count == OUTPUT_QUEUE_LENGTH) {
+		queue->Dropped++;
+		StatAdd(Dropped, 1);
 		return;
 	}
 
+	queue->Packets[(queue->Head + queue->Count) & (OUTPUT_QUEUE_LENGTH - 1)] = *packet;
+	if (++queue->Count > queue->HighWater) queue->HighWater = queue->Count;
+}
+
+VOID KbFilter_QueueKeyout(PDEVICE_EXTENSION devExt, const keydata *keys, ULONG n, USHORT unitId) {
+	KEYBOARD_INPUT_DATA packet;
+
+	memset(&packet, 0, sizeof(packet));
+	packet.UnitId = unitId;
+
+	for (ULONG j = 0; j < n; j++) {
+		USHORT key = keys[j].key;
+		packet.MakeCode = key;
+		packet.Flags = keys[j].flag | ((key >= K_HOME) ? KEY_E0 : 0);
+		KbFilter_QueuePacket(devExt, &packet);
+	}
+}
+
+//
+// Queues the keyout of the engine. A ScrollLock in it steps the mode instead
+// of being typed, like a ScrollLock the engine passed on: the key ends up
+// there when no sequence took it, or when one was bound to it (>ZZ Z).
+//
+VOID KbFilter_QueueEngineKeyout(PDEVICE_EXTENSION devExt, USHORT unitId) {
+	PKB_ENGINE engine = devExt->Engine;
+	ULONG start = 0;
+
+	for (ULONG j = 0; j < engine->kcount; j++) {
+		if (engine->keyout[j].key != K_SCROLLLOCK) continue;
+		KbFilter_QueueKeyout(devExt, &engine->keyout[start], j - start, unitId);
+		KbFilter_ModeKey(engine->keyout[j].flag);
+		start = j + 1;
+	}
+	KbFilter_QueueKeyout(devExt, &engine->keyout[start], engine->kcount - start, unitId);
+}
+
+//
+// Cycles through the modes on the release of ScrollLock. Only a release that
+// follows a press seen here counts, so the physical release of the ScrollLock
+// that ended a >ZZ sequence doesn't step the mode a second time.
+//
+VOID KbFilter_ModeKey(USHORT flags) {
+	if ((flags & KEY_BREAK) == 0) {
+		ModeKeyDown = TRUE;
+	} else if (ModeKeyDown) {
+		ModeKeyDown = FALSE;
+		if (++KeyEnabled > 3) KeyEnabled = KEY_MODE_KEYBOARD_OFF;
+	}
+}
+
+// Hands the queued output up, a run at a time where the queue wraps. What
+// kbdclass has no room for stays queued, ahead of any later output, and the
+// drain timer tries again once the raw input thread has had time to read.
+VOID KbFilter_DrainOutput(PDEVICE_EXTENSION devExt) {
+	POUTPUT_QUEUE queue = devExt->Output;
+
+	while (queue->Count) {
+		ULONG run = MIN(queue->Count, OUTPUT_QUEUE_LENGTH - queue->Head);
+		ULONG consumed = KbFilter_Upcall(devExt, &queue->Packets[queue->Head], run);
+
+		queue->Head = (queue->Head + consumed) & (OUTPUT_QUEUE_LENGTH - 1);
+		queue->Count -= consumed;
+
+		if (consumed < run) {
+			queue->Retries++;
+			WdfTimerStart(devExt->DrainTimer, -OUTPUT_RETRY_INTERVAL);
+			break;
+		}
+	}
+}
+
+//
+// Starts typing out a phrase, called with EngineLock held. A phrase started
+// while another one plays replaces what is left of it.
+//
+VOID KbFilter_PlayPhrase(PDEVICE_EXTENSION devExt, PKB_TABLES tables, USHORT phrase, USHORT unitId) {
+	PPHRASE_PLAYBACK playback = devExt->Playback;
+	const CHAR *text;
+	ULONG length;
+
+	text = PhraseText(tables->Phrases, phrase, &length);
+	if (text == NULL) { // an undefined phrase types nothing, and still stops the one playing
+		text = "";
+		length = 0;
+	}
+
+	RtlCopyMemory(playback->Text, text, length + 1);
+	playback->Length = length;
+	playback->Next = 0;
+	playback->UnitId = unitId;
+
+	KbFilter_PlaybackChunk(devExt);
+}
+
+//
+// Queues the next chunk of the playing phrase and arms the timer for the
+// one after, called with EngineLock held. A chunk is half of kbdclass's
+// queue, so the keys typed meanwhile still find room, and it waits until
+// kbdclass has taken the previous one. The port reports the length of the
+// queue in bytes.
+//
+VOID KbFilter_PlaybackChunk(PDEVICE_EXTENSION devExt) {
+	PPHRASE_PLAYBACK playback = devExt->Playback;
+	ULONG chunk = devExt->KeyboardAttributes.InputDataQueueLength / sizeof(KEYBOARD_INPUT_DATA) / 2;
+	ULONG queued = 0;
+	keydata keys[4];
+
+	if (playback->Next >= playback->Length) return;
+
+	if (chunk == 0) chunk = PLAYBACK_CHUNK;
+	if (chunk > OUTPUT_QUEUE_LENGTH / 2) chunk = OUTPUT_QUEUE_LENGTH / 2;
+
+	if (devExt->Output->Count == 0) {
+		while (playback->Next < playback->Length) {
+			ULONG n = KbTextKeys(playback->Text[playback->Next], keys);
+
+			if (queued && queued + n > chunk) break; // a character is never split over two chunks
+			KbFilter_QueueKeyout(devExt, keys, n, playback->UnitId);
+			queued += n;
+			playback->Next++;
+		}
+		KbFilter_DrainOutput(devExt);
+	}
+
+	if (playback->Next < playback->Length) WdfTimerStart(devExt->PlaybackTimer, -PLAYBACK_INTERVAL);
+}
+
+//
+// The config worker is one system thread for the life of the driver. Reload
+// requests only set ConfigWake, so any number of them made while the worker
+// is busy or asleep end in a single load, and the engine sees its result
+// when TablesPublish swaps ActiveTables.
+//
+// The worker also watches C:\Windows for writes to the config files of
+// every profile. An editor saves in bursts of writes and renames, each of them
+// restarts ConfigDebounce, and the file is loaded once it has been quiet.
+//
+NTSTATUS ConfigWorkerStart() {
 	HANDLE hthread;
-	if (PsCreateSystemThread(&hthread, THREAD_ALL_ACCESS, NULL, NULL, NULL, (PKSTART_ROUTINE)LoadConfig, NULL)) {
-		loading_config = 0;
-		KeyEnabled = KEY_MODE_BINDING_ON;
+	NTSTATUS status;
+
+	KeInitializeEvent(&ConfigWake, SynchronizationEvent, FALSE);
+	KeInitializeEvent(&ConfigStop, NotificationEvent, FALSE);
+	KeInitializeTimerEx(&ConfigDebounce, SynchronizationTimer);
+	RtlZeroMemory(&ConfigWatch, sizeof(ConfigWatch));
+
+	// the first load is pending before the worker even starts
+	ConfigRequestReload();
+
+	status = PsCreateSystemThread(&hthread, THREAD_ALL_ACCESS, NULL, NULL, NULL, ConfigWorker, NULL);
+	if (!NT_SUCCESS(status)) return status;
+
+	// the thread object is kept to wait for the worker to end at unload
+	status = ObReferenceObjectByHandle(hthread, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, (PVOID *)&ConfigThread, NULL);
+	ZwClose(hthread);
+	if (!NT_SUCCESS(status)) {
+		KeSetEvent(&ConfigStop, IO_NO_INCREMENT, FALSE);
+		ConfigThread = NULL;
+	}
+	return status;
+}
+
+VOID ConfigWorkerStop() {
+	if (ConfigThread == NULL) return;
+
+	KeSetEvent(&ConfigStop, IO_NO_INCREMENT, FALSE);
+	KeWaitForSingleObject(ConfigThread, Executive, KernelMode, FALSE, NULL);
+	ObDereferenceObject(ConfigThread);
+	ConfigThread = NULL;
+}
+
+// Callable up to DISPATCH_LEVEL, from the service callback
+VOID ConfigRequestReload() {
+	InterlockedIncrement(&ConfigRequests);
+	KeSetEvent(&ConfigWake, IO_NO_INCREMENT, FALSE);
+}
+
+VOID ConfigWorker(PVOID context) {
+	PVOID events[4] = { &ConfigStop, &ConfigWake, &ConfigDebounce, NULL };
+	KWAIT_BLOCK waits[4];
+	LARGE_INTEGER retry, debounce;
+	BOOLEAN missed = FALSE;
+	NTSTATUS status;
+
+	UNREFERENCED_PARAMETER(context);
+
+	KeSetPriorityThread(KeGetCurrentThread(), CONFIG_WORKER_PRIORITY);
+	retry.QuadPart = -CONFIG_WATCH_RETRY;
+	debounce.QuadPart = -CONFIG_DEBOUNCE;
+
+	for (;;) {
+		if (ConfigWatch.Directory == NULL) {
+			if (!ConfigWatchOpen(&ConfigWatch)) {
+				missed = TRUE;
+			} else if (missed) {
+				// C: was not there for the first load, it is now
+				KeSetTimer(&ConfigDebounce, debounce, NULL);
+				missed = FALSE;
+			}
+		}
+
+		// without a watch the wait times out to try again
+		events[3] = ConfigWatch.Event;
+		status = KeWaitForMultipleObjects(ConfigWatch.Directory ? 4 : 3, events, WaitAny, Executive, KernelMode, FALSE,
+			ConfigWatch.Directory ? NULL : &retry, waits);
+
+		if (status == STATUS_WAIT_0) { // stop, the first object satisfies a wait when several are set
+			break;
+		} else if (status == STATUS_WAIT_0 + 1 || status == STATUS_WAIT_0 + 2) { // ~r or a quiet file
+			LONGLONG start = KbFilter_Now();
+			KIRQL irql;
+
+			KeCancelTimer(&ConfigDebounce);
+			LoadConfig();
+
+			// counters are only written at DISPATCH_LEVEL, where the thread stays on its processor
+			KeRaiseIrql(DISPATCH_LEVEL, &irql);
+			StatAdd(Reloads, 1);
+			StatAdd(ReloadTime, KbFilter_Now() - start);
+			KeLowerIrql(irql);
+		} else if (status == STATUS_WAIT_0 + 3) {
+			if (ConfigWatchChanged(&ConfigWatch)) KeSetTimer(&ConfigDebounce, debounce, NULL);
+		}
+	}
+
+	KeCancelTimer(&ConfigDebounce);
+	ConfigWatchClose(&ConfigWatch);
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+//
+// Opens C:\Windows for change notifications and starts the first one.
+// The directory handle is asynchronous, its notifications complete into
+// an event the worker waits on along with its own.
+//
+BOOLEAN ConfigWatchOpen(PCONFIG_WATCH watch) {
+	NTSTATUS ntstatus;
+	IO_STATUS_BLOCK ioStatusBlock;
+	UNICODE_STRING uniName;
+	OBJECT_ATTRIBUTES objAttr;
+
+	InitializeObjectAttributes(&objAttr, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+	ntstatus = ZwCreateEvent(&watch->EventHandle, EVENT_ALL_ACCESS, &objAttr, NotificationEvent, FALSE);
+	if (!NT_SUCCESS(ntstatus)) return FALSE;
+
+	ntstatus = ObReferenceObjectByHandle(watch->EventHandle, EVENT_ALL_ACCESS, *ExEventObjectType, KernelMode, (PVOID *)&watch->Event, NULL);
+	if (!NT_SUCCESS(ntstatus)) {
+		ZwClose(watch->EventHandle);
+		return FALSE;
+	}
+
+	RtlInitUnicodeString(&uniName, L"\\DosDevices\\C:\\Windows");
+	InitializeObjectAttributes(&objAttr, &uniName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+
+	ntstatus = ZwCreateFile(&watch->Directory,
+		FILE_LIST_DIRECTORY, &objAttr, &ioStatusBlock, NULL,
+		0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		FILE_OPEN, FILE_DIRECTORY_FILE, NULL, 0);
+	if (!NT_SUCCESS(ntstatus)) watch->Directory = NULL;
+
+	if (watch->Directory == NULL || !ConfigWatchArm(watch)) {
+		ConfigWatchClose(watch);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOLEAN ConfigWatchArm(PCONFIG_WATCH watch) {
+	NTSTATUS ntstatus;
+
+	// a save can be a write in place, or a new file renamed over the old one
+	ntstatus = ZwNotifyChangeDirectoryFile(watch->Directory, watch->EventHandle, NULL, NULL, &watch->Io,
+		watch->Buffer, sizeof(watch->Buffer),
+		FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE, FALSE);
+	watch->Pending = NT_SUCCESS(ntstatus);
+	return watch->Pending;
+}
+
+//
+// Handles a completed notification and starts the next one. TRUE when it
+// touched a config file, or overflowed and may have.
+//
+BOOLEAN ConfigWatchChanged(PCONFIG_WATCH watch) {
+	static const PCWSTR extensions[2] = { L"txt", L"bin" };
+	NTSTATUS ntstatus = watch->Io.Status;
+	ULONG length = (ULONG)watch->Io.Information;
+	BOOLEAN changed = FALSE;
+	ULONG offset = 0;
+
+	watch->Pending = FALSE;
+	if (!NT_SUCCESS(ntstatus)) { // the volume went away, watched again once it can be opened
+		ConfigWatchClose(watch);
+		return FALSE;
+	}
+
+	if (ntstatus == STATUS_NOTIFY_ENUM_DIR || length == 0) {
+		changed = TRUE; // more changes than the buffer holds
+	} else {
+		while (offset + FIELD_OFFSET(FILE_NOTIFY_INFORMATION, FileName) <= length) {
+			PFILE_NOTIFY_INFORMATION info = (PFILE_NOTIFY_INFORMATION)((PUCHAR)watch->Buffer + offset);
+			UNICODE_STRING name;
+			DECLARE_UNICODE_STRING_SIZE(config, 32);
+
+			if (offset + FIELD_OFFSET(FILE_NOTIFY_INFORMATION, FileName) + info->FileNameLength > length) break;
+			name.Buffer = info->FileName;
+			name.Length = name.MaximumLength = (USHORT)info->FileNameLength;
+			for (ULONG profile = 0; profile < MAX_PROFILES; profile++) {
+				for (ULONG e = 0; e < 2; e++) {
+					ConfigFileName(&config, L"", profile, extensions[e]);
+					if (RtlEqualUnicodeString(&name, &config, TRUE)) changed = TRUE;
+				}
+			}
+
+			if (info->NextEntryOffset == 0) break;
+			offset += info->NextEntryOffset;
+		}
+	}
+
+	if (!ConfigWatchArm(watch)) ConfigWatchClose(watch);
+	return changed;
+}
+
+VOID ConfigWatchClose(PCONFIG_WATCH watch) {
+	if (watch->Directory) {
+		// closing the handle completes an outstanding notification, which still writes Io
+		ZwClose(watch->Directory);
+		if (watch->Pending) KeWaitForSingleObject(watch->Event, Executive, KernelMode, FALSE, NULL);
+		watch->Directory = NULL;
+		watch->Pending = FALSE;
+	}
+	if (watch->Event) {
+		ObDereferenceObject(watch->Event);
+		ZwClose(watch->EventHandle);
+		watch->Event = NULL;
+		watch->EventHandle = NULL;
+	}
+}
+
+// Runs on the config worker, at PASSIVE_LEVEL
+VOID LoadConfig() {
+	PPROFILE_SET set;
+	ULONG saved = 0;
+
+	InterlockedIncrement(&ConfigLoads);
+
+	set = ProfilesAllocate();
+	if (set == NULL) return;
+
+	for (ULONG profile = 0; profile < MAX_PROFILES; profile++) {
+		// a compiled kbfiltr.bin is used when installed, kbfiltr.txt is the fallback
+		PKB_TABLES tables = LoadImage(profile);
+		if (tables == NULL) tables = LoadText(profile);
+
+		// layers a profile has in common with an earlier one are kept once
+		if (tables) saved += KbTablesShare(tables, set->Tables, profile);
+		set->Tables[profile] = tables;
+	}
+	if (saved) DebugPrint(("kbfiltr: profiles share %u bytes of tables\n", saved));
+
+	// the live tables stay untouched until the new set is complete, a failed load keeps them
+	if (set->Tables[0] == NULL) {
+		ProfilesFree(set);
+		return;
+	}
+	InstallProfiles(set);
+}
+
+// Makes a complete profile set the live one, at PASSIVE_LEVEL
+VOID InstallProfiles(PPROFILE_SET set) {
+	ULONG profile = ActiveProfile;
+
+	// settings and tables of the same set, whoever installs last
+	ExAcquireFastMutex(&ConfigLock);
+	ApplySettings(set->Tables[profile] ? set->Tables[profile] : set->Tables[0]);
+	TablesPublish(set);
+	ExReleaseFastMutex(&ConfigLock);
+
+	InterlockedIncrement(&ConfigLoaded);
+}
+
+//
+// Installs binding images handed in by user mode, one per profile back to
+// back, each as long as its header says. The caller's buffer is copied, the
+// tables keep pointing into the copies.
+//
+NTSTATUS InstallImage(PVOID buffer, ULONG size) {
+	NTSTATUS status = STATUS_SUCCESS;
+	PPROFILE_SET set;
+	ULONG offset = 0;
+
+	if (size == 0 || size > MAX_IMAGE_SIZE) return STATUS_INVALID_BUFFER_SIZE;
+
+	set = ProfilesAllocate();
+	if (set == NULL) return STATUS_INSUFFICIENT_RESOURCES;
+
+	for (ULONG profile = 0; offset < size; profile++) {
+		PKB_IMAGE_HEADER header = (PKB_IMAGE_HEADER)((PUCHAR)buffer + offset);
+		ULONG length = size - offset;
+		PVOID image;
+
+		if (profile == MAX_PROFILES || length < sizeof(KB_IMAGE_HEADER) || header->Size < sizeof(KB_IMAGE_HEADER) || header->Size > length) {
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		length = header->Size;
+
+		// the engine reads the layers in place at DISPATCH_LEVEL
+		image = ExAllocatePoolWithTag(NonPagedPoolNx, length, KBFILTER_POOL_TAG);
+		if (image == NULL) {
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			break;
+		}
+		RtlCopyMemory(image, header, length);
+
+		set->Tables[profile] = KbImageLoad(image, length);
+		if (set->Tables[profile] == NULL) {
+			ExFreePoolWithTag(image, KBFILTER_POOL_TAG);
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		KbTablesShare(set->Tables[profile], set->Tables, profile);
+		offset += length;
+	}
+
+	if (!NT_SUCCESS(status)) {
+		ProfilesFree(set);
+		return status;
+	}
+	InstallProfiles(set);
+	return STATUS_SUCCESS;
+}
+
+//
+// Switches the engine of every keyboard to another loaded profile, from any
+// IRQL up to DISPATCH_LEVEL. Only an index changes, the next TablesAcquire
+// returns the tables of the profile. FALSE when the profile has no config.
+//
+BOOLEAN ProfileSelect(ULONG profile) {
+	PPROFILE_SET set;
+	BOOLEAN loaded = FALSE;
+	KIRQL irql;
+
+	if (profile >= MAX_PROFILES) return FALSE;
+
+	// a reader of the set, which can't be freed while its settings are read
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	TablesAcquire();
+	set = *(PPROFILE_SET volatile *)&ActiveProfiles;
+	if (set->Tables[profile]) {
+		InterlockedExchange(&ActiveProfile, (LONG)profile);
+		ApplySettings(set->Tables[profile]);
+		loaded = TRUE;
+	}
+	TablesRelease();
+	KeLowerIrql(irql);
+
+	return loaded;
+}
+
+PPROFILE_SET ProfilesAllocate() {
+	// TablesAcquire reads it at DISPATCH_LEVEL
+	PPROFILE_SET set = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(PROFILE_SET), KBFILTER_POOL_TAG);
+
+	if (set) RtlZeroMemory(set, sizeof(PROFILE_SET));
+	return set;
+}
+
+// Frees every profile of a set together, they may share blocks
+VOID ProfilesFree(PPROFILE_SET set) {
+	if (set == &EmptyProfiles) return;
+
+	for (ULONG profile = 0; profile < MAX_PROFILES; profile++) {
+		if (set->Tables[profile]) TablesFree(set->Tables[profile]);
 	}
+	ExFreePoolWithTag(set, KBFILTER_POOL_TAG);
+}
+
+// kbfiltr.<extension> for profile 0, kbfiltr<profile>.<extension> for the others
+VOID ConfigFileName(PUNICODE_STRING name, PCWSTR directory, ULONG profile, PCWSTR extension) {
+	if (profile == 0) RtlUnicodeStringPrintf(name, L"%wskbfiltr.%ws", directory, extension);
+	else RtlUnicodeStringPrintf(name, L"%wskbfiltr%u.%ws", directory, profile, extension);
 }
 
-INT LoadConfig() {
+//
+// Reads the kbfiltr.bin of a profile with a single read, NULL when it is missing or invalid
+//
+PKB_TABLES LoadImage(ULONG profile) {
 	HANDLE   handle;
 	NTSTATUS ntstatus;
 	IO_STATUS_BLOCK ioStatusBlock;
+	FILE_STANDARD_INFORMATION fileInfo;
 	LARGE_INTEGER byteOffset;
-
-	// Do not try to perform any file operations at higher IRQL levels.
-	// Instead, you may use a work item or a system worker thread to perform file operations.
-	UNICODE_STRING uniName;
+	DECLARE_UNICODE_STRING_SIZE(uniName, 64);
 	OBJECT_ATTRIBUTES objAttr;
+	PKB_TABLES tables = NULL;
+	PVOID image;
+	ULONG size;
 
-	RtlInitUnicodeString(&uniName, L"\\DosDevices\\C:\\Windows\\kbfiltr.txt");
+	ConfigFileName(&uniName, L"\\DosDevices\\C:\\Windows\\", profile, L"bin");
 	InitializeObjectAttributes(&objAttr, &uniName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
 
-	if (KeGetCurrentIrql() != PASSIVE_LEVEL) {
-		loading_config = 2;
-		PsTerminateSystemThread(STATUS_SUCCESS);
-		return STATUS_INVALID_DEVICE_STATE;
+	ntstatus = ZwCreateFile(&handle,
+		GENERIC_READ, &objAttr, &ioStatusBlock, NULL, 
+		FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, 
+		FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT, NULL, 0);
+	if (!NT_SUCCESS(ntstatus)) return NULL;
+
+	ntstatus = ZwQueryInformationFile(handle, &ioStatusBlock, &fileInfo, sizeof(fileInfo), FileStandardInformation);
+	if (!NT_SUCCESS(ntstatus) || fileInfo.EndOfFile.QuadPart > MAX_IMAGE_SIZE) {
+		ZwClose(handle);
+		return NULL;
+	}
+	size = fileInfo.EndOfFile.LowPart;
+
+	// the engine reads the layers in place at DISPATCH_LEVEL
+	image = ExAllocatePoolWithTag(NonPagedPoolNx, size ? size : 1, KBFILTER_POOL_TAG);
+	if (image == NULL) {
+		ZwClose(handle);
+		return NULL;
 	}
 
+	byteOffset.QuadPart = 0;
+	ntstatus = ZwReadFile(handle, NULL, NULL, NULL, &ioStatusBlock, image, size, &byteOffset, NULL);
+	ZwClose(handle);
+
+	if (NT_SUCCESS(ntstatus) && ioStatusBlock.Information == size) tables = KbImageLoad(image, size);
+	if (tables == NULL) ExFreePoolWithTag(image, KBFILTER_POOL_TAG);
+
+	return tables;
+}
+
+//
+// Parses the kbfiltr.txt of a profile, NULL when it is missing or can't be read completely
+//
+PKB_TABLES LoadText(ULONG profile) {
+	HANDLE   handle;
+	NTSTATUS ntstatus;
+	IO_STATUS_BLOCK ioStatusBlock;
+	LARGE_INTEGER byteOffset;
+	DECLARE_UNICODE_STRING_SIZE(uniName, 64);
+	OBJECT_ATTRIBUTES objAttr;
+	KB_PARSER parser;
+	PCHAR chunk;
+
+	ConfigFileName(&uniName, L"\\DosDevices\\C:\\Windows\\", profile, L"txt");
+	InitializeObjectAttributes(&objAttr, &uniName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+
 	ntstatus = ZwCreateFile(&handle,
 		GENERIC_READ, &objAttr, &ioStatusBlock, NULL, 
 		FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, 
 		FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT, NULL, 0);
+	if (!NT_SUCCESS(ntstatus)) return NULL;
 
-	if (!NT_SUCCESS(ntstatus)) {
-		loading_config = 2;
-		PsTerminateSystemThread(STATUS_SUCCESS);
-		return 0;
+	chunk = ExAllocatePoolWithTag(PagedPool, CONFIG_CHUNK_SIZE, KBFILTER_POOL_TAG);
+	if (chunk == NULL || !KbConfigBegin(&parser)) {
+		if (chunk) ExFreePoolWithTag(chunk, KBFILTER_POOL_TAG);
+		ZwClose(handle);
+		return NULL;
 	}
 
-	byteOffset.LowPart = byteOffset.HighPart = 0;
-	ntstatus = ZwReadFile(handle, NULL, NULL, NULL, &ioStatusBlock, buffer, CONFIG_BUFFER_SIZE, &byteOffset, NULL);
+	// the file is read one chunk at a time, the parser keeps its line state between chunks
+	byteOffset.QuadPart = 0;
+	for (;;) {
+		ntstatus = ZwReadFile(handle, NULL, NULL, NULL, &ioStatusBlock, chunk, CONFIG_CHUNK_SIZE, &byteOffset, NULL);
+		if (!NT_SUCCESS(ntstatus) || ioStatusBlock.Information == 0) break;
+
+		KbConfigParse(&parser, chunk, (ULONG)ioStatusBlock.Information);
+		byteOffset.QuadPart += ioStatusBlock.Information;
+	}
 	ZwClose(handle);
-	buffer[CONFIG_BUFFER_SIZE - 1] = '\0';
-
-	// parse the file
-	// key bindings
-	// key binding for each key with no function key
-	// bindings lay on top of the standard QWERTY keys
-	// syntax: 
-	// " signifies start of comment
-	// # hold <a> then <;> to trigger <enter>
-	// a; N	" hold a + ; = enter
-	// af E " hold a + f = esc 
-	// ~l 1	" set layer to 1, subsequent bindings will be for this layer 1
-	// ~l 2	" set layer to 2, subsequent bindings will be for this layer 2
-	// ~l 0	" set layer to 0, subsequent bindings will be for this layer 0
-	// ~l * " set for all layers 
-	// vj ~l 0 " ~ = function call, l = change layer, 0 = argument (layer 0)
-	// j  2	" single key binding: key<space><space>binding
-	// jj e " key hold binding: hold j for long key time for 'e' binding
-	// Q " stored command for recall
-
-	int len = strlen(buffer);
-	BOOLEAN commenton = FALSE;
-	int i = 0;
-	int l = 0;
-	int cmdlen = 0;
-	int _layer = 0;
-	USHORT key1 = 0, key2 = 0;
-	USHORT cmd[CMD_LEN];
-	memset(cmd, 0, CMD_LEN);
-	memset(bindings, 0, sizeof(struct_binding) * MAX_LAYERS * MAX_KEYS * MAX_KEYS);
-	memset(phrases, 0, PHRASE_MAX * PHRASE_LEN);
-
-	while (i < len) {
-		char c = buffer[i++];
-		if (c == '\r' || c == '\t') continue;
-
-		if (c == '\n' || c == '\0') {
-			if (key1) {
-				if (key1 == K_VARIABLE) { // ~ 
-					// use the file to set some system variables
-					char str[CMD_LEN];
-					memset(str, 0, CMD_LEN);
-					memcpy(str, cmd, CMD_LEN);
-
-					// Key bind time 
-					if (key2 == K_T) {
-						ULONG value = atoi(str);
-						key_bind_time = value;
-					} else if (key2 == K_D) { // longkey time
-						ULONG value = atoi(str);
-						longkey_time = value;
-					} else if (key2 == K_R) {// key repeat time
-						ULONG value = atoi(str);
-						key_repeat_time = value;
-					} else if (key2 == K_O) {// key timeout
-						ULONG value = atoi(str);
-						key_bind_timeout = value;
-					} else if (key2 == K_S) {// safe mode during config load 1 = on 0 = off 
-						ULONG value = atoi(str);
-						safe_mode = value;
-					} else if (key2 == K_C) {// 1 capslock works as left shift, 0 use capslock as normal 
-						ULONG value = atoi(str);
-						capslock_to_lshift = value;
-					} else if (key2 == K_L) { // set binding layer 
-					 // all layers
-						if (str[0] == '*') {
-							_layer = ALL_LAYERS;
-						} else {
-							ULONG value = atoi(str);
-							_layer = min(value, MAX_LAYERS - 1);
-						}
-					} else if (key2 == K_COMMAND) {// set command sequence  
-						memcpy(commands[keymap[str[0]]], &str[1], COMMAND_LEN);
-					} else {
-						// TODO combo hotkey phrase inserts
-						// TODO control mouse buttons and movement
-					}
-				} else {
-					if (cmdlen >= 4 && cmd[0] != '~') { // key binding by HEX codes 
-						// 2 byte HEX codes = 4 characters
-						//example E05B = LWIN
-						int start_layer = 0, end_layer = MAX_LAYERS - 1;
-						if (_layer != ALL_LAYERS) start_layer = end_layer = _layer;
-						for (int i = start_layer; i <= end_layer; i++) {
-							bindings[i][key1][K_ENABLED].out1 = K_BOUND;
-							bindings[i][key1][key2].out1 = (hex2dec[cmd[2]] << 4) + hex2dec[cmd[3]];
-							bindings[i][key1][key2].flag1 = (hex2dec[cmd[0]] << 4) + hex2dec[cmd[1]];
-							bindings[i][key1][key2].out2 = 0;
-						}
-					} else { // key binding
-						if (key2 == K_UNDEFINED) key2 = K_SINGLE;
-
-						int start_layer = 0, end_layer = MAX_LAYERS - 1;
-						if (_layer != ALL_LAYERS) start_layer = end_layer = _layer;
-						for (int i = start_layer; i <= end_layer; i++) {
-							if (cmd[0]) {
-								bindings[i][key1][K_ENABLED].out1 = K_BOUND;
-								bindings[i][key1][key2].out1 = keymap[cmd[0]];
-								bindings[i][key1][key2].flag1 = 0;
-							}
-							if (cmd[1]) bindings[i][key1][key2].out2 = keymap[cmd[1]];
-							if (cmd[2]) bindings[i][key1][key2].out3 = keymap[cmd[2]];
-							if (cmd[3] && cmd[3] != ' ') {
-								char str[CMD_LEN];
-								sprintf(str, "%c", cmd[3]);
-								ULONG value = atoi(str);
-								bindings[i][key1][key2].arg1 = (USHORT)value;
-							}
-						}
-					}
-				}
-			}
-			memset(cmd, 0, CMD_LEN);
+	ExFreePoolWithTag(chunk, KBFILTER_POOL_TAG);
 
-			cmdlen = l = 0;
-			key2 = key1 = K_UNDEFINED;
-			commenton = FALSE;
-		} else {
-			if (!commenton) {
-				if (c == '"') commenton = TRUE;
-				else if (l == 0 && c != ' ') key1 = keymap[c];
-				else if (l == 1 && c != ' ') key2 = keymap[c];
-				// l == 2, c = ' '
-				else if ((key2 == K_UNDEFINED) && (l >= 2)) { // single key command
-					cmd[l - 2] = c;
-					cmdlen++;
-				}
-				else if ((key2 != K_UNDEFINED) && (l >= 3)) { // 2 key command
-					cmd[l - 3] = c;
-					cmdlen++;
-				}
-			}
-			l++;
+	if (!NT_SUCCESS(ntstatus) && ntstatus != STATUS_END_OF_FILE) { // read error
+		KbConfigAbort(&parser);
+		return NULL;
+	}
+
+	if (parser.errors) DebugPrint(("kbfiltr: %wZ has %u errors\n", &uniName, parser.errors));
+	return KbConfigEnd(&parser);
+}
+
+//
+// The engine takes a reference on the profile set for the length of one
+// service callback or timer run. LoadConfig swaps ActiveProfiles and frees
+// the old set once all of those have dropped their reference.
+//
+// Called at DISPATCH_LEVEL under an EngineLock, so TablesRelease runs on the same processor
+PKB_TABLES TablesAcquire() {
+	ULONG slot = KeGetCurrentProcessorNumberEx(NULL);
+	PPROFILE_SET set;
+	PKB_TABLES tables;
+
+	if (slot >= TableReaderSlots) slot = 0;
+	InterlockedIncrement(&TableReaders[slot].Count); // orders the read below after the count
+	set = *(PPROFILE_SET volatile *)&ActiveProfiles;
+	tables = set->Tables[*(LONG volatile *)&ActiveProfile];
+	return tables ? tables : set->Tables[0];
+}
+
+VOID TablesRelease() {
+	ULONG slot = KeGetCurrentProcessorNumberEx(NULL);
+
+	if (slot >= TableReaderSlots) slot = 0;
+	InterlockedDecrement(&TableReaders[slot].Count);
+}
+
+VOID TablesPublish(PPROFILE_SET set) {
+	PPROFILE_SET old = InterlockedExchangePointer((PVOID *)&ActiveProfiles, set);
+	LARGE_INTEGER interval;
+
+	// a reader counted now may still hold old, anyone acquiring later sees set;
+	// once a processor's count has been 0, none of its readers can hold old
+	interval.QuadPart = -10000; // 1 ms
+	for (ULONG slot = 0; slot < TableReaderSlots; slot++) {
+		while (InterlockedCompareExchange(&TableReaders[slot].Count, 0, 0) != 0) {
+			KeDelayExecutionThread(KernelMode, FALSE, &interval);
 		}
 	}
+	ProfilesFree(old);
+}
 
-	config_loaded = 1;
-	loading_config = 2;
-	PsTerminateSystemThread(STATUS_SUCCESS);
-	return 0;
+//
+// Sums the counters of every processor. Nothing is locked, a processor
+// counting at the same time may have its latest step left out.
+//
+VOID StatsCollect(PKBFILTR_STATS total) {
+	RtlZeroMemory(total, sizeof(KBFILTR_STATS));
+
+	for (ULONG slot = 0; slot < CpuStatSlots; slot++) {
+		volatile ULONG64 *counters = (volatile ULONG64 *)&CpuStats[slot].Stats;
+
+		for (ULONG n = 0; n < sizeof(KBFILTR_STATS) / sizeof(ULONG64); n++) ((PULONG64)total)[n] += counters[n];
+	}
 }
 
+//
+// Counts a service callback of cycles in the histogram of its series, under
+// EngineLock. The bucket is the position of the highest bit and the two bits
+// below it, see KBFILTR_LATENCY_BUCKET_LOW.
+//
+VOID LatencyRecord(PKBFILTR_LATENCY latency, ULONG series, ULONG64 cycles) {
+	ULONG high, bucket;
+
+	if (cycles < 4) {
+		bucket = (ULONG)cycles;
+	} else {
+		if (cycles >> 32) {
+			_BitScanReverse(&high, (ULONG)(cycles >> 32));
+			high += 32;
+		} else {
+			_BitScanReverse(&high, (ULONG)cycles);
+		}
+		bucket = MIN(high * 4 + (ULONG)((cycles >> (high - 2)) & 3), KBFILTR_LATENCY_BUCKETS - 1);
+	}
+	latency->Buckets[series][bucket]++;
+	if (cycles > latency->Max[series]) latency->Max[series] = cycles;
+}
 
-ULONG atoi(char* str)
-{
-	WCHAR wstr[CMD_LEN];
-	UNICODE_STRING ustr;
-	ULONG value = 0;
+VOID TablesFree(PKB_TABLES tables) {
+	if (tables == &EmptyTables) return;
 
-	swprintf(wstr, L"%s", str);
-	RtlInitUnicodeString(&ustr, wstr);
-	RtlUnicodeStringToInteger(&ustr, 10, &value); // base 10
+	KbTablesFree(tables);
+}
 
-	return value;
+// Makes the ~ settings of a table set the current ones
+VOID ApplySettings(PKB_TABLES tables)
+{
+	key_bind_time = tables->Settings.key_bind_time;
+	longkey_time = tables->Settings.longkey_time;
+	key_repeat_time = tables->Settings.key_repeat_time;
+	key_bind_timeout = tables->Settings.key_bind_timeout;
+	safe_mode = tables->Settings.safe_mode;
+	capslock_to_lshift = tables->Settings.capslock_to_lshift;
 }
 
 VOID Initialize()
 {
-	// some special characters for system settings
-	// settings in the config file overrides the default
-	keymap['~'] = K_VARIABLE; // Or for command it means internal command/function call
-
-	keymap[' '] = ' ';
-
-	// Non-obvious keys
-	keymap['A'] = K_LALT;
-	keymap['B'] = K_BACKSPACE;
-	keymap['C'] = K_LCTRL;
-	keymap['D'] = K_DEL;
-	keymap['E'] = K_ESC;
-	keymap['F'] = K_CAPSLOCK;
-	keymap['G'] = K_RSHIFT;
-	keymap['I'] = K_LSHIFT;
-	keymap['H'] = K_LEFT;
-	keymap['J'] = K_DOWN;
-	keymap['K'] = K_UP;
-	keymap['L'] = K_RIGHT;
-	keymap['M'] = K_INS;
-	keymap['N'] = K_ENTER;
-	keymap['O'] = K_HOME;
-	keymap['P'] = K_END;
-	keymap['Q'] = K_COMMAND;
-	keymap['R'] = K_RSHIFT;
-	keymap['S'] = K_SPACE;
-	keymap['T'] = K_TAB;
-	keymap['U'] = K_PGUP;
-	keymap['V'] = K_PGDN;
-	keymap['W'] = K_LWIN;
-	keymap['X'] = K_NUMLOCK;
-	keymap['Z'] = K_SCROLLLOCK;
-	//keymap[' '] = K_SPACE;
-	//keymap['\n'] = K_ENTER;
-
-	// F keys
-	keymap['!'] = K_F1;
-	keymap['@'] = K_F2;
-	keymap['#'] = K_F3;
-	keymap['$'] = K_F4;
-	keymap['%'] = K_F5;
-	keymap['^'] = K_F6;
-	keymap['&'] = K_F7;
-	keymap['*'] = K_F8;
-	keymap['('] = K_F9;
-	keymap[')'] = K_F10;
-	keymap['_'] = K_F11;
-	keymap['+'] = K_F12;
-
-
-	// alphas
-	keymap['a'] = K_A;
-	keymap['b'] = K_B;
-	keymap['c'] = K_C;
-	keymap['d'] = K_D;
-	keymap['e'] = K_E;
-	keymap['f'] = K_F;
-	keymap['g'] = K_G;
-	keymap['h'] = K_H;
-	keymap['i'] = K_I;
-	keymap['j'] = K_J;
-	keymap['k'] = K_K;
-	keymap['l'] = K_L;
-	keymap['m'] = K_M;
-	keymap['n'] = K_N;
-	keymap['o'] = K_O;
-	keymap['p'] = K_P;
-	keymap['q'] = K_Q;
-	keymap['r'] = K_R;
-	keymap['s'] = K_S;
-	keymap['t'] = K_T;
-	keymap['u'] = K_U;
-	keymap['v'] = K_V;
-	keymap['w'] = K_W;
-	keymap['x'] = K_X;
-	keymap['y'] = K_Y;
-	keymap['z'] = K_Z;
-
-	// numerics
-	keymap['0'] = K_0;
-	keymap['1'] = K_1;
-	keymap['2'] = K_2;
-	keymap['3'] = K_3;
-	keymap['4'] = K_4;
-	keymap['5'] = K_5;
-	keymap['6'] = K_6;
-	keymap['7'] = K_7;
-	keymap['8'] = K_8;
-	keymap['9'] = K_9;
-
-	// punctuations
-	keymap['`'] = K_TILDA;
-	keymap['-'] = K_MINUS;
-	keymap['='] = K_EQUAL;
-	keymap['['] = K_SQUARE_L;
-	keymap[']'] = K_SQUARE_R;
-	keymap['\\'] = K_BACKSLASH;
-	keymap[';'] = K_SEMICOLON;
-	keymap['\''] = K_QUOTE;
-	keymap[','] = K_COMMA;
-	keymap['.'] = K_PERIOD;
-	keymap['/'] = K_SLASH;
+	// the keymap of the diagnostic mode messages, config tables carry their own
+	KbDefaultKeymap(keymap);
 
 	// default initialization
-	layer = 0;
-	pause = FALSE;
-	key1 = 0;
-	key2 = 0;
-	key_bind_time = 10; 
-	longkey_time = 10; 
-	key_bind_timeout = 50;  
-	key_repeat_time = 30;
-	safe_mode = SETTING_ON;
-	capslock_to_lshift = SETTING_OFF;
-	reload_config = SETTING_OFF;
-	loading_config = 0;
-	config_loaded = 0;
-	last_packet_length = 0;
-
-	// hex to dec
-	hex2dec['0'] = 0x00;
-	hex2dec['1'] = 0x01;
-	hex2dec['2'] = 0x02;
-	hex2dec['3'] = 0x03;
-	hex2dec['4'] = 0x04;
-	hex2dec['5'] = 0x05;
-	hex2dec['6'] = 0x06;
-	hex2dec['7'] = 0x07;
-	hex2dec['8'] = 0x08;
-	hex2dec['9'] = 0x09;
-	hex2dec['a'] = hex2dec['A'] = 0x0A;
-	hex2dec['b'] = hex2dec['B'] = 0x0B;
-	hex2dec['c'] = hex2dec['C'] = 0x0C;
-	hex2dec['d'] = hex2dec['D'] = 0x0D;
-	hex2dec['e'] = hex2dec['E'] = 0x0E;
-	hex2dec['f'] = hex2dec['F'] = 0x0F;
+	KbDefaultKeymap(EmptyTables.keymap);
+	KbDefaultSettings(&EmptyTables.Settings);
+	ApplySettings(&EmptyTables);
+	EmptyProfiles.Tables[0] = &EmptyTables;
+	ActiveProfiles = &EmptyProfiles;
+	ActiveProfile = 0;
+
+	// a reader count per processor, a single shared one if that can't be had
+	TableReaderSlots = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	TableReaders = ExAllocatePoolWithTag(NonPagedPoolNxCacheAligned, TableReaderSlots * sizeof(TABLE_READERS), KBFILTER_POOL_TAG);
+	if (TableReaders == NULL) {
+		TableReaders = &SharedReaders;
+		TableReaderSlots = 1;
+	}
+	RtlZeroMemory(TableReaders, TableReaderSlots * sizeof(TABLE_READERS));
+
+	// the same for the counters
+	CpuStatSlots = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	CpuStats = ExAllocatePoolWithTag(NonPagedPoolNxCacheAligned, CpuStatSlots * sizeof(CPU_STATS), KBFILTER_POOL_TAG);
+	if (CpuStats == NULL) {
+		CpuStats = &SharedStats;
+		CpuStatSlots = 1;
+	}
+	RtlZeroMemory(CpuStats, CpuStatSlots * sizeof(CPU_STATS));
+
+	LatencyCycleBase = ReadTimeStampCounter();
+	LatencyTimeBase = KbFilter_Now();
+
+	ExInitializeFastMutex(&ConfigLock);
+	ConfigThread = NULL;
+	ConfigRequests = 0;
+	ConfigLoads = 0;
+	ConfigLoaded = 0;
 }
\ No newline at end of file
@@ -38,23 +38,28 @@ Environment:
 
 #include "public.h"
 
-#define KBFILTER_POOL_TAG (ULONG) 'tlfK'
+#include "kbtypes.h"
+#include "kbkeys.h"
+#include "bindidx.h"
+#include "chordtrie.h"
+#include "seqdfa.h"
+#include "cmdvm.h"
+#include "kbconfig.h"
+#include "kbimage.h"
+#include "kbengine.h"
 
 #if DBG
 
 #define TRAP()                      DbgBreakPoint()
 
-#define DebugPrint(_x_) DbgPrint _x_
-
 #else   // DBG
 
 #define TRAP()
 
-#define DebugPrint(_x_)
-
 #endif
 
 #define MIN(_A_,_B_) (((_A_) < (_B_)) ? (_A_) : (_B_))
+#define MAX(_A_,_B_) (((_A_) > (_B_)) ? (_A_) : (_B_))
 
 typedef struct _DEVICE_EXTENSION
 {
@@ -65,6 +70,13 @@ typedef struct _DEVICE_EXTENSION
     //
     WDFQUEUE rawPdoQueue;
 
+    //
+    // Manual queue of the IOCTL_KBFILTR_WAIT_NOTIFICATION requests apps
+    // park through the rawPdo, one is completed per engine event
+    //
+    WDFQUEUE NotifyQueue;
+    ULONG NotifySequence;   // engine events so far, guarded by EngineLock
+
     //
     // Number of creates sent down
     //
@@ -102,6 +114,61 @@ typedef struct _DEVICE_EXTENSION
     //
     KEYBOARD_ATTRIBUTES KeyboardAttributes;
 
+    //
+    // ClassService calls made and packets handed up with them,
+    // UpcallPackets / UpcallCount is the batching factor
+    //
+    LONG UpcallCount;
+    LONG UpcallPackets;
+
+    //
+    // Chord state of this keyboard, in a cache aligned block of its own so
+    // keyboards typing on different processors share no written lines
+    //
+    PKB_ENGINE Engine;
+    ULONG LastPacketLength;
+
+    //
+    // Output waiting to be handed up to kbdclass, guarded by EngineLock
+    //
+    struct _OUTPUT_QUEUE *Output;
+
+    //
+    // Serializes the binding engine between the service callback and the
+    // hold timer, which resolves a held key1 at the engine's deadline and
+    // goes on with a ~Q program that waits
+    //
+    WDFSPINLOCK EngineLock;
+    WDFTIMER HoldTimer;
+    USHORT HoldUnitId;
+
+    //
+    // Resubmits queued output kbdclass did not consume
+    //
+    WDFTIMER DrainTimer;
+
+    //
+    // A ~i phrase being typed out, a chunk per PlaybackTimer run,
+    // guarded by EngineLock
+    //
+    struct _PHRASE_PLAYBACK *Playback;
+    WDFTIMER PlaybackTimer;
+
+    //
+    // Event ring mapped into monitoring applications through the raw PDO.
+    // Written under EngineLock, and only while RingReaders is non-zero
+    //
+    PKBFILTR_RING Ring;
+    PMDL RingMdl;
+    ULONG RingHead;         // the driver's own copy, Ring->Head is only published
+    LONG RingReaders;
+
+    //
+    // Service callback latency per path, read and reset through the raw
+    // PDO, written under EngineLock
+    //
+    PKBFILTR_LATENCY Latency;
+
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_EXTENSION, FilterGetData)
@@ -122,6 +189,7 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(WORKER_ITEM_CONTEXT, GetWorkItemContext)
 DRIVER_INITIALIZE DriverEntry;
 
 EVT_WDF_DRIVER_DEVICE_ADD KbFilter_EvtDeviceAdd;
+EVT_WDF_DRIVER_UNLOAD KbFilter_EvtDriverUnload;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL KbFilter_EvtIoDeviceControlForRawPdo;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL KbFilter_EvtIoDeviceControlFromRawPdo;
 EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL KbFilter_EvtIoInternalDeviceControl;
@@ -157,6 +225,28 @@ KbFilter_ServiceCallback(
 EVT_WDF_REQUEST_COMPLETION_ROUTINE
 KbFilterRequestCompletionRoutine;
 
+EVT_WDF_TIMER KbFilter_EvtHoldTimer;
+EVT_WDF_TIMER KbFilter_EvtDrainTimer;
+EVT_WDF_TIMER KbFilter_EvtPlaybackTimer;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP KbFilter_EvtDeviceCleanup;
+EVT_WDF_IO_IN_CALLER_CONTEXT KbFilter_EvtIoInCallerContextForRawPdo;
+EVT_WDF_FILE_CLEANUP KbFilter_EvtFileCleanupForRawPdo;
+
+ULONG KbFilter_Upcall(PDEVICE_EXTENSION devExt, PKEYBOARD_INPUT_DATA data, ULONG count);
+BOOLEAN KbFilter_ReserveOutput(PDEVICE_EXTENSION devExt, ULONG n);
+VOID KbFilter_QueuePacket(PDEVICE_EXTENSION devExt, PKEYBOARD_INPUT_DATA packet);
+VOID KbFilter_QueueKeyout(PDEVICE_EXTENSION devExt, const keydata *keys, ULONG n, USHORT unitId);
+VOID KbFilter_QueueEngineKeyout(PDEVICE_EXTENSION devExt, USHORT unitId);
+VOID KbFilter_ModeKey(USHORT flags);
+VOID KbFilter_DrainOutput(PDEVICE_EXTENSION devExt);
+VOID KbFilter_PlayPhrase(PDEVICE_EXTENSION devExt, PKB_TABLES tables, USHORT phrase, USHORT unitId);
+VOID KbFilter_PlaybackChunk(PDEVICE_EXTENSION devExt);
+VOID KbFilter_ArmHoldTimer(PDEVICE_EXTENSION devExt, LONGLONG due, USHORT unitId);
+BOOLEAN KbFilter_EngineRequests(PDEVICE_EXTENSION devExt, PKB_TABLES tables, USHORT unitId);
+VOID KbFilter_EngineNotify(PDEVICE_EXTENSION devExt);
+LONGLONG KbFilter_Now();
+VOID KbFilter_RingWrite(PDEVICE_EXTENSION devExt, PKEYBOARD_INPUT_DATA data, ULONG count, USHORT direction);
+
 
 //
 // IOCTL Related defintions
@@ -191,6 +281,20 @@ typedef struct _RPDO_DEVICE_DATA
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(RPDO_DEVICE_DATA, PdoGetData)
 
+typedef struct _RING_FILE_CONTEXT
+{
+    //
+    // Mapping of the parent's event ring made for this handle, if any,
+    // and the process it was made in, referenced until it is unmapped.
+    // Process is claimed first so only one request on the handle maps.
+    //
+    PVOID UserAddress;
+    PEPROCESS Process;
+
+} RING_FILE_CONTEXT, *PRING_FILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(RING_FILE_CONTEXT, RingFileGetData)
+
 
 NTSTATUS
 KbFiltr_CreateRawPdo(
@@ -198,63 +302,142 @@ KbFiltr_CreateRawPdo(
     ULONG           InstanceNo
 );
 
-#define MAX_KB_INPUT_DATA	64	
-#define MAX_KEYOUT			128	
-#define MAX_LAYERS			5
-#define MAX_KEYS			256	
-#define CMD_LEN				16	
-#define MSG_LEN				260	
-#define CONFIG_BUFFER_SIZE	10000
-#define PHRASE_LEN			256
-#define PHRASE_MAX			10	
-#define COMMAND_LEN			16	
+NTSTATUS
+KbFilter_LoadImageRequest(
+    WDFREQUEST      Request,
+    size_t          InputBufferLength
+);
 
+NTSTATUS
+KbFilter_SetProfileRequest(
+    WDFREQUEST      Request,
+    size_t          InputBufferLength
+);
 
-typedef struct _keydata {
-	USHORT key;
-	USHORT flag;
-} keydata;
+NTSTATUS
+KbFilter_GetStatsRequest(
+    WDFREQUEST      Request,
+    size_t          OutputBufferLength
+);
 
-keydata Keydata(USHORT k, USHORT f);
+NTSTATUS
+KbFilter_GetLatencyRequest(
+    WDFDEVICE       Device,
+    WDFREQUEST      Request,
+    size_t          InputBufferLength,
+    size_t          OutputBufferLength
+);
 
-// keybindings 2D matrix
-typedef struct binding {
-	USHORT out1;
-	USHORT out2;
-	USHORT out3;
-	USHORT flag1;
-	USHORT arg1;
-} struct_binding;
+VOID
+KbFilter_MapEventRing(
+    WDFDEVICE       Device,
+    WDFREQUEST      Request
+);
 
+#define MSG_LEN				260	
+#define MAX_PACKET_OUTPUT	(2 * MSG_LEN)	// most one input packet can produce, a diagnostic message
+#define OUTPUT_QUEUE_LENGTH	1024	// a power of two, at least MAX_PACKET_OUTPUT
+#define OUTPUT_RETRY_INTERVAL	10000	// 1 ms in 100ns, before output kbdclass had no room for is sent again
+#define PLAYBACK_INTERVAL	50000	// 5 ms in 100ns, between the chunks of a phrase
+#define PLAYBACK_CHUNK		32		// packets per chunk when the port reported no queue length
+#define CONFIG_CHUNK_SIZE	4096	// LoadConfig reads the file in chunks of this size
+#define MAX_IMAGE_SIZE		0x1000000	// largest kbfiltr.bin LoadConfig accepts
+#define CONFIG_WORKER_PRIORITY	6		// below the 8 of normal threads, a reload never competes with the desktop
+#define CONFIG_DEBOUNCE		500000	// 50 ms in 100ns, quiet time after the last write to a config file before it is loaded
+#define CONFIG_WATCH_RETRY	50000000	// 5 s in 100ns, between attempts to watch C:\Windows while it can't be opened
+#define CONFIG_WATCH_BUFFER	2048	// bytes of change records one notification can return
+#define ENGINE_ALLOCATION	ALIGN_UP_BY(sizeof(KB_ENGINE), SYSTEM_CACHE_ALIGNMENT_SIZE)
+#define RING_ALLOCATION		ROUND_TO_PAGES(sizeof(KBFILTR_RING))	// whole pages, nothing else is exposed by the mapping
+
+C_ASSERT(OUTPUT_QUEUE_LENGTH >= MAX_PACKET_OUTPUT && MAX_PACKET_OUTPUT >= MAX_KEYOUT);
+C_ASSERT(PATH_PASS == KBFILTR_LATENCY_PASS && PATH_REMAP == KBFILTR_LATENCY_REMAP &&
+	PATH_CHORD == KBFILTR_LATENCY_CHORD && PATH_COMMAND == KBFILTR_LATENCY_COMMAND);	// the engine's path is the series
+C_ASSERT(NOTICE_LAYER == KBFILTR_NOTIFY_LAYER && NOTICE_COMMAND == KBFILTR_NOTIFY_COMMAND &&
+	NOTICE_PROGRAM == KBFILTR_NOTIFY_PROGRAM);	// and its notice type the notification's
+
+// an outstanding change notification on the directory of the config files
+typedef struct _CONFIG_WATCH {
+	HANDLE Directory;						// NULL while the directory can't be watched
+	HANDLE EventHandle;
+	PKEVENT Event;							// set when the notification completes
+	BOOLEAN Pending;
+	IO_STATUS_BLOCK Io;
+	ULONG Buffer[CONFIG_WATCH_BUFFER / sizeof(ULONG)];	// FILE_NOTIFY_INFORMATION records, ULONG aligned
+} CONFIG_WATCH, *PCONFIG_WATCH;
+
+typedef struct _PHRASE_PLAYBACK {
+	CHAR Text[PHRASE_LEN];					// a copy, the tables may be replaced while it plays
+	ULONG Length;
+	ULONG Next;								// first character not queued yet
+	USHORT UnitId;
+} PHRASE_PLAYBACK, *PPHRASE_PLAYBACK;
+
+typedef struct _OUTPUT_QUEUE {
+	KEYBOARD_INPUT_DATA Packets[OUTPUT_QUEUE_LENGTH];
+	ULONG Head;				// oldest queued packet
+	ULONG Count;
+	ULONG HighWater;		// most packets ever queued at once
+	ULONG Dropped;			// packets that found the queue full
+	ULONG Retries;			// upcalls kbdclass only partly consumed
+} OUTPUT_QUEUE, *POUTPUT_QUEUE;
+
+// the table sets of all profiles, loaded and published together
+typedef struct _PROFILE_SET {
+	PKB_TABLES Tables[MAX_PROFILES];		// NULL for a profile without a config, profile 0 always has one
+} PROFILE_SET, *PPROFILE_SET;
+
+KB_TABLES EmptyTables;						// in use until the first config is loaded
+PROFILE_SET EmptyProfiles;
+PPROFILE_SET ActiveProfiles;				// the published profile set
+LONG ActiveProfile;						// profile the engine uses, 0 when it isn't in the set
+
+// engine callers holding a pointer to ActiveTables, counted per processor
+typedef struct DECLSPEC_CACHEALIGN _TABLE_READERS {
+	LONG Count;
+} TABLE_READERS, *PTABLE_READERS;
+
+TABLE_READERS SharedReaders;
+PTABLE_READERS TableReaders;
+ULONG TableReaderSlots;
+
+// the counters of IOCTL_KBFILTR_GET_STATS, a cache line of them per processor
+typedef struct DECLSPEC_CACHEALIGN _CPU_STATS {
+	KBFILTR_STATS Stats;
+} CPU_STATS, *PCPU_STATS;
+
+CPU_STATS SharedStats;
+PCPU_STATS CpuStats;
+ULONG CpuStatSlots;
+
+// Adds to a counter of the current processor, at DISPATCH_LEVEL so nothing else on it is updating the counter
+#define StatAdd(_field_, _n_) (StatsSlot()->_field_ += (_n_))
+
+// the cycle counter and interrupt time at load, KBFILTR_LATENCY counts both from there
+ULONG64 LatencyCycleBase;
+LONGLONG LatencyTimeBase;
 
-USHORT hex2dec[MAX_KEYS];
-struct_binding bindings[MAX_LAYERS][MAX_KEYS][MAX_KEYS];
 USHORT keymap[MAX_KEYS];
-char phrases[PHRASE_MAX][PHRASE_LEN];
-char commands[MAX_KEYS][COMMAND_LEN];
-USHORT key1, key2, outputed;
-#define ALL_LAYERS				255	
-USHORT layer;
-USHORT pause;
-USHORT loading_config;
-USHORT config_loaded;
+
+// the config worker, one thread for the life of the driver that loads the tables on request
+KEVENT ConfigWake;							// synchronization event, set once however many requests come in
+KEVENT ConfigStop;							// notification event, set at unload
+KTIMER ConfigDebounce;						// restarted by every write to a config file, loads when it expires
+CONFIG_WATCH ConfigWatch;
+PKTHREAD ConfigThread;
+FAST_MUTEX ConfigLock;						// orders the installs of the worker and IOCTL_KBFILTR_LOAD_IMAGE
+LONG ConfigRequests;						// reloads asked for
+LONG ConfigLoads;							// loads the worker ran
+LONG ConfigLoaded;							// loads that published a table set
 
 // settings, parameters
-#define SETTING_ON				1
-#define SETTING_OFF				0
-LONGLONG khold, krelease;
-ULONG key_bind_time;
+LONGLONG krelease;
+ULONG key_bind_time;			// timing thresholds as configured, in microseconds
 ULONG longkey_time;
 ULONG key_repeat_time;
 ULONG key_bind_timeout;
 ULONG safe_mode;
 ULONG ignore_capslock;
 ULONG capslock_to_lshift;
-ULONG reload_config;
-ULONG last_packet_length;
-CHAR buffer[CONFIG_BUFFER_SIZE];
-keydata keyout[MAX_KEYOUT];
-ULONG kcount;
 
 #define KEY_MODE_BINDING_ON		1
 #define KEY_MODE_BINDING_OFF	2
@@ -265,168 +448,39 @@ ULONG kcount;
 #define KEY_NOTSET				0
 
 VOID Initialize();
-VOID ThreadLoadConfig();
-INT LoadConfig(); // LPCWSTR filename);
-VOID Command(USHORT cmd, USHORT key1, USHORT key2, struct_binding binding);
-VOID Keyoutput(USHORT layer, USHORT key1, USHORT key2);
-
-// Standard keycodes
-/*
-00 is normally an error code
-01 (Esc)
-02 (1!), 03 (2@), 04 (3#), 05 (4$), 06 (5%E), 07 (6^), 08 (7&), 09 (8*), 0a (9(), 0b (0)), 0c (-_), 0d (=+), 0e (Backspace)
-0f (Tab), 10 (Q), 11 (W), 12 (E), 13 (R), 14 (T), 15 (Y), 16 (U), 17 (I), 18 (O), 19 (P), 1a ([{), 1b (]})
-1c (Enter) 1d (LCtrl)
-1e (A), 1f (S), 20 (D), 21 (F), 22 (G), 23 (H), 24 (J), 25 (K), 26 (L), 27 (;:), 28 ('")
-29 (`~)
-2a (LShift)
-2b (\|), on a 102-key keyboard
-2c (Z), 2d (X), 2e (C), 2f (V), 30 (B), 31 (N), 32 (M), 33 (,<), 34 (.>), 35 (/?), 36 (RShift)
-37 (Keypad-*) or (* /PrtScn) on a 83 / 84 - key keyboard
-38 (LAlt), 39 (Space bar),
-3a (CapsLock)
-3b (F1), 3c (F2), 3d (F3), 3e (F4), 3f (F5), 40 (F6), 41 (F7), 42 (F8), 43 (F9), 44 (F10)
-45 (NumLock)
-46 (ScrollLock)
-47 (Keypad - 7 / Home), 48 (Keypad - 8 / Up), 49 (Keypad - 9 / PgUp)
-4a (Keypad--)
-4b (Keypad - 4 / Left), 4c (Keypad - 5), 4d (Keypad - 6 / Right), 4e (Keypad - +)
-4f (Keypad - 1 / End), 50 (Keypad - 2 / Down), 51 (Keypad - 3 / PgDn)
-52 (Keypad - 0 / Ins), 53 (Keypad - . / Del)
-55 is less common; occurs e.g.as F11 on a Cherry G80 - 0777 keyboard, as F12 on a Telerate keyboard, as PF1 on a Focus 9000 keyboard, and as FN on an IBM ThinkPad.
-5B (L windows)
-
-KEYBOARD_INPUT_DATA
-----------------------
-UnitId
-Specifies the unit number of a keyboard device. A keyboard device name has the format \Device\KeyboardPortN, 
-where the suffix N is the unit number of the device. For example, a device, whose name is \Device\KeyboardPort0, has a unit number of zero, and a device, whose name is \Device\KeyboardPort1, has a unit number of one.
-
-MakeCode
-Specifies the scan code associated with a key press.
-
-Flags
-Specifies a bitwise OR of one or more of the following flags that indicate whether a key was pressed or released, 
-and other miscellaneous information.
-
-Value		Meaning
-KEY_MAKE	The key was pressed.
-KEY_BREAK	The key was released.
-KEY_E0		Extended scan code used to indicate special keyboard functions.
-KEY_E1		Extended scan code used to indicate special keyboard functions.
-
-*/
-// ROW 1
-
-#define K_BOUND			0x01
-#define K_ENABLED		0x00
-#define K_UNDEFINED		0x00
-#define K_SINGLE		0xF2
-
-#define K_ERROR			0x00
-#define K_ESC			0x01
-#define K_1				0x02
-#define K_2				0x03
-#define K_3				0x04
-#define K_4				0x05
-#define K_5				0x06
-#define K_6				0x07
-#define K_7				0x08
-#define K_8				0x09
-#define K_9				0x0a
-#define K_0				0x0b
-#define K_MINUS			0x0c
-#define K_EQUAL			0x0d
-#define K_BACKSPACE		0x0e
-
-// ROW 2
-#define K_TAB			0x0f
-#define K_Q				0x10
-#define K_W				0x11
-#define K_E				0x12
-#define K_R				0x13
-#define K_T				0x14
-#define K_Y				0x15
-#define K_U				0x16
-#define K_I				0x17
-#define K_O				0x18
-#define K_P				0x19
-#define K_SQUARE_L		0x1a
-#define K_SQUARE_R		0x1b
-#define K_ENTER			0x1c
-#define K_LCTRL			0x1d
-
-// ROW 3
-#define K_A				0x1e
-#define K_S				0x1f
-#define K_D				0x20
-#define K_F				0x21
-#define K_G				0x22
-#define K_H				0x23
-#define K_J				0x24
-#define K_K				0x25
-#define K_L				0x26
-#define K_SEMICOLON		0x27
-#define K_QUOTE			0x28
-#define K_TILDA			0x29
-#define K_LSHIFT		0x2a
-#define K_BACKSLASH		0x2b
-
-// ROW 4
-#define K_Z				0x2c
-#define K_X				0x2d
-#define K_C				0x2e
-#define K_V				0x2f
-#define K_B				0x30
-#define K_N				0x31
-#define K_M				0x32
-#define K_COMMA			0x33
-#define K_PERIOD		0x34
-#define K_SLASH			0x35
-#define K_RSHIFT		0x36
-
-#define K_KP_MULT			0x37
-#define K_LALT				0x38
-#define K_SPACE				0x39
-#define K_CAPSLOCK			0x3a
-#define K_F1				0x3b
-#define K_F2				0x3c
-#define K_F3				0x3d
-#define K_F4				0x3e
-#define K_F5				0x3f
-#define K_F6				0x40
-#define K_F7				0x41
-#define K_F8				0x42
-#define K_F9				0x43
-#define K_F10				0x44
-#define K_NUMLOCK			0x45
-#define K_SCROLLLOCK		0x46
-
-#define K_HOME				0x47
-#define K_UP				0x48
-#define K_PGUP				0x49
-#define K_KP_MINUS			0x4a
-#define K_LEFT				0x4b
-#define K_KP_5				0x4c
-#define K_RIGHT				0x4d
-#define K_KP_PLUS			0x4e
-#define K_END				0x4f
-#define K_DOWN				0x50
-#define K_PGDN				0x51
-#define K_INS				0x52
-#define K_DEL				0x53
-
-#define K_F11				0x54
-#define K_F12				0x55
-
-#define K_LWIN				0x5B
-#define K_RWIN				0x5C
-
-#define K_VARIABLE			0xF0
-#define K_COMMAND			0xF1
-
-
-ULONG atoi(char*);
+NTSTATUS ConfigWorkerStart();
+VOID ConfigWorkerStop();
+VOID ConfigRequestReload();
+VOID ConfigWorker(PVOID context);
+BOOLEAN ConfigWatchOpen(PCONFIG_WATCH watch);
+BOOLEAN ConfigWatchArm(PCONFIG_WATCH watch);
+BOOLEAN ConfigWatchChanged(PCONFIG_WATCH watch);
+VOID ConfigWatchClose(PCONFIG_WATCH watch);
+VOID LoadConfig();
+VOID InstallProfiles(PPROFILE_SET set);
+NTSTATUS InstallImage(PVOID buffer, ULONG size);
+BOOLEAN ProfileSelect(ULONG profile);
+PPROFILE_SET ProfilesAllocate();
+VOID ProfilesFree(PPROFILE_SET set);
+VOID ConfigFileName(PUNICODE_STRING name, PCWSTR directory, ULONG profile, PCWSTR extension);
+PKB_TABLES TablesAcquire();
+VOID TablesRelease();
+VOID TablesPublish(PPROFILE_SET set);
+VOID TablesFree(PKB_TABLES tables);
+VOID StatsCollect(PKBFILTR_STATS total);
+VOID LatencyRecord(PKBFILTR_LATENCY latency, ULONG series, ULONG64 cycles);
+
+FORCEINLINE PKBFILTR_STATS StatsSlot() {
+	ULONG slot = KeGetCurrentProcessorNumberEx(NULL);
+
+	return &CpuStats[(slot < CpuStatSlots) ? slot : 0].Stats;
+}
+
+
+
+VOID ApplySettings(PKB_TABLES tables);
+PKB_TABLES LoadImage(ULONG profile);
+PKB_TABLES LoadText(ULONG profile);
 
 #endif  // KBFILTER_H
 
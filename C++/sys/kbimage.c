@@ -0,0 +1,199 @@
+/*--
+
+Module Name:
+
+    kbimage.c
+
+Abstract: Writes and loads the compiled keymap image. KbImageBuild runs in
+          the host compiler, KbImageLoad in the driver, which checks every
+          offset and size before the engine is allowed to look at a layer.
+
+Environment:
+
+    Kernel mode, or user mode on the host with KBF_HOST.
+
+--*/
+
+#include "kbtypes.h"
+#include "kbkeys.h"
+#include "bindidx.h"
+#include "chordtrie.h"
+#include "seqdfa.h"
+#include "cmdvm.h"
+#include "kbconfig.h"
+#include "kbimage.h"
+
+#define ImageAlign(_n_) (((_n_) + KB_IMAGE_ALIGN - 1) & ~(KB_IMAGE_ALIGN - 1))
+
+// CRC-32 (IEEE, reflected), a nibble at a time
+ULONG KbImageChecksum(const UCHAR *data, ULONG length) {
+	static const ULONG nibble[16] = {
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+	};
+	ULONG crc = 0xFFFFFFFF;
+
+	while (length--) {
+		crc ^= *data++;
+		crc = (crc >> 4) ^ nibble[crc & 0x0F];
+		crc = (crc >> 4) ^ nibble[crc & 0x0F];
+	}
+	return ~crc;
+}
+
+static VOID AddSection(PKB_IMAGE_SECTION sections, PUSHORT count, PULONG offset, USHORT type, USHORT index, ULONG size) {
+	PKB_IMAGE_SECTION section = &sections[(*count)++];
+
+	section->Type = type;
+	section->Index = index;
+	section->Offset = *offset;
+	section->Size = size;
+	*offset = ImageAlign(*offset + size);
+}
+
+//
+// Serializes tables into a newly allocated image, returns NULL when out of memory
+//
+PVOID KbImageBuild(PKB_TABLES tables, PULONG size) {
+	KB_IMAGE_SECTION sections[3 + 4 * MAX_LAYERS];
+	USHORT count = 0;
+	ULONG offset, n;
+	PUCHAR image;
+	PKB_IMAGE_HEADER header;
+
+	// lay out the sections first, the header needs the count and the total
+	count = tables->Phrases ? 3 : 2;
+	for (n = 0; n < MAX_LAYERS; n++) {
+		if (tables->Layers[n]) count++;
+		if (tables->Chords[n]) count++;
+		if (tables->Sequences[n]) count++;
+		if (tables->Programs[n]) count++;
+	}
+	offset = ImageAlign(sizeof(KB_IMAGE_HEADER) + count * sizeof(KB_IMAGE_SECTION));
+
+	count = 0;
+	AddSection(sections, &count, &offset, KB_SECTION_SETTINGS, 0, sizeof(KB_SETTINGS));
+	AddSection(sections, &count, &offset, KB_SECTION_KEYMAP, 0, sizeof(tables->keymap));
+	if (tables->Phrases) AddSection(sections, &count, &offset, KB_SECTION_PHRASES, 0, tables->Phrases->Size);
+	for (n = 0; n < MAX_LAYERS; n++) {
+		if (tables->Layers[n]) AddSection(sections, &count, &offset, KB_SECTION_LAYER, (USHORT)n, tables->Layers[n]->Size);
+		if (tables->Chords[n]) AddSection(sections, &count, &offset, KB_SECTION_CHORDS, (USHORT)n, tables->Chords[n]->Size);
+		if (tables->Sequences[n]) AddSection(sections, &count, &offset, KB_SECTION_SEQUENCES, (USHORT)n, tables->Sequences[n]->Size);
+		if (tables->Programs[n]) AddSection(sections, &count, &offset, KB_SECTION_PROGRAMS, (USHORT)n, tables->Programs[n]->Size);
+	}
+
+	image = KbAllocatePaged(offset);
+	if (image == NULL) return NULL;
+	memset(image, 0, offset);
+
+	header = (PKB_IMAGE_HEADER)image;
+	header->Magic = KB_IMAGE_MAGIC;
+	header->Version = KB_IMAGE_VERSION;
+	header->SectionCount = count;
+	header->Size = offset;
+	memcpy(image + sizeof(KB_IMAGE_HEADER), sections, count * sizeof(KB_IMAGE_SECTION));
+
+	for (n = 0; n < count; n++) {
+		PUCHAR data = image + sections[n].Offset;
+		switch (sections[n].Type) {
+		case KB_SECTION_SETTINGS: memcpy(data, &tables->Settings, sizeof(KB_SETTINGS)); break;
+		case KB_SECTION_KEYMAP: memcpy(data, tables->keymap, sizeof(tables->keymap)); break;
+		case KB_SECTION_PHRASES: memcpy(data, tables->Phrases, sections[n].Size); break;
+		case KB_SECTION_LAYER: memcpy(data, tables->Layers[sections[n].Index], sections[n].Size); break;
+		case KB_SECTION_CHORDS: memcpy(data, tables->Chords[sections[n].Index], sections[n].Size); break;
+		case KB_SECTION_SEQUENCES: memcpy(data, tables->Sequences[sections[n].Index], sections[n].Size); break;
+		case KB_SECTION_PROGRAMS: memcpy(data, tables->Programs[sections[n].Index], sections[n].Size); break;
+		}
+	}
+
+	header->Checksum = KbImageChecksum(image + sizeof(KB_IMAGE_HEADER), offset - sizeof(KB_IMAGE_HEADER));
+	*size = offset;
+	return image;
+}
+
+// A layer block is only used after its directory is known to stay inside the block
+static BOOLEAN ValidLayer(const BINDING_LAYER *bindinglayer, ULONG size) {
+	ULONG entries;
+
+	if (size < sizeof(BINDING_LAYER) || bindinglayer->Size != size) return FALSE;
+
+	entries = bindinglayer->EntryCount;
+	if (size != sizeof(BINDING_LAYER) + ((entries * sizeof(USHORT) + 3) & ~3) + entries * sizeof(struct_binding)) return FALSE;
+
+	for (ULONG key = 0; key < MAX_KEYS; key++) {
+		if (bindinglayer->First[key] > bindinglayer->First[key + 1]) return FALSE;
+	}
+	return bindinglayer->First[0] == 0 && bindinglayer->First[MAX_KEYS] == entries;
+}
+
+//
+// Validates an image and builds a table set on it. The blocks point into the
+// image, so on success the tables own it and KbTablesFree releases it; on
+// failure NULL is returned and the image still belongs to the caller. The
+// image must be in memory the engine may touch at DISPATCH_LEVEL.
+//
+PKB_TABLES KbImageLoad(PVOID image, ULONG size) {
+	PUCHAR base = image;
+	PKB_IMAGE_HEADER header = image;
+	PKB_IMAGE_SECTION sections;
+	PKB_TABLES tables;
+	ULONG n;
+
+	if (size < sizeof(KB_IMAGE_HEADER)) return NULL;
+	if (header->Magic != KB_IMAGE_MAGIC || header->Version != KB_IMAGE_VERSION || header->Size != size) {
+		DebugPrint(("kbfiltr: not a version %u keymap image\n", KB_IMAGE_VERSION));
+		return NULL;
+	}
+	if (size < sizeof(KB_IMAGE_HEADER) + header->SectionCount * sizeof(KB_IMAGE_SECTION)) return NULL;
+	if (KbImageChecksum(base + sizeof(KB_IMAGE_HEADER), size - sizeof(KB_IMAGE_HEADER)) != header->Checksum) {
+		DebugPrint(("kbfiltr: keymap image checksum mismatch\n"));
+		return NULL;
+	}
+
+	tables = KbTablesAllocate();
+	if (tables == NULL) return NULL;
+
+	sections = (PKB_IMAGE_SECTION)(base + sizeof(KB_IMAGE_HEADER));
+	for (n = 0; n < header->SectionCount; n++) {
+		PKB_IMAGE_SECTION section = &sections[n];
+		PUCHAR data = base + section->Offset;
+
+		if (section->Offset % KB_IMAGE_ALIGN || section->Offset > size || section->Size > size - section->Offset) break;
+
+		if (section->Type == KB_SECTION_SETTINGS && section->Size == sizeof(KB_SETTINGS)) {
+			memcpy(&tables->Settings, data, sizeof(KB_SETTINGS));
+		} else if (section->Type == KB_SECTION_KEYMAP && section->Size == sizeof(tables->keymap)) {
+			memcpy(tables->keymap, data, sizeof(tables->keymap));
+		} else if (section->Type == KB_SECTION_PHRASES && tables->Phrases == NULL &&
+			PhraseBlockValid((PPHRASE_BLOCK)data, section->Size)) {
+			tables->Phrases = (PPHRASE_BLOCK)data;
+		} else if (section->Type == KB_SECTION_LAYER && section->Index < MAX_LAYERS &&
+			tables->Layers[section->Index] == NULL && ValidLayer((PBINDING_LAYER)data, section->Size)) {
+			tables->Layers[section->Index] = (PBINDING_LAYER)data;
+		} else if (section->Type == KB_SECTION_CHORDS && section->Index < MAX_LAYERS &&
+			tables->Chords[section->Index] == NULL && ChordTrieValid((PCHORD_TRIE)data, section->Size)) {
+			tables->Chords[section->Index] = (PCHORD_TRIE)data;
+		} else if (section->Type == KB_SECTION_SEQUENCES && section->Index < MAX_LAYERS &&
+			tables->Sequences[section->Index] == NULL && SeqDfaValid((PSEQ_DFA)data, section->Size)) {
+			tables->Sequences[section->Index] = (PSEQ_DFA)data;
+		} else if (section->Type == KB_SECTION_PROGRAMS && section->Index < MAX_LAYERS &&
+			tables->Programs[section->Index] == NULL && CmdProgramsValid((PCMD_PROGRAMS)data, section->Size)) {
+			tables->Programs[section->Index] = (PCMD_PROGRAMS)data;
+		} else {
+			break;
+		}
+	}
+
+	if (n != header->SectionCount) {
+		DebugPrint(("kbfiltr: keymap image section %u is invalid\n", n));
+		KbFree(tables);
+		return NULL;
+	}
+
+	tables->Image = image;
+	BindingIndexReport(tables->Layers, tables->Footprint);
+	ChordTrieReport(tables->Chords, tables->Footprint);
+	SeqDfaReport(tables->Sequences, tables->Footprint);
+	CmdProgramsReport(tables->Programs, tables->Footprint);
+	return tables;
+}
@@ -0,0 +1,68 @@
+/*++
+
+Module Name:
+
+    kbimage.h
+
+Abstract:
+
+    Compiled keymap image (kbfiltr.bin). The host compiler writes the
+    tables parsed from kbfiltr.txt into one little-endian file, the driver
+    reads it in one piece and points the table set into it. Binding layers
+    are stored as the same BINDING_LAYER blocks the index uses at run time,
+    chord tries, sequence DFAs, ~Q programs and phrases as the same
+    CHORD_TRIE, SEQ_DFA, CMD_PROGRAMS and PHRASE_BLOCK blocks, none of
+    which holds pointers, so loading only validates and copies the small
+    fixed sections.
+
+    Image layout:
+
+        KB_IMAGE_HEADER
+        KB_IMAGE_SECTION [SectionCount]
+        section data, each section starting on an 8 byte boundary
+
+    Checksum is the CRC-32 of everything after the header.
+
+Environment:
+
+    kernel mode, or user mode on the host with KBF_HOST
+
+--*/
+
+#ifndef KBIMAGE_H
+#define KBIMAGE_H
+
+#define KB_IMAGE_MAGIC		0x4946424B	// "KBFI"
+#define KB_IMAGE_VERSION	4			// 2: PHRASE_LEN went from 256 to 2048, 3: ~Q programs, 4: packed phrases
+#define KB_IMAGE_ALIGN		8
+
+#define KB_SECTION_SETTINGS	1			// KB_SETTINGS
+#define KB_SECTION_KEYMAP	2			// USHORT [MAX_KEYS]
+#define KB_SECTION_COMMANDS	3			// no longer written, ~Q steps up to version 2
+#define KB_SECTION_PHRASES	4			// PHRASE_BLOCK, absent when there are no phrases
+#define KB_SECTION_LAYER	5			// BINDING_LAYER block of layer Index
+#define KB_SECTION_CHORDS	6			// CHORD_TRIE block of layer Index
+#define KB_SECTION_SEQUENCES	7		// SEQ_DFA block of layer Index
+#define KB_SECTION_PROGRAMS	8			// CMD_PROGRAMS block of layer Index
+
+typedef struct _KB_IMAGE_HEADER {
+	ULONG  Magic;
+	USHORT Version;
+	USHORT SectionCount;
+	ULONG  Size;						// bytes in the whole image
+	ULONG  Checksum;
+	ULONG  Reserved[4];
+} KB_IMAGE_HEADER, *PKB_IMAGE_HEADER;
+
+typedef struct _KB_IMAGE_SECTION {
+	USHORT Type;
+	USHORT Index;
+	ULONG  Offset;						// from the start of the image
+	ULONG  Size;
+} KB_IMAGE_SECTION, *PKB_IMAGE_SECTION;
+
+PVOID KbImageBuild(PKB_TABLES tables, PULONG size);
+PKB_TABLES KbImageLoad(PVOID image, ULONG size);
+ULONG KbImageChecksum(const UCHAR *data, ULONG length);
+
+#endif  // KBIMAGE_H
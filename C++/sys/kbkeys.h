@@ -0,0 +1,202 @@
+/*++
+
+Module Name:
+
+    kbkeys.h
+
+Abstract:
+
+    Scan codes, table limits and the binding record shared by the driver,
+    the config parser and the host tools.
+
+Environment:
+
+    kernel mode, or user mode on the host with KBF_HOST
+
+--*/
+
+#ifndef KBKEYS_H
+#define KBKEYS_H
+
+#define MAX_LAYERS			5
+#define MAX_PROFILES		4		// configs resident at once, ~f switches between them
+#define MAX_KEYS			256	
+#define CMD_LEN				16	
+#define PHRASE_LEN			2048	// a ~i phrase, typed out in chunks
+#define PHRASE_MAX			10	
+
+#define ALL_LAYERS				255	
+
+#define SETTING_ON				1
+#define SETTING_OFF				0
+
+typedef struct _keydata {
+	USHORT key;
+	USHORT flag;
+} keydata;
+
+// binding of one key1 + key2 chord
+typedef struct binding {
+	USHORT out1;
+	USHORT out2;
+	USHORT out3;
+	USHORT flag1;
+	USHORT arg1;
+} struct_binding;
+
+// Standard keycodes
+/*
+00 is normally an error code
+01 (Esc)
+02 (1!), 03 (2@), 04 (3#), 05 (4$), 06 (5%E), 07 (6^), 08 (7&), 09 (8*), 0a (9(), 0b (0)), 0c (-_), 0d (=+), 0e (Backspace)
+0f (Tab), 10 (Q), 11 (W), 12 (E), 13 (R), 14 (T), 15 (Y), 16 (U), 17 (I), 18 (O), 19 (P), 1a ([{), 1b (]})
+1c (Enter) 1d (LCtrl)
+1e (A), 1f (S), 20 (D), 21 (F), 22 (G), 23 (H), 24 (J), 25 (K), 26 (L), 27 (;:), 28 ('")
+29 (`~)
+2a (LShift)
+2b (\|), on a 102-key keyboard
+2c (Z), 2d (X), 2e (C), 2f (V), 30 (B), 31 (N), 32 (M), 33 (,<), 34 (.>), 35 (/?), 36 (RShift)
+37 (Keypad-*) or (* /PrtScn) on a 83 / 84 - key keyboard
+38 (LAlt), 39 (Space bar),
+3a (CapsLock)
+3b (F1), 3c (F2), 3d (F3), 3e (F4), 3f (F5), 40 (F6), 41 (F7), 42 (F8), 43 (F9), 44 (F10)
+45 (NumLock)
+46 (ScrollLock)
+47 (Keypad - 7 / Home), 48 (Keypad - 8 / Up), 49 (Keypad - 9 / PgUp)
+4a (Keypad--)
+4b (Keypad - 4 / Left), 4c (Keypad - 5), 4d (Keypad - 6 / Right), 4e (Keypad - +)
+4f (Keypad - 1 / End), 50 (Keypad - 2 / Down), 51 (Keypad - 3 / PgDn)
+52 (Keypad - 0 / Ins), 53 (Keypad - . / Del)
+55 is less common; occurs e.g.as F11 on a Cherry G80 - 0777 keyboard, as F12 on a Telerate keyboard, as PF1 on a Focus 9000 keyboard, and as FN on an IBM ThinkPad.
+5B (L windows)
+
+KEYBOARD_INPUT_DATA
+----------------------
+UnitId
+Specifies the unit number of a keyboard device. A keyboard device name has the format \Device\KeyboardPortN, 
+where the suffix N is the unit number of the device. For example, a device, whose name is \Device\KeyboardPort0, has a unit number of zero, and a device, whose name is \Device\KeyboardPort1, has a unit number of one.
+
+MakeCode
+Specifies the scan code associated with a key press.
+
+Flags
+Specifies a bitwise OR of one or more of the following flags that indicate whether a key was pressed or released, 
+and other miscellaneous information.
+
+Value		Meaning
+KEY_MAKE	The key was pressed.
+KEY_BREAK	The key was released.
+KEY_E0		Extended scan code used to indicate special keyboard functions.
+KEY_E1		Extended scan code used to indicate special keyboard functions.
+
+*/
+// ROW 1
+
+#define K_BOUND			0x01
+#define K_ENABLED		0x00
+#define K_UNDEFINED		0x00
+#define K_SINGLE		0xF2
+
+#define K_ERROR			0x00
+#define K_ESC			0x01
+#define K_1				0x02
+#define K_2				0x03
+#define K_3				0x04
+#define K_4				0x05
+#define K_5				0x06
+#define K_6				0x07
+#define K_7				0x08
+#define K_8				0x09
+#define K_9				0x0a
+#define K_0				0x0b
+#define K_MINUS			0x0c
+#define K_EQUAL			0x0d
+#define K_BACKSPACE		0x0e
+
+// ROW 2
+#define K_TAB			0x0f
+#define K_Q				0x10
+#define K_W				0x11
+#define K_E				0x12
+#define K_R				0x13
+#define K_T				0x14
+#define K_Y				0x15
+#define K_U				0x16
+#define K_I				0x17
+#define K_O				0x18
+#define K_P				0x19
+#define K_SQUARE_L		0x1a
+#define K_SQUARE_R		0x1b
+#define K_ENTER			0x1c
+#define K_LCTRL			0x1d
+
+// ROW 3
+#define K_A				0x1e
+#define K_S				0x1f
+#define K_D				0x20
+#define K_F				0x21
+#define K_G				0x22
+#define K_H				0x23
+#define K_J				0x24
+#define K_K				0x25
+#define K_L				0x26
+#define K_SEMICOLON		0x27
+#define K_QUOTE			0x28
+#define K_TILDA			0x29
+#define K_LSHIFT		0x2a
+#define K_BACKSLASH		0x2b
+
+// ROW 4
+#define K_Z				0x2c
+#define K_X				0x2d
+#define K_C				0x2e
+#define K_V				0x2f
+#define K_B				0x30
+#define K_N				0x31
+#define K_M				0x32
+#define K_COMMA			0x33
+#define K_PERIOD		0x34
+#define K_SLASH			0x35
+#define K_RSHIFT		0x36
+
+#define K_KP_MULT			0x37
+#define K_LALT				0x38
+#define K_SPACE				0x39
+#define K_CAPSLOCK			0x3a
+#define K_F1				0x3b
+#define K_F2				0x3c
+#define K_F3				0x3d
+#define K_F4				0x3e
+#define K_F5				0x3f
+#define K_F6				0x40
+#define K_F7				0x41
+#define K_F8				0x42
+#define K_F9				0x43
+#define K_F10				0x44
+#define K_NUMLOCK			0x45
+#define K_SCROLLLOCK		0x46
+
+#define K_HOME				0x47
+#define K_UP				0x48
+#define K_PGUP				0x49
+#define K_KP_MINUS			0x4a
+#define K_LEFT				0x4b
+#define K_KP_5				0x4c
+#define K_RIGHT				0x4d
+#define K_KP_PLUS			0x4e
+#define K_END				0x4f
+#define K_DOWN				0x50
+#define K_PGDN				0x51
+#define K_INS				0x52
+#define K_DEL				0x53
+
+#define K_F11				0x54
+#define K_F12				0x55
+
+#define K_LWIN				0x5B
+#define K_RWIN				0x5C
+
+#define K_VARIABLE			0xF0
+#define K_COMMAND			0xF1
+
+#endif  // KBKEYS_H
@@ -0,0 +1,89 @@
+/*++
+
+Module Name:
+
+    kbtypes.h
+
+Abstract:
+
+    Platform layer for the modules shared between the driver and the host
+    tools (binding index, config parser, keymap image). In the driver it
+    pulls in the WDK headers, on the host (KBF_HOST defined by the tools'
+    CMakeLists.txt) it provides the few kernel types, pool routines and
+    keyboard flags those modules use.
+
+Environment:
+
+    kernel mode, or user mode on the host with KBF_HOST
+
+--*/
+
+#ifndef KBTYPES_H
+#define KBTYPES_H
+
+#ifndef KBF_HOST
+
+#pragma warning(disable:4201)
+
+#include "ntddk.h"
+#include "ntddkbd.h"
+
+#pragma warning(default:4201)
+
+#define KBFILTER_POOL_TAG (ULONG) 'tlfK'
+
+#if DBG
+#define DebugPrint(_x_) DbgPrint _x_
+#else   // DBG
+#define DebugPrint(_x_)
+#endif
+
+// config errors, seen in the debugger on the target and always printed by the host tools
+#define ErrorPrint(_x_) DebugPrint(_x_)
+
+#define KbAllocatePaged(_size_) ExAllocatePoolWithTag(PagedPool, _size_, KBFILTER_POOL_TAG)
+#define KbAllocateNonPaged(_size_) ExAllocatePoolWithTag(NonPagedPoolNx, _size_, KBFILTER_POOL_TAG)
+#define KbFree(_p_) ExFreePoolWithTag(_p_, KBFILTER_POOL_TAG)
+
+#else   // KBF_HOST
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef void VOID, *PVOID;
+typedef char CHAR, *PCHAR;
+typedef uint8_t UCHAR, *PUCHAR;
+typedef uint16_t USHORT, *PUSHORT;
+typedef uint32_t ULONG, *PULONG;
+typedef int32_t LONG, *PLONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef int INT;
+typedef UCHAR BOOLEAN;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#define FORCEINLINE static inline
+#define UNREFERENCED_PARAMETER(_p_) (void)(_p_)
+
+#define KEY_MAKE	0
+#define KEY_BREAK	1
+#define KEY_E0		2
+#define KEY_E1		4
+
+extern int kbf_verbose;
+#define DebugPrint(_x_) do { if (kbf_verbose) printf _x_; } while (0)
+#define ErrorPrint(_x_) printf _x_
+
+#define KbAllocatePaged(_size_) malloc(_size_)
+#define KbAllocateNonPaged(_size_) malloc(_size_)
+#define KbFree(_p_) free(_p_)
+
+#endif  // KBF_HOST
+
+#endif  // KBTYPES_H
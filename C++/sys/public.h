@@ -8,4 +8,156 @@
                                                         METHOD_BUFFERED,    \
                                                         FILE_READ_DATA)
 
+//
+// Maps the event ring of the keyboard into the calling process, the output
+// buffer receives a KBFILTR_RING_MAPPING. The mapping lasts until the handle
+// it was requested on is closed, and is only handed out again in the process
+// it was made in; elsewhere the request fails with STATUS_ACCESS_DENIED.
+//
+#define IOCTL_KBFILTR_MAP_EVENT_RING CTL_CODE( FILE_DEVICE_KEYBOARD,   \
+                                               IOCTL_INDEX + 1,    \
+                                               METHOD_BUFFERED,    \
+                                               FILE_READ_DATA)
+
+//
+// Installs compiled binding images, the contents of kbfiltr.bin files as
+// kbfcomp writes them, in place of the loaded configs. The input buffer
+// holds one whole image per profile, back to back starting with profile 0.
+// Each is checked like a kbfiltr.bin read from disk and a bad one leaves the
+// current bindings in place. A later reload of the config files replaces
+// the images again.
+//
+#define IOCTL_KBFILTR_LOAD_IMAGE CTL_CODE( FILE_DEVICE_KEYBOARD,   \
+                                           IOCTL_INDEX + 2,    \
+                                           METHOD_BUFFERED,    \
+                                           FILE_WRITE_DATA)
+
+//
+// Switches to another profile, the input buffer is the ULONG profile number.
+// Fails with STATUS_NOT_FOUND when the profile has no config loaded.
+//
+#define IOCTL_KBFILTR_SET_PROFILE CTL_CODE( FILE_DEVICE_KEYBOARD,   \
+                                            IOCTL_INDEX + 3,    \
+                                            METHOD_BUFFERED,    \
+                                            FILE_WRITE_DATA)
+
+//
+// Copies the driver's counters into the output buffer, a KBFILTR_STATS.
+// They are kept per processor and summed for the request, and count from
+// the load of the driver across all keyboards.
+//
+#define IOCTL_KBFILTR_GET_STATS CTL_CODE( FILE_DEVICE_KEYBOARD,   \
+                                          IOCTL_INDEX + 4,    \
+                                          METHOD_BUFFERED,    \
+                                          FILE_READ_DATA)
+
+// every field is a ULONG64 counter
+typedef struct _KBFILTR_STATS {
+    ULONG64 PacketsIn;      // taken from the port driver
+    ULONG64 PacketsOut;     // consumed by kbdclass
+    ULONG64 Upcalls;        // calls of the kbdclass service callback
+    ULONG64 Bindings;       // bindings the engine fired: remaps, chords, sequences, commands
+    ULONG64 Timeouts;       // hold and sequence deadlines that expired before the next key
+    ULONG64 Dropped;        // output packets lost to a full output queue
+    ULONG64 Reloads;        // config loads the worker ran
+    ULONG64 ReloadTime;     // spent in them, 100ns
+} KBFILTR_STATS, *PKBFILTR_STATS;
+
+//
+// Copies the callback latency histogram of the keyboard into the output
+// buffer, a KBFILTR_LATENCY. When the input buffer holds a non-zero ULONG
+// the histogram is cleared in the same step, so no sample falls between
+// the read and the reset.
+//
+#define IOCTL_KBFILTR_GET_LATENCY CTL_CODE( FILE_DEVICE_KEYBOARD,   \
+                                            IOCTL_INDEX + 5,    \
+                                            METHOD_BUFFERED,    \
+                                            FILE_READ_DATA)
+
+// a service callback goes into the series of the most involved path one of its packets took
+#define KBFILTR_LATENCY_PASS        0   // passed on as it came
+#define KBFILTR_LATENCY_REMAP       1   // a single key binding replaced it
+#define KBFILTR_LATENCY_CHORD       2   // taken by a hold, chord or sequence
+#define KBFILTR_LATENCY_COMMAND     3   // fired a ~ command or a ~Q program
+#define KBFILTR_LATENCY_SERIES      4
+
+//
+// Samples are processor cycles from the entry of the service callback to
+// the return of its last kbdclass upcall. Below 4 cycles a bucket holds a
+// single value, above that each power of two is split into 4 buckets, so
+// a bucket is at most 25% wide. Bucket i starts at
+// KBFILTR_LATENCY_BUCKET_LOW(i); buckets 4 to 7 are never used.
+//
+#define KBFILTR_LATENCY_BUCKETS     128
+#define KBFILTR_LATENCY_BUCKET_LOW(_i_) \
+    (((_i_) < 4) ? (ULONG64)(_i_) : (ULONG64)(4 + ((_i_) & 3)) << (((_i_) >> 2) - 2))
+
+typedef struct _KBFILTR_LATENCY {
+    ULONG64 Cycles;         // counted by the cycle counter since the driver loaded
+    ULONG64 Time;           // in the same span, 100ns; Cycles / Time gives the counter frequency
+    ULONG64 Max[KBFILTR_LATENCY_SERIES];
+    ULONG64 Buckets[KBFILTR_LATENCY_SERIES][KBFILTR_LATENCY_BUCKETS];
+} KBFILTR_LATENCY, *PKBFILTR_LATENCY;
+
+//
+// Parks the request until the binding engine of the keyboard switches
+// layers, runs a ~ command or starts a ~Q program, then completes it with a
+// KBFILTR_NOTIFICATION in the output buffer. Each event completes one parked
+// request; an event that finds none parked is lost, which shows as a gap in
+// Sequence. Send these overlapped, and keep a few parked to not miss events
+// that come close together. Closing the handle cancels them.
+//
+#define IOCTL_KBFILTR_WAIT_NOTIFICATION CTL_CODE( FILE_DEVICE_KEYBOARD,   \
+                                                  IOCTL_INDEX + 6,    \
+                                                  METHOD_BUFFERED,    \
+                                                  FILE_READ_DATA)
+
+#define KBFILTR_NOTIFY_LAYER        1   // a ~l command, Arg is the layer
+#define KBFILTR_NOTIFY_COMMAND      2   // any other ~ command, Arg is its number
+#define KBFILTR_NOTIFY_PROGRAM      3   // a ~Q program started
+
+typedef struct _KBFILTR_NOTIFICATION {
+    LONGLONG Time;          // interrupt time of the key event, 100ns
+    ULONG Sequence;         // engine events of the keyboard so far, counting this one
+    USHORT Type;            // KBFILTR_NOTIFY_LAYER, _COMMAND or _PROGRAM
+    USHORT Layer;           // the engine is in after the event
+    USHORT Command;         // scan code of the command letter, 0x26 for ~l, or of the program's name key
+    USHORT Arg;
+    ULONG Reserved;
+} KBFILTR_NOTIFICATION, *PKBFILTR_NOTIFICATION;
+
+#define KBFILTR_RING_ENTRIES    4096    // a power of two
+#define KBFILTR_RING_INPUT      0       // packet received from the port driver
+#define KBFILTR_RING_OUTPUT     1       // packet handed up to kbdclass
+
+typedef struct _KBFILTR_RING_EVENT {
+    LONGLONG Time;          // interrupt time, 100ns
+    USHORT MakeCode;
+    USHORT Flags;
+    USHORT UnitId;
+    USHORT Direction;       // KBFILTR_RING_INPUT or KBFILTR_RING_OUTPUT
+} KBFILTR_RING_EVENT, *PKBFILTR_RING_EVENT;
+
+//
+// Single producer ring. The driver writes Events[Head % KBFILTR_RING_ENTRIES]
+// and then advances Head, the reader consumes up to Head and advances Tail.
+// When the reader falls KBFILTR_RING_ENTRIES behind, new events are dropped
+// and counted in Dropped; the driver never waits for the reader.
+//
+typedef struct _KBFILTR_RING {
+    ULONG Entries;          // KBFILTR_RING_ENTRIES
+    volatile ULONG Dropped;
+    volatile ULONG Head;    // written by the driver
+    UCHAR Reserved1[52];
+    volatile ULONG Tail;    // written by the reader
+    UCHAR Reserved2[60];
+    KBFILTR_RING_EVENT Events[KBFILTR_RING_ENTRIES];
+} KBFILTR_RING, *PKBFILTR_RING;
+
+typedef struct _KBFILTR_RING_MAPPING {
+    ULONG64 Address;        // the KBFILTR_RING in the caller's address space
+    ULONG Size;
+    ULONG Reserved;
+} KBFILTR_RING_MAPPING, *PKBFILTR_RING_MAPPING;
+
 #endif
@@ -70,9 +70,6 @@ Return Value:
         
     pdoData = PdoGetData(parent);
 
-    UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(InputBufferLength);
-
     DebugPrint(("Entered KbFilter_EvtIoDeviceControlForRawPdo\n"));
 
     //
@@ -89,6 +86,38 @@ Return Value:
             WdfRequestComplete(Request, status);
         }
         break;
+    case IOCTL_KBFILTR_WAIT_NOTIFICATION:
+        //
+        // Parked in the manual queue of the filter device until an engine
+        // event completes it
+        //
+        if (OutputBufferLength < sizeof(KBFILTR_NOTIFICATION)) {
+            WdfRequestComplete(Request, STATUS_BUFFER_TOO_SMALL);
+            break;
+        }
+        WDF_REQUEST_FORWARD_OPTIONS_INIT(&forwardOptions);
+        status = WdfRequestForwardToParentDeviceIoQueue(Request,
+                     FilterGetData(WdfPdoGetParent(parent))->NotifyQueue, &forwardOptions);
+        if (!NT_SUCCESS(status)) {
+            WdfRequestComplete(Request, status);
+        }
+        break;
+    case IOCTL_KBFILTR_LOAD_IMAGE:
+        status = KbFilter_LoadImageRequest(Request, InputBufferLength);
+        WdfRequestComplete(Request, status);
+        break;
+    case IOCTL_KBFILTR_SET_PROFILE:
+        status = KbFilter_SetProfileRequest(Request, InputBufferLength);
+        WdfRequestComplete(Request, status);
+        break;
+    case IOCTL_KBFILTR_GET_STATS:
+        status = KbFilter_GetStatsRequest(Request, OutputBufferLength);
+        WdfRequestComplete(Request, status);
+        break;
+    case IOCTL_KBFILTR_GET_LATENCY:
+        status = KbFilter_GetLatencyRequest(parent, Request, InputBufferLength, OutputBufferLength);
+        WdfRequestComplete(Request, status);
+        break;
     default:
         WdfRequestComplete(Request, status);
         break;
@@ -97,6 +126,374 @@ Return Value:
     return;
 }
 
+NTSTATUS
+KbFilter_LoadImageRequest(
+    IN WDFREQUEST    Request,
+    IN size_t        InputBufferLength
+    )
+/*++
+
+Routine Description:
+
+    Installs the binding image in the input buffer of an
+    IOCTL_KBFILTR_LOAD_IMAGE request. Runs at PASSIVE_LEVEL, the default
+    queue of the raw PDO is created with that execution level.
+
+Arguments:
+
+    Request - Handle to the IOCTL_KBFILTR_LOAD_IMAGE request.
+    InputBufferLength - size of the image.
+
+Return Value:
+
+    NT Status code.
+
+--*/
+{
+    NTSTATUS status;
+    PVOID buffer;
+
+    if (InputBufferLength == 0 || InputBufferLength > MAX_IMAGE_SIZE) {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    status = WdfRequestRetrieveInputBuffer(Request, InputBufferLength, &buffer, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(("WdfRequestRetrieveInputBuffer failed %x\n", status));
+        return status;
+    }
+
+    return InstallImage(buffer, (ULONG)InputBufferLength);
+}
+
+NTSTATUS
+KbFilter_SetProfileRequest(
+    IN WDFREQUEST    Request,
+    IN size_t        InputBufferLength
+    )
+/*++
+
+Routine Description:
+
+    Switches every keyboard to the profile in the input buffer of an
+    IOCTL_KBFILTR_SET_PROFILE request.
+
+Arguments:
+
+    Request - Handle to the IOCTL_KBFILTR_SET_PROFILE request.
+    InputBufferLength - size of the input buffer.
+
+Return Value:
+
+    NT Status code.
+
+--*/
+{
+    NTSTATUS status;
+    PULONG profile;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), &profile, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(("WdfRequestRetrieveInputBuffer failed %x\n", status));
+        return status;
+    }
+
+    return ProfileSelect(*profile) ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
+
+NTSTATUS
+KbFilter_GetStatsRequest(
+    IN WDFREQUEST    Request,
+    IN size_t        OutputBufferLength
+    )
+/*++
+
+Routine Description:
+
+    Fills the output buffer of an IOCTL_KBFILTR_GET_STATS request with the
+    counters of the driver, summed over all processors.
+
+Arguments:
+
+    Request - Handle to the IOCTL_KBFILTR_GET_STATS request.
+    OutputBufferLength - size of the output buffer.
+
+Return Value:
+
+    NT Status code.
+
+--*/
+{
+    NTSTATUS status;
+    PKBFILTR_STATS stats;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(KBFILTR_STATS), &stats, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(("WdfRequestRetrieveOutputBuffer failed %x\n", status));
+        return status;
+    }
+
+    StatsCollect(stats);
+    WdfRequestSetInformation(Request, sizeof(KBFILTR_STATS));
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+KbFilter_GetLatencyRequest(
+    IN WDFDEVICE     Device,
+    IN WDFREQUEST    Request,
+    IN size_t        InputBufferLength,
+    IN size_t        OutputBufferLength
+    )
+/*++
+
+Routine Description:
+
+    Fills the output buffer of an IOCTL_KBFILTR_GET_LATENCY request with the
+    callback latency histogram of the keyboard the raw PDO belongs to, and
+    clears it when the input buffer asks for that.
+
+Arguments:
+
+    Device - Handle to the raw PDO.
+    Request - Handle to the IOCTL_KBFILTR_GET_LATENCY request.
+    InputBufferLength - size of the input buffer, 0 or a ULONG.
+    OutputBufferLength - size of the output buffer.
+
+Return Value:
+
+    NT Status code.
+
+--*/
+{
+    NTSTATUS status;
+    PDEVICE_EXTENSION devExt = FilterGetData(WdfPdoGetParent(Device));
+    PKBFILTR_LATENCY latency;
+    PULONG reset;
+    BOOLEAN clear = FALSE;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+    //
+    // METHOD_BUFFERED shares one system buffer between input and output,
+    // so the reset flag is read before the histogram overwrites it
+    //
+    if (InputBufferLength) {
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), &reset, NULL);
+        if (!NT_SUCCESS(status)) {
+            DebugPrint(("WdfRequestRetrieveInputBuffer failed %x\n", status));
+            return status;
+        }
+        clear = (*reset != 0);
+    }
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(KBFILTR_LATENCY), &latency, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(("WdfRequestRetrieveOutputBuffer failed %x\n", status));
+        return status;
+    }
+
+    WdfSpinLockAcquire(devExt->EngineLock);
+    RtlCopyMemory(latency, devExt->Latency, sizeof(KBFILTR_LATENCY));
+    if (clear) {
+        RtlZeroMemory(devExt->Latency, sizeof(KBFILTR_LATENCY));
+    }
+    WdfSpinLockRelease(devExt->EngineLock);
+
+    latency->Cycles = ReadTimeStampCounter() - LatencyCycleBase;
+    latency->Time = KbFilter_Now() - LatencyTimeBase;
+    WdfRequestSetInformation(Request, sizeof(KBFILTR_LATENCY));
+    return STATUS_SUCCESS;
+}
+
+VOID
+KbFilter_EvtIoInCallerContextForRawPdo(
+    IN WDFDEVICE     Device,
+    IN WDFREQUEST    Request
+    )
+/*++
+
+Routine Description:
+
+    Called for every request on the raw PDO in the context of the thread
+    that sent it. IOCTL_KBFILTR_MAP_EVENT_RING has to be handled here,
+    since the ring is mapped into the address space of the caller; all
+    other requests go on to the default queue.
+
+Arguments:
+
+    Device - Handle to the raw PDO.
+    Request - Handle to a framework request object.
+
+Return Value:
+
+   VOID
+
+--*/
+{
+    NTSTATUS status;
+    WDF_REQUEST_PARAMETERS params;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request, &params);
+
+    if (params.Type == WdfRequestTypeDeviceControl &&
+        params.Parameters.DeviceIoControl.IoControlCode == IOCTL_KBFILTR_MAP_EVENT_RING) {
+        KbFilter_MapEventRing(Device, Request);
+        return;
+    }
+
+    status = WdfDeviceEnqueueRequest(Device, Request);
+    if (!NT_SUCCESS(status)) {
+        WdfRequestComplete(Request, status);
+    }
+}
+
+VOID
+KbFilter_MapEventRing(
+    IN WDFDEVICE     Device,
+    IN WDFREQUEST    Request
+    )
+/*++
+
+Routine Description:
+
+    Maps the event ring of the parent filter device into the calling
+    process, once per handle, and completes the request with the address.
+
+Arguments:
+
+    Device - Handle to the raw PDO.
+    Request - Handle to the IOCTL_KBFILTR_MAP_EVENT_RING request.
+
+Return Value:
+
+   VOID
+
+--*/
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PDEVICE_EXTENSION devExt = FilterGetData(WdfPdoGetParent(Device));
+    PRING_FILE_CONTEXT fileContext;
+    PKBFILTR_RING_MAPPING mapping;
+    PEPROCESS process;
+    PVOID address = NULL;
+
+    if (WdfRequestGetRequestorMode(Request) != UserMode || devExt->RingMdl == NULL) {
+        WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
+        return;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(KBFILTR_RING_MAPPING), &mapping, NULL);
+    if (!NT_SUCCESS(status)) {
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    fileContext = RingFileGetData(WdfRequestGetFileObject(Request));
+    process = PsGetCurrentProcess();
+
+    //
+    // Overlapped requests on one handle get here concurrently, the one that
+    // claims Process makes the mapping and the others return it once it is
+    // published.
+    //
+    if (InterlockedCompareExchangePointer((PVOID *)&fileContext->Process, process, NULL) == NULL) {
+        __try {
+            address = MmMapLockedPagesSpecifyCache(devExt->RingMdl, UserMode, MmCached,
+                                                   NULL, FALSE, NormalPagePriority | MdlMappingNoExecute);
+        } __except (EXCEPTION_EXECUTE_HANDLER) {
+            address = NULL;
+        }
+
+        if (address == NULL) {
+            DebugPrint(("Mapping the event ring failed\n"));
+            InterlockedExchangePointer((PVOID *)&fileContext->Process, NULL);
+            WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+            return;
+        }
+
+        ObReferenceObject(process);
+        InterlockedIncrement(&devExt->RingReaders);
+        InterlockedExchangePointer(&fileContext->UserAddress, address);
+    }
+
+    //
+    // The address is only valid in the process that made the mapping, a
+    // handle duplicated into another process can't use it.
+    //
+    address = fileContext->UserAddress;
+    if (fileContext->Process != process || address == NULL) {
+        WdfRequestComplete(Request, address == NULL ? STATUS_DEVICE_BUSY : STATUS_ACCESS_DENIED);
+        return;
+    }
+
+    mapping->Address = (ULONG64)(ULONG_PTR)address;
+    mapping->Size = (ULONG)RING_ALLOCATION;
+    mapping->Reserved = 0;
+
+    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(KBFILTR_RING_MAPPING));
+}
+
+VOID
+KbFilter_EvtFileCleanupForRawPdo(
+    IN WDFFILEOBJECT FileObject
+    )
+/*++
+
+Routine Description:
+
+    Called when the last handle to the raw PDO is closed, undoes the event
+    ring mapping made for the handle. That may be in another process than
+    the one the mapping was made in when the handle was duplicated, so the
+    mapping is undone attached to its own process, and left alone when
+    that process has exited and its address space is gone with it.
+
+Arguments:
+
+    FileObject - Handle to the framework file object.
+
+Return Value:
+
+   VOID
+
+--*/
+{
+    PRING_FILE_CONTEXT fileContext = RingFileGetData(FileObject);
+    PDEVICE_EXTENSION devExt;
+    PEPROCESS process = fileContext->Process;
+    KAPC_STATE apcState;
+    LARGE_INTEGER noWait;
+
+    if (fileContext->UserAddress == NULL) {
+        return;
+    }
+
+    devExt = FilterGetData(WdfPdoGetParent(WdfFileObjectGetDevice(FileObject)));
+
+    if (process == PsGetCurrentProcess()) {
+        MmUnmapLockedPages(fileContext->UserAddress, devExt->RingMdl);
+    } else {
+        //
+        // a process object is signalled once the process has exited
+        //
+        noWait.QuadPart = 0;
+        if (KeWaitForSingleObject(process, Executive, KernelMode, FALSE, &noWait) == STATUS_TIMEOUT) {
+            KeStackAttachProcess(process, &apcState);
+            MmUnmapLockedPages(fileContext->UserAddress, devExt->RingMdl);
+            KeUnstackDetachProcess(&apcState);
+        }
+    }
+
+    InterlockedDecrement(&devExt->RingReaders);
+    fileContext->UserAddress = NULL;
+    fileContext->Process = NULL;
+    ObDereferenceObject(process);
+}
+
 #define MAX_ID_LEN 128
 
 NTSTATUS
@@ -125,6 +522,9 @@ Return Value:
     WDF_OBJECT_ATTRIBUTES       pdoAttributes;
     WDF_DEVICE_PNP_CAPABILITIES pnpCaps;
     WDF_IO_QUEUE_CONFIG         ioQueueConfig;
+    WDF_FILEOBJECT_CONFIG       fileConfig;
+    WDF_OBJECT_ATTRIBUTES       fileAttributes;
+    WDF_OBJECT_ATTRIBUTES       queueAttributes;
     WDFQUEUE                    queue;
     WDF_DEVICE_STATE            deviceState;
     PDEVICE_EXTENSION           devExt;
@@ -252,6 +652,17 @@ Return Value:
     //
     WdfPdoInitAllowForwardingRequestToParent(pDeviceInit);
 
+    //
+    // The event ring is mapped into the process that asks for it, which
+    // needs the caller's context, and unmapped when its handle is closed.
+    //
+    WdfDeviceInitSetIoInCallerContextCallback(pDeviceInit, KbFilter_EvtIoInCallerContextForRawPdo);
+
+    WDF_FILEOBJECT_CONFIG_INIT(&fileConfig, WDF_NO_EVENT_CALLBACK, WDF_NO_EVENT_CALLBACK,
+                               KbFilter_EvtFileCleanupForRawPdo);
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&fileAttributes, RING_FILE_CONTEXT);
+    WdfDeviceInitSetFileObjectConfig(pDeviceInit, &fileConfig, &fileAttributes);
+
     status = WdfDeviceCreate(&pDeviceInit, &pdoAttributes, &hChild);
     if (!NT_SUCCESS(status)) {
         goto Cleanup;
@@ -282,9 +693,16 @@ Return Value:
 
     ioQueueConfig.EvtIoDeviceControl = KbFilter_EvtIoDeviceControlForRawPdo;
 
+    //
+    // IOCTL_KBFILTR_LOAD_IMAGE swaps the tables and waits for the engine
+    // to let go of the old ones, which needs PASSIVE_LEVEL.
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT(&queueAttributes);
+    queueAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+
     status = WdfIoQueueCreate(hChild,
                                         &ioQueueConfig,
-                                        WDF_NO_OBJECT_ATTRIBUTES,
+                                        &queueAttributes,
                                         &queue // pointer to default queue
                                         );
     if (!NT_SUCCESS(status)) {
@@ -0,0 +1,380 @@
+/*--
+
+Module Name:
+
+    seqdfa.c
+
+Abstract: Builds the per-layer sequence DFA. The parser records every
+          sequence line into a builder, which is sorted once and turned
+          into a trie of the sequences. The trie is then minimised bottom
+          up: states with the same output, timeout and transitions into
+          the same states are merged, which folds the common endings of
+          the sequences together. The result is one non-paged block per
+          layer.
+
+Environment:
+
+    Kernel mode, or user mode on the host with KBF_HOST.
+
+--*/
+
+#include "kbtypes.h"
+#include "kbkeys.h"
+#include "bindidx.h"
+#include "chordtrie.h"
+#include "seqdfa.h"
+
+#define BUILDER_GROW	64
+
+// a state of the trie while the layer is compiled
+typedef struct _SEQ_NODE {
+	ULONG lo, hi;					// records of the prefix this node stands for
+	ULONG depth;
+	ULONG first, count;				// children, side by side in key order
+	ULONG height;					// keys in the longest sequence going on from here
+	ULONG canon;					// the node this one is merged into
+	ULONG number;					// state number of a canonical node
+	ULONG timeout;
+	ULONG hash;
+	struct_binding binding;
+	UCHAR key;						// key leading into this node
+} SEQ_NODE, *PSEQ_NODE;
+
+VOID SeqBuilderInit(PSEQ_BUILDER builder) {
+	builder->records = NULL;
+	builder->count = 0;
+	builder->capacity = 0;
+	builder->failed = FALSE;
+}
+
+BOOLEAN SeqBuilderSet(PSEQ_BUILDER builder, USHORT layer, const USHORT *keys, ULONG length, ULONG timeout, USHORT mask, const struct_binding *value) {
+	if (layer >= MAX_LAYERS || length < 2 || length > SEQ_MAX) return FALSE;
+	for (ULONG i = 0; i < length; i++) if (keys[i] >= MAX_KEYS) return FALSE;
+
+	if (builder->count == builder->capacity) {
+		ULONG capacity = builder->capacity ? builder->capacity * 2 : BUILDER_GROW;
+		PSEQ_RECORD records = KbAllocatePaged(capacity * sizeof(SEQ_RECORD));
+		if (records == NULL) {
+			builder->failed = TRUE;
+			return FALSE;
+		}
+		if (builder->records) {
+			memcpy(records, builder->records, builder->count * sizeof(SEQ_RECORD));
+			KbFree(builder->records);
+		}
+		builder->records = records;
+		builder->capacity = capacity;
+	}
+
+	PSEQ_RECORD record = &builder->records[builder->count];
+	memset(record, 0, sizeof(SEQ_RECORD));
+	record->layer = (UCHAR)layer;
+	record->length = (UCHAR)length;
+	record->mask = (UCHAR)mask;
+	for (ULONG i = 0; i < length; i++) record->keys[i] = (UCHAR)keys[i];
+	record->timeout = timeout;
+	record->seq = builder->count++;
+	record->value = *value;
+	return TRUE;
+}
+
+// layer, then the keys in order with a prefix before its extensions, then parse order
+static LONG RecordCompare(const SEQ_RECORD *a, const SEQ_RECORD *b) {
+	if (a->layer != b->layer) return (LONG)a->layer - b->layer;
+	for (ULONG i = 0; i < a->length && i < b->length; i++) {
+		if (a->keys[i] != b->keys[i]) return (LONG)a->keys[i] - b->keys[i];
+	}
+	if (a->length != b->length) return (LONG)a->length - b->length;
+	return 0;
+}
+
+static __inline BOOLEAN RecordLess(const SEQ_RECORD *a, const SEQ_RECORD *b) {
+	LONG order = RecordCompare(a, b);
+	return order ? order < 0 : a->seq < b->seq;
+}
+
+static VOID SiftDown(PSEQ_RECORD records, ULONG root, ULONG count) {
+	for (;;) {
+		ULONG child = root * 2 + 1;
+		if (child >= count) return;
+		if (child + 1 < count && RecordLess(&records[child], &records[child + 1])) child++;
+		if (!RecordLess(&records[root], &records[child])) return;
+		SEQ_RECORD t = records[root];
+		records[root] = records[child];
+		records[child] = t;
+		root = child;
+	}
+}
+
+//
+// Sorts the records and folds repeated sequences into one record, later lines
+// override earlier ones field by field and set the timeout.
+//
+VOID SeqBuilderFinish(PSEQ_BUILDER builder) {
+	PSEQ_RECORD records = builder->records;
+	ULONG count = builder->count;
+	ULONG i, out;
+
+	if (count < 2) return;
+
+	for (i = count / 2; i-- > 0;) SiftDown(records, i, count);
+	for (i = count - 1; i > 0; i--) {
+		SEQ_RECORD t = records[0];
+		records[0] = records[i];
+		records[i] = t;
+		SiftDown(records, 0, i);
+	}
+
+	out = 0;
+	for (i = 1; i < count; i++) {
+		PSEQ_RECORD last = &records[out];
+		PSEQ_RECORD next = &records[i];
+		if (RecordCompare(last, next) == 0) {
+			if (next->mask & BIND_OUT1) last->value.out1 = next->value.out1;
+			if (next->mask & BIND_OUT2) last->value.out2 = next->value.out2;
+			if (next->mask & BIND_OUT3) last->value.out3 = next->value.out3;
+			if (next->mask & BIND_FLAG1) last->value.flag1 = next->value.flag1;
+			if (next->mask & BIND_ARG1) last->value.arg1 = next->value.arg1;
+			last->mask |= next->mask;
+			last->timeout = next->timeout;
+		} else {
+			records[++out] = *next;
+		}
+	}
+	builder->count = out + 1;
+}
+
+static BOOLEAN SamePrefix(const SEQ_RECORD *a, const SEQ_RECORD *b, ULONG depth) {
+	if (a->length < depth || b->length < depth) return FALSE;
+	for (ULONG i = 0; i < depth; i++) if (a->keys[i] != b->keys[i]) return FALSE;
+	return TRUE;
+}
+
+static BOOLEAN SameBinding(const struct_binding *a, const struct_binding *b) {
+	return a->out1 == b->out1 && a->out2 == b->out2 && a->out3 == b->out3 &&
+		a->flag1 == b->flag1 && a->arg1 == b->arg1;
+}
+
+// TRUE when a and b, whose children are already canonical, accept the same sequences the same way
+static BOOLEAN Equivalent(const SEQ_NODE *nodes, const SEQ_NODE *a, const SEQ_NODE *b) {
+	if (a->hash != b->hash || a->count != b->count || a->timeout != b->timeout) return FALSE;
+	if (!SameBinding(&a->binding, &b->binding)) return FALSE;
+
+	for (ULONG c = 0; c < a->count; c++) {
+		const SEQ_NODE *x = &nodes[a->first + c], *y = &nodes[b->first + c];
+		if (x->key != y->key || x->canon != y->canon) return FALSE;
+	}
+	return TRUE;
+}
+
+static ULONG NodeHash(const SEQ_NODE *nodes, const SEQ_NODE *node) {
+	ULONG hash = node->timeout * 31 + node->count;
+
+	hash = hash * 31 + node->binding.out1;
+	hash = hash * 31 + node->binding.out2;
+	hash = hash * 31 + node->binding.out3;
+	hash = hash * 31 + node->binding.flag1;
+	hash = hash * 31 + node->binding.arg1;
+	for (ULONG c = 0; c < node->count; c++) {
+		hash = hash * 31 + nodes[node->first + c].key;
+		hash = hash * 31 + nodes[node->first + c].canon;
+	}
+	return hash * 0x9E3779B1;
+}
+
+//
+// Compiles the sequences of one layer into a non-paged SEQ_DFA block.
+// SeqBuilderFinish must have been called. Returns NULL for a layer without
+// sequences.
+//
+PSEQ_DFA SeqBuilderCompile(PSEQ_BUILDER builder, USHORT layer) {
+	PSEQ_RECORD records = builder->records;
+	ULONG start = 0, end, i, nodecount, next, buckets, states, edges, size;
+	PSEQ_NODE nodes = NULL;
+	PULONG table = NULL, order = NULL;
+	PSEQ_DFA dfa = NULL;
+
+	while (start < builder->count && records[start].layer < layer) start++;
+	end = start;
+	while (end < builder->count && records[end].layer == layer) end++;
+	if (end == start) return NULL;
+
+	// one trie node per distinct prefix, plus the start
+	nodecount = 1;
+	for (i = start; i < end; i++) {
+		for (ULONG depth = 1; depth <= records[i].length; depth++) {
+			if (i == start || !SamePrefix(&records[i - 1], &records[i], depth)) nodecount++;
+		}
+	}
+
+	buckets = 16;
+	while (buckets < nodecount * 2) buckets *= 2;
+
+	nodes = KbAllocatePaged(nodecount * sizeof(SEQ_NODE));
+	table = KbAllocatePaged(buckets * sizeof(ULONG));
+	order = KbAllocatePaged(nodecount * sizeof(ULONG));
+	if (nodes == NULL || table == NULL || order == NULL) {
+		builder->failed = TRUE;
+		goto Cleanup;
+	}
+	memset(nodes, 0, nodecount * sizeof(SEQ_NODE));
+
+	// the trie, breadth first so the children of a node are side by side in key order
+	nodes[0].lo = start;
+	nodes[0].hi = end;
+	next = 1;
+	for (ULONG n = 0; n < next; n++) {
+		PSEQ_NODE node = &nodes[n];
+		ULONG lo = node->lo, hi = node->hi;
+
+		while (lo < hi && records[lo].length == node->depth) node->binding = records[lo++].value;
+
+		node->first = next;
+		while (lo < hi) {
+			UCHAR key = records[lo].keys[node->depth];
+			ULONG j = lo;
+
+			for (; j < hi && records[j].keys[node->depth] == key; j++) {
+				if (records[j].timeout > node->timeout) node->timeout = records[j].timeout;
+			}
+			nodes[next].lo = lo;
+			nodes[next].hi = j;
+			nodes[next].depth = node->depth + 1;
+			nodes[next].key = key;
+			next++;
+			node->count++;
+			lo = j;
+		}
+	}
+
+	// minimise from the leaves up, a node is looked up once its children are canonical
+	memset(table, 0xFF, buckets * sizeof(ULONG));
+	states = 0;
+	for (ULONG n = nodecount; n-- > 0;) {
+		PSEQ_NODE node = &nodes[n];
+		ULONG slot;
+
+		for (ULONG c = 0; c < node->count; c++) {
+			ULONG height = nodes[node->first + c].height + 1;
+			if (height > node->height) node->height = height;
+		}
+		node->hash = NodeHash(nodes, node);
+
+		for (slot = node->hash & (buckets - 1); table[slot] != (ULONG)-1; slot = (slot + 1) & (buckets - 1)) {
+			if (Equivalent(nodes, &nodes[table[slot]], node)) break;
+		}
+		if (table[slot] == (ULONG)-1) {
+			table[slot] = n;
+			node->canon = n;
+			order[states++] = n;
+		} else {
+			node->canon = table[slot];
+		}
+	}
+
+	if (states > SEQ_STATES_MAX) {
+		ErrorPrint(("kbfiltr: layer %u has %u sequence states, the DFA holds %u\n", layer, states, SEQ_STATES_MAX));
+		builder->failed = TRUE;
+		goto Cleanup;
+	}
+
+	// number the states by falling height, so every edge goes forward and the start is 0
+	edges = 0;
+	i = 0;
+	for (ULONG height = SEQ_MAX + 1; height-- > 0;) {
+		for (ULONG n = 0; n < nodecount; n++) {
+			if (nodes[n].canon != n || nodes[n].height != height) continue;
+			nodes[n].number = i;
+			order[i++] = n;
+			edges += nodes[n].count;
+		}
+	}
+
+	size = SeqDfaSize(states, edges);
+	dfa = KbAllocateNonPaged(size);
+	if (dfa == NULL) {
+		builder->failed = TRUE;
+		goto Cleanup;
+	}
+	memset(dfa, 0, size);
+	dfa->Size = size;
+	dfa->StateCount = states;
+	dfa->EdgeCount = edges;
+
+	edges = 0;
+	for (i = 0; i < states; i++) {
+		PSEQ_NODE node = &nodes[order[i]];
+		PSEQ_STATE state = &SeqDfaStates(dfa)[i];
+		ULONG rank = 0;
+
+		state->FirstEdge = edges;
+		state->Timeout = node->count ? node->timeout : 0;
+		state->Binding = node->binding;
+		for (ULONG c = 0; c < node->count; c++) {
+			PSEQ_NODE child = &nodes[node->first + c];
+			state->Next[child->key >> 5] |= 1UL << (child->key & 31);
+			SeqDfaEdges(dfa)[edges++] = (USHORT)nodes[child->canon].number;
+		}
+		for (ULONG w = 0; w < CHORD_WORDS; w++) {
+			state->Rank[w] = (UCHAR)rank;
+			rank += ChordBits(state->Next[w]);
+		}
+	}
+
+Cleanup:
+	if (nodes) KbFree(nodes);
+	if (table) KbFree(table);
+	if (order) KbFree(order);
+	return dfa;
+}
+
+VOID SeqBuilderFree(PSEQ_BUILDER builder) {
+	if (builder->records) KbFree(builder->records);
+	SeqBuilderInit(builder);
+}
+
+VOID SeqDfaFree(PSEQ_DFA dfa) {
+	if (dfa) KbFree(dfa);
+}
+
+//
+// A DFA from an image is only run after every edge is known to stay inside
+// the block and to lead forward, so a run can neither leave it nor loop.
+//
+BOOLEAN SeqDfaValid(const SEQ_DFA *dfa, ULONG size) {
+	const SEQ_STATE *states = SeqDfaStates(dfa);
+
+	if (size < sizeof(SEQ_DFA) || dfa->Size != size || dfa->StateCount == 0 || dfa->StateCount > SEQ_STATES_MAX) return FALSE;
+	if (dfa->EdgeCount > SEQ_STATES_MAX * MAX_KEYS || size != SeqDfaSize(dfa->StateCount, dfa->EdgeCount)) return FALSE;
+
+	for (ULONG s = 0; s < dfa->StateCount; s++) {
+		ULONG count = 0;
+
+		for (ULONG w = 0; w < CHORD_WORDS; w++) {
+			if (states[s].Rank[w] != count) return FALSE;
+			count += ChordBits(states[s].Next[w]);
+		}
+		if (states[s].FirstEdge > dfa->EdgeCount || count > dfa->EdgeCount - states[s].FirstEdge) return FALSE;
+		for (ULONG e = 0; e < count; e++) {
+			ULONG target = SeqDfaEdges(dfa)[states[s].FirstEdge + e];
+			if (target <= s || target >= dfa->StateCount) return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+//
+// Adds the memory of each layer's DFA to footprint[] and returns the total
+//
+ULONG SeqDfaReport(PSEQ_DFA dfas[MAX_LAYERS], ULONG footprint[MAX_LAYERS]) {
+	ULONG total = 0;
+
+	for (USHORT i = 0; i < MAX_LAYERS; i++) {
+		if (dfas[i] == NULL) continue;
+		footprint[i] += dfas[i]->Size;
+		total += dfas[i]->Size;
+		DebugPrint(("kbfiltr: layer %u: sequence DFA of %u states and %u edges in %u bytes\n",
+			i, dfas[i]->StateCount, dfas[i]->EdgeCount, dfas[i]->Size));
+	}
+	return total;
+}
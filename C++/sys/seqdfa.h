@@ -0,0 +1,106 @@
+/*++
+
+Module Name:
+
+    seqdfa.h
+
+Abstract:
+
+    Sequence bindings: keys tapped one after another, like a vim leader
+    (>Zgt in kbfiltr.txt). Each layer's sequences are compiled into one
+    minimised DFA. Every state records the output of the sequence that
+    ends in it, how long it waits for the next key and, as in the chord
+    trie, a 256 bit set of the keys it has a transition for. The rank of a
+    key in that set indexes the state's run of the edge array, so a
+    keystroke costs a bit test and a population count and nothing is ever
+    matched twice.
+
+    States are numbered so that every edge leads to a higher number, the
+    start state is 0.
+
+    Block layout (all offsets relative to the start of the block):
+
+        SEQ_DFA                     header
+        SEQ_STATE [StateCount]
+        USHORT Edges[EdgeCount]     target state, per state in key order
+
+Environment:
+
+    kernel mode, or user mode on the host with KBF_HOST
+
+--*/
+
+#ifndef SEQDFA_H
+#define SEQDFA_H
+
+#define SEQ_MAX				8		// keys in the longest sequence
+#define SEQ_NONE			0		// the start state is never a target, so its number means no transition
+#define SEQ_STATES_MAX		0xFFFF
+#define SEQ_DEFAULT_TIMEOUT	1000000	// us allowed between two keys of a sequence, ~e
+
+typedef struct _SEQ_STATE {
+	ULONG  Next[CHORD_WORDS];		// keys with a transition from this state
+	UCHAR  Rank[CHORD_WORDS];		// transitions for the keys of the words before each word
+	ULONG  FirstEdge;
+	ULONG  Timeout;					// us to wait for the next key, 0 in a final state
+	struct_binding Binding;			// output of the sequence ending here, out1 == 0 when none does
+	USHORT Reserved;
+} SEQ_STATE, *PSEQ_STATE;
+
+typedef struct _SEQ_DFA {
+	ULONG Size;						// bytes used by the whole block
+	ULONG StateCount;
+	ULONG EdgeCount;
+	ULONG Reserved;
+} SEQ_DFA, *PSEQ_DFA;
+
+#define SeqDfaStates(_d_) ((SEQ_STATE *)((UCHAR *)(_d_) + sizeof(SEQ_DFA)))
+#define SeqDfaEdges(_d_) ((USHORT *)((UCHAR *)(_d_) + sizeof(SEQ_DFA) + (_d_)->StateCount * sizeof(SEQ_STATE)))
+#define SeqDfaSize(_states_, _edges_) \
+	(sizeof(SEQ_DFA) + (_states_) * sizeof(SEQ_STATE) + (((_edges_) * sizeof(USHORT) + 7) & ~7))
+
+typedef struct _SEQ_RECORD {
+	UCHAR  layer;
+	UCHAR  length;
+	UCHAR  mask;
+	UCHAR  keys[SEQ_MAX];
+	ULONG  timeout;					// us, the ~e in effect for the line
+	ULONG  seq;
+	struct_binding value;
+} SEQ_RECORD, *PSEQ_RECORD;
+
+// collects sequence lines in parse order, like the binding builder
+typedef struct _SEQ_BUILDER {
+	PSEQ_RECORD records;
+	ULONG count;
+	ULONG capacity;
+	BOOLEAN failed;
+} SEQ_BUILDER, *PSEQ_BUILDER;
+
+VOID SeqBuilderInit(PSEQ_BUILDER builder);
+BOOLEAN SeqBuilderSet(PSEQ_BUILDER builder, USHORT layer, const USHORT *keys, ULONG length, ULONG timeout, USHORT mask, const struct_binding *value);
+VOID SeqBuilderFinish(PSEQ_BUILDER builder);
+PSEQ_DFA SeqBuilderCompile(PSEQ_BUILDER builder, USHORT layer);
+VOID SeqBuilderFree(PSEQ_BUILDER builder);
+VOID SeqDfaFree(PSEQ_DFA dfa);
+BOOLEAN SeqDfaValid(const SEQ_DFA *dfa, ULONG size);
+ULONG SeqDfaReport(PSEQ_DFA dfas[MAX_LAYERS], ULONG footprint[MAX_LAYERS]);
+
+//
+// Returns the state reached from state on key, or SEQ_NONE when there is no transition
+//
+FORCEINLINE ULONG SeqStep(const SEQ_DFA *dfa, ULONG state, USHORT key) {
+	const SEQ_STATE *s;
+	ULONG word, bit;
+
+	if (key >= MAX_KEYS) return SEQ_NONE;
+
+	s = &SeqDfaStates(dfa)[state];
+	word = s->Next[key >> 5];
+	bit = 1UL << (key & 31);
+	if ((word & bit) == 0) return SEQ_NONE;
+
+	return SeqDfaEdges(dfa)[s->FirstEdge + s->Rank[key >> 5] + ChordBits(word & (bit - 1))];
+}
+
+#endif  // SEQDFA_H
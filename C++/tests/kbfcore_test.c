@@ -0,0 +1,446 @@
+/*++
+
+Module Name:
+
+    kbfcore_test.c
+
+Abstract:
+
+    Behaviour tests of the modules shared with the driver. Runs key events
+    through the binding engine against a virtual clock and compares its
+    output with what the bindings of a small config should type, for the
+    tables parsed from the text and again for the same tables after a
+    round trip through a compiled image. Then checks that images with a
+    bad header, checksum or section are refused, and that the parser
+    rejects what it can't hold.
+
+    kbfcore_test
+
+    Prints each failed check and exits with 1 when there was one.
+
+Environment:
+
+    user mode, host build (KBF_HOST)
+
+--*/
+
+#include "kbtypes.h"
+#include "kbkeys.h"
+#include "bindidx.h"
+#include "chordtrie.h"
+#include "seqdfa.h"
+#include "cmdvm.h"
+#include "kbconfig.h"
+#include "kbimage.h"
+#include "kbengine.h"
+
+int kbf_verbose = 0;
+
+#define MS			10000	// 100ns units in a millisecond, the engine clock
+#define OUT_LEN		512
+
+static const char config[] =
+	"~t 16\n"
+	"~o 300\n"
+	"~e 1000\n"
+	"~l *\n"
+	"F W\t\" capslock to Win, a single key remap\n"
+	"dj 1\n"
+	"dd D\t\" d held past ~o\n"
+	"qw ~l 0\n"
+	"qwe CIE\n"
+	">Zgt Ct\n"
+	"Qk K\n"
+	"Ql L\n"
+	"Qw ~w 100\n"
+	"~Q p kwl\n"
+	"cp Qp\n"
+	"~i 2 Hi\\n\n"
+	"xz ~i 2\n"
+	"ab ~l 1\n";
+
+static ULONG failures = 0;
+
+#define CHECK(_c_) do { if (!(_c_)) { printf("%s(%d): %s failed\n", __FILE__, __LINE__, #_c_); failures++; } } while (0)
+#define CHECK_OUT(_got_, _want_) do { const char *got = (_got_), *want = (_want_); \
+	if (strcmp(got, want)) { printf("%s(%d): got \"%s\", expected \"%s\"\n", __FILE__, __LINE__, got, want); failures++; } } while (0)
+
+static char output[OUT_LEN];
+
+// Writes keys as "key+" for a make and "key-" for a break, in hex
+static const char *Format(const keydata *keys, ULONG count) {
+	size_t n = 0;
+
+	output[0] = 0;
+	for (ULONG j = 0; j < count && n < OUT_LEN - 16; j++) {
+		n += sprintf(output + n, "%s%x%c", j ? " " : "", keys[j].key, (keys[j].flag & KEY_BREAK) ? '-' : '+');
+	}
+	return output;
+}
+
+// What the driver types for one event at ms, the event itself when the engine passes it on
+static const char *Input(PKB_ENGINE engine, PKB_TABLES tables, USHORT key, USHORT flag, LONGLONG ms) {
+	keydata event = Keydata(key, flag);
+
+	if (KbEngineInput(engine, tables, &event, ms * MS)) return Format(&event, 1);
+	return Format(engine->keyout, engine->kcount);
+}
+
+// What the hold timer types when it fires at the engine's wake time
+static const char *Timeout(PKB_ENGINE engine, PKB_TABLES tables) {
+	KbEngineTimeout(engine, tables, KbEngineWake(engine));
+	return Format(engine->keyout, engine->kcount);
+}
+
+static PKB_TABLES Parse(const char *text, PULONG errors) {
+	KB_PARSER parser;
+
+	if (!KbConfigBegin(&parser)) return NULL;
+	KbConfigParse(&parser, text, (ULONG)strlen(text));
+	if (errors) *errors = parser.errors;
+	return KbConfigEnd(&parser);
+}
+
+static VOID TestRemap(PKB_TABLES tables) {
+	KB_ENGINE engine;
+
+	KbEngineInit(&engine, &tables->Settings);
+	CHECK_OUT(Input(&engine, tables, K_CAPSLOCK, KEY_MAKE, 0), "5b+");
+	CHECK(engine.path == PATH_REMAP);
+	CHECK_OUT(Input(&engine, tables, K_CAPSLOCK, KEY_BREAK, 50), "5b-");
+	CHECK_OUT(Input(&engine, tables, K_Y, KEY_MAKE, 100), "15+");
+	CHECK(engine.path == PATH_PASS);
+}
+
+static VOID TestChord(PKB_TABLES tables) {
+	KB_ENGINE engine;
+
+	// d held, j after ~t: the chord
+	KbEngineInit(&engine, &tables->Settings);
+	CHECK_OUT(Input(&engine, tables, K_D, KEY_MAKE, 0), "");
+	CHECK(KbEngineWake(&engine) == 300 * MS);
+	CHECK_OUT(Input(&engine, tables, K_J, KEY_MAKE, 100), "2+ 2-");
+	CHECK(engine.path == PATH_CHORD);
+	CHECK(KbEngineWake(&engine) == 0);
+	CHECK_OUT(Input(&engine, tables, K_J, KEY_BREAK, 150), "24-");
+	CHECK_OUT(Input(&engine, tables, K_D, KEY_BREAK, 200), "20-");
+
+	// j inside ~t: typed as d j
+	KbEngineInit(&engine, &tables->Settings);
+	CHECK_OUT(Input(&engine, tables, K_D, KEY_MAKE, 1000), "");
+	CHECK_OUT(Input(&engine, tables, K_J, KEY_MAKE, 1008), "20+ 20- 24+ 24-");
+
+	// d held past ~o: its dd hold binding, Del, from the timer
+	KbEngineInit(&engine, &tables->Settings);
+	CHECK_OUT(Input(&engine, tables, K_D, KEY_MAKE, 2000), "");
+	CHECK_OUT(Timeout(&engine, tables), "53+ 53-");
+	CHECK(KbEngineWake(&engine) == 0);
+
+	// qw is bound but qwe goes on, so w waits for e
+	KbEngineInit(&engine, &tables->Settings);
+	CHECK_OUT(Input(&engine, tables, K_Q, KEY_MAKE, 3000), "");
+	CHECK_OUT(Input(&engine, tables, K_W, KEY_MAKE, 3100), "");
+	CHECK_OUT(Input(&engine, tables, K_E, KEY_MAKE, 3150), "1d+ 2a+ 1+ 1- 2a- 1d-");
+}
+
+// ~l is a command: no output, the engine goes on in the new layer
+static VOID TestLayer(PKB_TABLES tables) {
+	KB_ENGINE engine;
+
+	KbEngineInit(&engine, &tables->Settings);
+	Input(&engine, tables, K_A, KEY_MAKE, 1000);
+	CHECK_OUT(Input(&engine, tables, K_B, KEY_MAKE, 1100), "");
+	CHECK(engine.layer == 1);
+	CHECK(engine.ncount == 1 && engine.notices[0].type == NOTICE_LAYER && engine.notices[0].arg == 1);
+}
+
+static VOID TestSequence(PKB_TABLES tables) {
+	KB_ENGINE engine;
+
+	KbEngineInit(&engine, &tables->Settings);
+	CHECK_OUT(Input(&engine, tables, K_SCROLLLOCK, KEY_MAKE, 0), "");
+	CHECK_OUT(Input(&engine, tables, K_SCROLLLOCK, KEY_BREAK, 50), "");
+	CHECK_OUT(Input(&engine, tables, K_G, KEY_MAKE, 300), "");
+	CHECK_OUT(Input(&engine, tables, K_G, KEY_BREAK, 350), "");
+	CHECK_OUT(Input(&engine, tables, K_T, KEY_MAKE, 600), "1d+ 14+ 14- 1d-");
+
+	// j has no transition: the keys taken so far are typed out ahead of it
+	KbEngineInit(&engine, &tables->Settings);
+	Input(&engine, tables, K_SCROLLLOCK, KEY_MAKE, 1000);
+	Input(&engine, tables, K_SCROLLLOCK, KEY_BREAK, 1050);
+	Input(&engine, tables, K_G, KEY_MAKE, 1300);
+	Input(&engine, tables, K_G, KEY_BREAK, 1350);
+	CHECK_OUT(Input(&engine, tables, K_J, KEY_MAKE, 1500), "46+ 46- 22+ 22- 24+");
+
+	// nothing follows within ~e: typed out when it runs out
+	KbEngineInit(&engine, &tables->Settings);
+	Input(&engine, tables, K_SCROLLLOCK, KEY_MAKE, 2000);
+	CHECK(KbEngineWake(&engine) == 3000 * MS);
+	Input(&engine, tables, K_SCROLLLOCK, KEY_BREAK, 2050);
+	CHECK_OUT(Timeout(&engine, tables), "46+ 46-");
+}
+
+// program p: Up, a 100 ms wait, Right
+static VOID TestProgram(PKB_TABLES tables) {
+	KB_ENGINE engine;
+
+	KbEngineInit(&engine, &tables->Settings);
+	CHECK_OUT(Input(&engine, tables, K_C, KEY_MAKE, 0), "");
+	CHECK_OUT(Input(&engine, tables, K_P, KEY_MAKE, 100), "48+ 48-");
+	CHECK(engine.path == PATH_COMMAND);
+	CHECK(engine.ncount == 1 && engine.notices[0].type == NOTICE_PROGRAM && engine.notices[0].command == K_P);
+	CHECK(KbEngineWake(&engine) == 200 * MS);
+	CHECK_OUT(Timeout(&engine, tables), "4d+ 4d-");
+	CHECK(KbEngineWake(&engine) == 0);
+}
+
+static VOID TestPhrase(PKB_TABLES tables) {
+	KB_ENGINE engine;
+	const CHAR *text;
+	ULONG length = 0;
+
+	KbEngineInit(&engine, &tables->Settings);
+	Input(&engine, tables, K_X, KEY_MAKE, 0);
+	CHECK_OUT(Input(&engine, tables, K_Z, KEY_MAKE, 100), "");
+	CHECK(engine.play && engine.phrase == 2);
+
+	// packed: only phrase 2 takes any room
+	text = PhraseText(tables->Phrases, 2, &length);
+	CHECK(text && length == 3 && strcmp(text, "Hi\n") == 0);
+	CHECK(PhraseText(tables->Phrases, 0, &length) == NULL);
+	CHECK(tables->Phrases->Size < 64);
+}
+
+static VOID TestEngine(PKB_TABLES tables) {
+	TestRemap(tables);
+	TestChord(tables);
+	TestLayer(tables);
+	TestSequence(tables);
+	TestProgram(tables);
+	TestPhrase(tables);
+}
+
+static BOOLEAN SameBlock(const VOID *a, const VOID *b) {
+	if (a == NULL || b == NULL) return a == b;
+	return *(const ULONG *)a == *(const ULONG *)b && memcmp(a, b, *(const ULONG *)a) == 0;
+}
+
+// The two table sets hold the same bytes, the blocks all start with their Size
+static BOOLEAN SameTables(PKB_TABLES a, PKB_TABLES b) {
+	if (memcmp(&a->Settings, &b->Settings, sizeof(KB_SETTINGS)) || memcmp(a->keymap, b->keymap, sizeof(a->keymap))) return FALSE;
+	if (!SameBlock(a->Phrases, b->Phrases)) return FALSE;
+
+	for (ULONG layer = 0; layer < MAX_LAYERS; layer++) {
+		if (!SameBlock(a->Layers[layer], b->Layers[layer]) || !SameBlock(a->Chords[layer], b->Chords[layer])) return FALSE;
+		if (!SameBlock(a->Sequences[layer], b->Sequences[layer]) || !SameBlock(a->Programs[layer], b->Programs[layer])) return FALSE;
+	}
+	return TRUE;
+}
+
+static PVOID Copy(const VOID *image, ULONG size) {
+	PVOID copy = malloc(size);
+
+	memcpy(copy, image, size);
+	return copy;
+}
+
+// Loads a copy of image, TRUE when it was taken
+static BOOLEAN Loads(const VOID *image, ULONG size) {
+	PVOID copy = Copy(image, size);
+	PKB_TABLES tables = KbImageLoad(copy, size);
+
+	if (tables == NULL) {
+		free(copy);
+		return FALSE;
+	}
+	KbTablesFree(tables);
+	return TRUE;
+}
+
+static VOID Rechecksum(PUCHAR image) {
+	PKB_IMAGE_HEADER header = (PKB_IMAGE_HEADER)image;
+
+	header->Checksum = KbImageChecksum(image + sizeof(KB_IMAGE_HEADER), header->Size - sizeof(KB_IMAGE_HEADER));
+}
+
+// The data of the first section of type in image
+static PVOID Section(PUCHAR image, USHORT type) {
+	PKB_IMAGE_HEADER header = (PKB_IMAGE_HEADER)image;
+	PKB_IMAGE_SECTION sections = (PKB_IMAGE_SECTION)(image + sizeof(KB_IMAGE_HEADER));
+
+	for (ULONG n = 0; n < header->SectionCount; n++) {
+		if (sections[n].Type == type) return image + sections[n].Offset;
+	}
+	return NULL;
+}
+
+static VOID TestImage(PKB_TABLES tables) {
+	PUCHAR image, bad;
+	PKB_TABLES loaded;
+	ULONG size;
+	PBINDING_LAYER layer;
+	PCHORD_TRIE trie;
+	PSEQ_DFA dfa;
+	PCMD_PROGRAMS programs;
+	PPHRASE_BLOCK phrases;
+
+	image = KbImageBuild(tables, &size);
+	CHECK(image != NULL);
+	if (image == NULL) return;
+
+	// round trip: the same blocks, and the engine behaves the same on them
+	loaded = KbImageLoad(Copy(image, size), size);
+	CHECK(loaded != NULL);
+	if (loaded) {
+		CHECK(SameTables(tables, loaded));
+		TestEngine(loaded);
+		KbTablesFree(loaded);
+	}
+
+	// header and checksum
+	bad = Copy(image, size);
+	bad[size - 1] ^= 1;
+	CHECK(!Loads(bad, size));
+	free(bad);
+
+	bad = Copy(image, size);
+	((PKB_IMAGE_HEADER)bad)->Version = KB_IMAGE_VERSION - 1;
+	CHECK(!Loads(bad, size));
+	free(bad);
+
+	CHECK(!Loads(image, size - KB_IMAGE_ALIGN));
+	CHECK(!Loads(image, sizeof(KB_IMAGE_HEADER) - 1));
+
+	// each kind of block with a consistent checksum but a broken structure
+	bad = Copy(image, size);
+	layer = Section(bad, KB_SECTION_LAYER);
+	layer->First[MAX_KEYS]++;
+	Rechecksum(bad);
+	CHECK(!Loads(bad, size));
+	free(bad);
+
+	bad = Copy(image, size);
+	trie = Section(bad, KB_SECTION_CHORDS);
+	ChordTrieNodes(trie)[0].FirstChild = 0;	// the root pointing back at itself
+	Rechecksum(bad);
+	CHECK(!Loads(bad, size));
+	free(bad);
+
+	bad = Copy(image, size);
+	dfa = Section(bad, KB_SECTION_SEQUENCES);
+	SeqDfaEdges(dfa)[0] = 0;				// an edge back to the start
+	Rechecksum(bad);
+	CHECK(!Loads(bad, size));
+	free(bad);
+
+	bad = Copy(image, size);
+	programs = Section(bad, KB_SECTION_PROGRAMS);
+	CmdOps(programs)[programs->OpCount - 1].Op = CMD_KEYS;	// running past the end of the block
+	Rechecksum(bad);
+	CHECK(!Loads(bad, size));
+	free(bad);
+
+	bad = Copy(image, size);
+	programs = Section(bad, KB_SECTION_PROGRAMS);
+	CmdOps(programs)[0].Op = CMD_CALL;
+	CmdOps(programs)[0].Arg = MAX_LAYERS;	// a call into a layer that doesn't exist
+	Rechecksum(bad);
+	CHECK(!Loads(bad, size));
+	free(bad);
+
+	bad = Copy(image, size);
+	phrases = Section(bad, KB_SECTION_PHRASES);
+	phrases->Offset[2] = (USHORT)phrases->Size;	// a phrase past the end of the block
+	Rechecksum(bad);
+	CHECK(!Loads(bad, size));
+	free(bad);
+
+	// and the untouched image still loads
+	CHECK(Loads(image, size));
+	KbFree(image);
+}
+
+// Profiles parsed from the same text end up with one copy of every block
+static VOID TestShare(VOID) {
+	PKB_TABLES first = Parse(config, NULL), second = Parse(config, NULL);
+
+	CHECK(first && second);
+	if (first == NULL || second == NULL) return;
+
+	CHECK(KbTablesShare(second, &first, 1) > 0);
+	CHECK(second->Phrases == first->Phrases && second->Layers[0] == first->Layers[0]);
+	CHECK(second->Sequences[0] == first->Sequences[0] && second->Programs[0] == first->Programs[0]);
+	TestEngine(second);
+
+	KbTablesFree(second);
+	KbTablesFree(first);
+}
+
+static VOID TestParser(VOID) {
+	PKB_TABLES tables;
+	PBINDING_BUILDER builder;
+	ULONG errors;
+	char *text, *line;
+	ULONG seed = 1;
+
+	// a line that can't be read is reported, and the rest of the config still loads
+	tables = Parse("~l 9\ndj 1\n", &errors);
+	CHECK(tables && errors == 1 && BindingLookup(tables->Layers[MAX_LAYERS - 1], K_D, K_J)->out1 == K_1);
+	KbTablesFree(tables);
+
+	// times past a ULONG of microseconds are reported and read as the longest
+	tables = Parse("~t 4294967\n~o 4294967295u\n", &errors);
+	CHECK(tables && errors == 0 && tables->Settings.key_bind_time == 4294967000UL && tables->Settings.key_bind_timeout == 0xFFFFFFFF);
+	KbTablesFree(tables);
+
+	tables = Parse("~t 5000000\n~o 4294968\n~d 99999999999u\n", &errors);
+	CHECK(tables && errors == 3 && tables->Settings.key_bind_time == 0xFFFFFFFF && tables->Settings.longkey_time == 0xFFFFFFFF);
+	KbTablesFree(tables);
+
+	// a layer with a binding for every key1 + key2 is one more than its index holds
+	builder = malloc(sizeof(BINDING_BUILDER));
+	BindingBuilderInit(builder);
+	for (ULONG n = 0; n < MAX_KEYS * MAX_KEYS; n++) {
+		struct_binding value = { K_A, 0, 0, 0, 0 };
+		BindingBuilderSet(builder, 0, (USHORT)(n / MAX_KEYS), (USHORT)(n % MAX_KEYS), BIND_OUT1, &value);
+	}
+	BindingBuilderFinish(builder);
+	CHECK(BindingBuilderCompile(builder, 0) == NULL && builder->failed);
+	BindingBuilderFree(builder);
+	free(builder);
+
+	// a layer whose sequences need more DFA states than it holds fails the load
+	text = malloc(40000 * 16);
+	line = text;
+	for (ULONG n = 0; n < 40000; n++) {
+		*line++ = '>';
+		for (ULONG k = 0; k < SEQ_MAX; k++) {
+			seed = seed * 1103515245 + 12345;
+			*line++ = "abcdefghijklmnopqrstuvwxyz"[(seed >> 16) % 26];
+		}
+		line += sprintf(line, " x\n");
+	}
+	*line = 0;
+	tables = Parse(text, NULL);
+	CHECK(tables == NULL);
+	KbTablesFree(tables);
+	free(text);
+}
+
+int main(void) {
+	PKB_TABLES tables;
+	ULONG errors;
+
+	tables = Parse(config, &errors);
+	CHECK(tables != NULL && errors == 0);
+	if (tables == NULL) return 1;
+
+	TestEngine(tables);
+	TestImage(tables);
+	TestShare();
+	TestParser();
+
+	KbTablesFree(tables);
+	if (failures) printf("%u checks failed\n", failures);
+	return failures ? 1 : 0;
+}
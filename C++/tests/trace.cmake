@@ -0,0 +1,17 @@
+# Runs kbfsim on a trace and fails when its output differs from the expected file.
+#
+#   cmake -DKBFSIM=kbfsim -DCONFIG=kbfiltr.txt -DTRACE=chord.trace -DEXPECTED=chord.expected -P trace.cmake
+
+execute_process(COMMAND ${KBFSIM} ${CONFIG} ${TRACE}
+	OUTPUT_VARIABLE output
+	RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "kbfsim exited with ${result}")
+endif()
+
+file(READ ${EXPECTED} expected)
+if(NOT output STREQUAL expected)
+	file(WRITE ${CMAKE_CURRENT_BINARY_DIR}/chord.out "${output}")
+	execute_process(COMMAND diff -u ${EXPECTED} ${CMAKE_CURRENT_BINARY_DIR}/chord.out)
+	message(FATAL_ERROR "kbfsim output differs from ${EXPECTED}")
+endif()
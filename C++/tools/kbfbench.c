@@ -0,0 +1,158 @@
+/*++
+
+Module Name:
+
+    kbfbench.c
+
+Abstract:
+
+    Throughput benchmark of the binding engine. Parses a kbfiltr.txt and
+    drives the engine with a generated stream of typing, chords and holds
+    on a virtual clock, the way the service callback and the hold timer
+    would, then reports the time spent per event.
+
+    kbfbench [-n events] [-s seed] kbfiltr.txt
+
+Environment:
+
+    user mode, host build (KBF_HOST)
+
+--*/
+
+#include <time.h>
+
+#include "kbtypes.h"
+#include "kbkeys.h"
+#include "bindidx.h"
+#include "chordtrie.h"
+#include "seqdfa.h"
+#include "cmdvm.h"
+#include "kbconfig.h"
+#include "kbengine.h"
+
+int kbf_verbose = 0;
+
+#define MS					10000	// 100ns units per millisecond
+
+static ULONG seed = 1;
+
+static ULONG Random(ULONG n) {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) % n;
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: kbfbench [-n events] [-s seed] kbfiltr.txt\n");
+	exit(2);
+}
+
+static double Seconds(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	const char *input = NULL;
+	ULONG events = 10000000, n = 0;
+	KB_PARSER parser;
+	PKB_TABLES tables;
+	KB_ENGINE engine;
+	keydata *stream;
+	LONGLONG *times, now = 0;
+	unsigned long long outputs = 0, passed = 0, sum = 0;
+	char chunk[4096];
+	size_t length;
+	double start, elapsed;
+	FILE *file;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) events = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) seed = strtoul(argv[++i], NULL, 0);
+		else if (argv[i][0] == '-' || input) usage();
+		else input = argv[i];
+	}
+	if (input == NULL || events < 4) usage();
+
+	file = fopen(input, "rb");
+	if (file == NULL) {
+		perror(input);
+		return 1;
+	}
+	if (!KbConfigBegin(&parser)) {
+		fprintf(stderr, "kbfbench: out of memory\n");
+		return 1;
+	}
+	while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0) KbConfigParse(&parser, chunk, (ULONG)length);
+	fclose(file);
+	tables = KbConfigEnd(&parser);
+	if (tables == NULL) {
+		fprintf(stderr, "kbfbench: out of memory\n");
+		return 1;
+	}
+
+	// generate the whole stream first so only the engine is timed
+	stream = malloc(events * sizeof(keydata));
+	times = malloc(events * sizeof(LONGLONG));
+	if (stream == NULL || times == NULL) {
+		fprintf(stderr, "kbfbench: out of memory\n");
+		return 1;
+	}
+	while (n + 4 <= events) {
+		USHORT key1 = (USHORT)(K_Q + Random(K_M - K_Q + 1));
+		USHORT key2 = (USHORT)(K_Q + Random(K_M - K_Q + 1));
+
+		switch (Random(8)) {
+		case 0: // chord: key1 held past ~t, then key2
+		case 1:
+			now += 40 * MS; stream[n] = Keydata(key1, KEY_MAKE); times[n++] = now;
+			now += 60 * MS; stream[n] = Keydata(key2, KEY_MAKE); times[n++] = now;
+			now += 30 * MS; stream[n] = Keydata(key2, KEY_BREAK); times[n++] = now;
+			now += 20 * MS; stream[n] = Keydata(key1, KEY_BREAK); times[n++] = now;
+			break;
+		case 2: // hold through key repeat and the binding timeout
+			now += 40 * MS; stream[n] = Keydata(key1, KEY_MAKE); times[n++] = now;
+			now += 500 * MS; stream[n] = Keydata(key1, KEY_MAKE); times[n++] = now;
+			now += 800 * MS; stream[n] = Keydata(key1, KEY_MAKE); times[n++] = now;
+			now += 30 * MS; stream[n] = Keydata(key1, KEY_BREAK); times[n++] = now;
+			break;
+		default: // fast typing, rolled over
+			now += 25 * MS; stream[n] = Keydata(key1, KEY_MAKE); times[n++] = now;
+			now += 5 * MS; stream[n] = Keydata(key2, KEY_MAKE); times[n++] = now;
+			now += 40 * MS; stream[n] = Keydata(key1, KEY_BREAK); times[n++] = now;
+			now += 10 * MS; stream[n] = Keydata(key2, KEY_BREAK); times[n++] = now;
+			break;
+		}
+	}
+
+	KbEngineInit(&engine, &tables->Settings);
+
+	start = Seconds();
+	for (ULONG i = 0; i < n; i++) {
+		keydata event = stream[i];
+
+		// the hold timer would have fired by now
+		if (KbEngineWake(&engine) && times[i] >= KbEngineWake(&engine)) {
+			KbEngineTimeout(&engine, tables, KbEngineWake(&engine));
+			outputs += engine.kcount;
+		}
+
+		if (KbEngineInput(&engine, tables, &event, times[i])) {
+			passed++;
+			sum += event.key;
+		} else {
+			outputs += engine.kcount;
+			for (ULONG j = 0; j < engine.kcount; j++) sum += engine.keyout[j].key;
+		}
+	}
+	elapsed = Seconds() - start;
+
+	printf("%lu events, %llu passed, %llu emitted, checksum %llu\n", (unsigned long)n, passed, outputs, sum);
+	printf("%.1f ns/event, %.0f events/s\n", elapsed * 1e9 / n, n / elapsed);
+
+	KbTablesFree(tables);
+	free(stream);
+	free(times);
+	return 0;
+}
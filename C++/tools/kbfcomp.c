@@ -0,0 +1,104 @@
+/*++
+
+Module Name:
+
+    kbfcomp.c
+
+Abstract:
+
+    Compiles kbfiltr.txt into the kbfiltr.bin keymap image the driver loads
+    in place of the text. Uses the driver's own parser and image writer, so
+    errors show up here instead of on the target machine.
+
+    kbfcomp [-q] [-o kbfiltr.bin] kbfiltr.txt
+
+Environment:
+
+    user mode, host build (KBF_HOST)
+
+--*/
+
+#include "kbtypes.h"
+#include "kbkeys.h"
+#include "bindidx.h"
+#include "chordtrie.h"
+#include "seqdfa.h"
+#include "cmdvm.h"
+#include "kbconfig.h"
+#include "kbimage.h"
+
+int kbf_verbose = 1;
+
+static void usage(void) {
+	fprintf(stderr, "usage: kbfcomp [-q] [-o kbfiltr.bin] kbfiltr.txt\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	const char *input = NULL, *output = "kbfiltr.bin";
+	KB_PARSER parser;
+	PKB_TABLES tables, loaded;
+	char chunk[4096];
+	size_t length;
+	ULONG size;
+	PVOID image, copy;
+	FILE *file;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-q") == 0) kbf_verbose = 0;
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+		else if (argv[i][0] == '-' || input) usage();
+		else input = argv[i];
+	}
+	if (input == NULL) usage();
+
+	file = fopen(input, "rb");
+	if (file == NULL) {
+		perror(input);
+		return 1;
+	}
+	if (!KbConfigBegin(&parser)) {
+		fprintf(stderr, "kbfcomp: out of memory\n");
+		return 1;
+	}
+	while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0) KbConfigParse(&parser, chunk, (ULONG)length);
+	fclose(file);
+
+	if (parser.errors) {
+		fprintf(stderr, "%s: %u errors, no image written\n", input, parser.errors);
+		KbConfigAbort(&parser);
+		return 1;
+	}
+
+	tables = KbConfigEnd(&parser);
+	if (tables == NULL || (image = KbImageBuild(tables, &size)) == NULL) {
+		fprintf(stderr, "kbfcomp: out of memory\n");
+		return 1;
+	}
+
+	// load a copy the way the driver will, so a bad image never leaves the host
+	copy = malloc(size);
+	if (copy == NULL) {
+		fprintf(stderr, "kbfcomp: out of memory\n");
+		return 1;
+	}
+	memcpy(copy, image, size);
+	loaded = KbImageLoad(copy, size);
+	if (loaded == NULL) {
+		fprintf(stderr, "kbfcomp: image failed validation\n");
+		return 1;
+	}
+
+	file = fopen(output, "wb");
+	if (file == NULL || fwrite(image, 1, size, file) != size || fclose(file) != 0) {
+		perror(output);
+		return 1;
+	}
+
+	if (kbf_verbose) printf("%s: %u bytes, checksum %08x\n", output, size, ((PKB_IMAGE_HEADER)image)->Checksum);
+
+	KbTablesFree(loaded);
+	KbTablesFree(tables);
+	free(image);
+	return 0;
+}
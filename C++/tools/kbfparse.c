@@ -0,0 +1,219 @@
+/*++
+
+Module Name:
+
+    kbfparse.c
+
+Abstract:
+
+    Throughput benchmark of the kbfiltr.txt parser. Generates a config of
+    the requested size with every kind of line the parser knows, comments,
+    ~ settings, layer switches, single key remaps, chords of two to four
+    keys, > sequences and HEX bindings, then times the tokenizer over it
+    in the 4k chunks the driver reads, and the compile of the tables once.
+
+    kbfparse [-m megabytes] [-n passes] [-s seed] [-o generated.txt] [kbfiltr.txt]
+
+    With a file argument that file is timed instead of a generated one.
+
+Environment:
+
+    user mode, host build (KBF_HOST)
+
+--*/
+
+#include <time.h>
+
+#include "kbtypes.h"
+#include "kbkeys.h"
+#include "bindidx.h"
+#include "chordtrie.h"
+#include "seqdfa.h"
+#include "cmdvm.h"
+#include "kbconfig.h"
+
+int kbf_verbose = 0;
+
+#define CHUNK				4096
+
+static ULONG seed = 1;
+
+// characters that are keys in the default keymap
+static const char keys[] = "abcdefghijklmnopqrstuvwxyz0123456789`-=[]\\;',./ABCDEFGHIJKLMNOPRSTUVWXZ!@#$%^&*()_+";
+
+static ULONG Random(ULONG n) {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) % n;
+}
+
+static char Key(void) {
+	return keys[Random(sizeof(keys) - 1)];
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: kbfparse [-m megabytes] [-n passes] [-s seed] [-o generated.txt] [kbfiltr.txt]\n");
+	exit(2);
+}
+
+static double Seconds(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes one random line into line, returns its length
+static int GenerateLine(char *line) {
+	static const char settings[] = "tdros";
+	static const char *comments[] = { "\t\" comment", "\t\t\" Ctrl + Shift", "\t\"", "" };
+	const char *comment = comments[Random(4)];
+	char out[4] = { Key(), Key(), Key(), 0 };
+	ULONG outs = 1 + Random(3);
+
+	out[outs] = 0;
+	switch (Random(16)) {
+	case 0: // comment and blank lines
+		return sprintf(line, "\" ------------------------------------------------------------------------------\n");
+	case 1:
+		return sprintf(line, "\n");
+	case 2: // settings and layer switches
+		return sprintf(line, "~%c %u%s\n", settings[Random(sizeof(settings) - 1)], 1 + Random(2000), comment);
+	case 3:
+		return (Random(4) == 0) ? sprintf(line, "~l *\n") : sprintf(line, "~l %u\t\" layer\n", Random(MAX_LAYERS));
+	case 4: // single key remap
+		return sprintf(line, "%c %s%s\n", Key(), out, comment);
+	case 5: // HEX binding
+		return sprintf(line, "%c%c E0%02X%s\n", Key(), Key(), 0x47 + Random(8), comment);
+	case 6: // layer command
+		return sprintf(line, "%c%c ~l %u%s\n", Key(), Key(), Random(MAX_LAYERS), comment);
+	case 7: // three and four key chords
+		return sprintf(line, "%c%c%c %s%s\n", Key(), Key(), Key(), out, comment);
+	case 8:
+		return sprintf(line, "%c%c%c%c %s%s\n", Key(), Key(), Key(), Key(), out, comment);
+	case 9: // sequences
+		return sprintf(line, ">%c%c%c %s%s\n", Key(), Key(), Key(), out, comment);
+	default: // two key chords, most of a real config
+		return sprintf(line, "%c%c %s%s\n", Key(), Key(), out, comment);
+	}
+}
+
+static char *Generate(size_t size, size_t *length, ULONG *lines) {
+	char *text = malloc(size + 256);
+	size_t n = 0;
+
+	if (text == NULL) return NULL;
+	*lines = 0;
+	while (n < size) {
+		n += GenerateLine(text + n);
+		(*lines)++;
+	}
+	*length = n;
+	return text;
+}
+
+static char *ReadFile(const char *name, size_t *length, ULONG *lines) {
+	char *text = NULL;
+	size_t size = 0, n = 0, got;
+	FILE *file = fopen(name, "rb");
+
+	if (file == NULL) {
+		perror(name);
+		return NULL;
+	}
+	do {
+		if (n == size) {
+			char *grown = realloc(text, size = size ? size * 2 : 1 << 20);
+			if (grown == NULL) {
+				free(text);
+				fclose(file);
+				return NULL;
+			}
+			text = grown;
+		}
+		got = fread(text + n, 1, size - n, file);
+		n += got;
+	} while (got > 0);
+	fclose(file);
+
+	*lines = 0;
+	for (size_t i = 0; i < n; i++) if (text[i] == '\n') (*lines)++;
+	*length = n;
+	return text;
+}
+
+// Feeds text to parser in driver sized chunks
+static VOID Parse(PKB_PARSER parser, const char *text, size_t length) {
+	for (size_t i = 0; i < length; i += CHUNK) {
+		KbConfigParse(parser, text + i, (ULONG)((length - i < CHUNK) ? length - i : CHUNK));
+	}
+}
+
+int main(int argc, char *argv[]) {
+	const char *input = NULL, *output = NULL;
+	ULONG megabytes = 8, passes = 5, lines = 0, errors = 0;
+	KB_PARSER parser;
+	PKB_TABLES tables;
+	size_t length;
+	char *text;
+	double start, parse, best = 0, compile;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) megabytes = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) passes = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) seed = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+		else if (argv[i][0] == '-' || input) usage();
+		else input = argv[i];
+	}
+	if (passes == 0 || (input == NULL && megabytes == 0)) usage();
+
+	text = input ? ReadFile(input, &length, &lines) : Generate((size_t)megabytes << 20, &length, &lines);
+	if (text == NULL) {
+		fprintf(stderr, "kbfparse: out of memory\n");
+		return 1;
+	}
+	if (output) {
+		FILE *file = fopen(output, "wb");
+		if (file == NULL || fwrite(text, 1, length, file) != length) {
+			perror(output);
+			return 1;
+		}
+		fclose(file);
+	}
+
+	// the tokenizer alone, best of the passes
+	for (ULONG pass = 0; pass < passes; pass++) {
+		if (!KbConfigBegin(&parser)) {
+			fprintf(stderr, "kbfparse: out of memory\n");
+			return 1;
+		}
+		start = Seconds();
+		Parse(&parser, text, length);
+		parse = Seconds() - start;
+		if (pass == 0 || parse < best) best = parse;
+		errors = parser.errors;
+		KbConfigAbort(&parser);
+	}
+
+	// then once more through the compile of the tables
+	if (!KbConfigBegin(&parser)) {
+		fprintf(stderr, "kbfparse: out of memory\n");
+		return 1;
+	}
+	Parse(&parser, text, length);
+	start = Seconds();
+	tables = KbConfigEnd(&parser);
+	compile = Seconds() - start;
+	if (tables == NULL) {
+		fprintf(stderr, "kbfparse: out of memory\n");
+		return 1;
+	}
+
+	printf("%lu bytes, %lu lines, %lu errors\n", (unsigned long)length, (unsigned long)lines, (unsigned long)errors);
+	printf("parse %.1f ms, %.1f MB/s, %.1f ns/line\n", best * 1e3, length / best / (1 << 20), best * 1e9 / (lines ? lines : 1));
+	printf("compile %.1f ms\n", compile * 1e3);
+
+	KbTablesFree(tables);
+	free(text);
+	return 0;
+}
@@ -0,0 +1,305 @@
+/*++
+
+Module Name:
+
+    kbfsim.c
+
+Abstract:
+
+    Replays a recorded keyboard trace through the binding engine against
+    a virtual clock, so a chord misfire reported from a real machine can be
+    reproduced exactly. The hold timer is simulated: a pending hold is
+    resolved at its deadline whenever the next event comes later, or at the
+    end of the trace, and a ~Q program that waits goes on the same way.
+    ScrollLock cycles the modes like it does in the driver, once the engine
+    passed it on or typed it; with bindings off the keys go out as they
+    came, in the diagnostic and keyboard off modes none do (the messages of
+    the diagnostic keys are not simulated). Each pass starts with bindings
+    on.
+
+    kbfsim [-q] [-n passes] kbfiltr.txt trace
+
+    A trace has one event per line, the scancode and the KEYBOARD_INPUT_DATA
+    flags in hex and the time in microseconds, " starts a comment:
+
+        1e 0 1000		" A make
+        1e 1 81000		" A break
+
+    The output is printed in the same format, so it can be diffed or fed
+    back in, followed by the throughput on stderr. -n replays the trace
+    that many times back to back, -q prints only the throughput.
+
+Environment:
+
+    user mode, host build (KBF_HOST)
+
+--*/
+
+#include <time.h>
+
+#include "kbtypes.h"
+#include "kbkeys.h"
+#include "bindidx.h"
+#include "chordtrie.h"
+#include "seqdfa.h"
+#include "cmdvm.h"
+#include "kbconfig.h"
+#include "kbengine.h"
+
+int kbf_verbose = 0;
+
+typedef struct _TRACE_EVENT {
+	keydata event;
+	LONGLONG time;		// 100ns
+} TRACE_EVENT, *PTRACE_EVENT;
+
+static BOOLEAN quiet = FALSE;
+
+// the ScrollLock modes, KeyEnabled in kbfiltr.c
+#define MODE_KEYBOARD_OFF	0
+#define MODE_BINDING_ON		1
+#define MODE_BINDING_OFF	2
+#define MODE_DIAGNOSTIC		3
+
+static ULONG mode = MODE_BINDING_ON;
+static BOOLEAN modedown = FALSE;
+
+static void usage(void) {
+	fprintf(stderr, "usage: kbfsim [-q] [-n passes] kbfiltr.txt trace\n");
+	exit(2);
+}
+
+static double Seconds(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static PKB_TABLES ReadConfig(const char *name) {
+	KB_PARSER parser;
+	char chunk[4096];
+	size_t length;
+	FILE *file;
+
+	file = fopen(name, "rb");
+	if (file == NULL) {
+		perror(name);
+		return NULL;
+	}
+	if (!KbConfigBegin(&parser)) {
+		fclose(file);
+		return NULL;
+	}
+	while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0) KbConfigParse(&parser, chunk, (ULONG)length);
+	fclose(file);
+	return KbConfigEnd(&parser);
+}
+
+static PTRACE_EVENT ReadTrace(const char *name, PULONG count) {
+	PTRACE_EVENT trace = NULL;
+	ULONG n = 0, size = 0, line = 0;
+	char text[256];
+	FILE *file;
+
+	file = fopen(name, "r");
+	if (file == NULL) {
+		perror(name);
+		return NULL;
+	}
+	while (fgets(text, sizeof(text), file)) {
+		unsigned int key, flag;
+		unsigned long long us;
+		char *comment = strchr(text, '"');
+
+		line++;
+		if (comment) *comment = 0;
+		if (strspn(text, " \t\r\n") == strlen(text)) continue;
+
+		if (sscanf(text, "%x %x %llu", &key, &flag, &us) != 3 || key > 0xFFFF || flag > 0xFFFF) {
+			fprintf(stderr, "%s(%u): expected scancode, flags and time\n", name, line);
+			free(trace);
+			fclose(file);
+			return NULL;
+		}
+		if (n == size) {
+			PTRACE_EVENT grown;
+			size = size ? size * 2 : 1024;
+			grown = realloc(trace, size * sizeof(TRACE_EVENT));
+			if (grown == NULL) {
+				free(trace);
+				fclose(file);
+				return NULL;
+			}
+			trace = grown;
+		}
+		trace[n].event = Keydata((USHORT)key, (USHORT)flag);
+		trace[n].time = (LONGLONG)us * 10;
+		n++;
+	}
+	fclose(file);
+	*count = n;
+	return trace;
+}
+
+// Steps the mode on the release of a ScrollLock whose press came here too, as KbFilter_ModeKey does
+static VOID ModeKey(USHORT flag, LONGLONG time) {
+	if ((flag & KEY_BREAK) == 0) {
+		modedown = TRUE;
+		return;
+	}
+	if (!modedown) return;
+
+	modedown = FALSE;
+	if (++mode > MODE_DIAGNOSTIC) mode = MODE_KEYBOARD_OFF;
+	if (!quiet) printf("\" mode %u at %lld\n", mode, (long long)(time / 10));
+}
+
+//
+// Prints keyout the way the driver hands it up, extended keys get their E0
+// prefix flag and a ScrollLock steps the mode. Returns the packets typed.
+//
+static ULONG PrintKeyout(PKB_ENGINE engine, LONGLONG time) {
+	ULONG typed = 0;
+
+	for (ULONG j = 0; j < engine->kcount; j++) {
+		USHORT key = engine->keyout[j].key;
+
+		if (key == K_SCROLLLOCK) {
+			ModeKey(engine->keyout[j].flag, time);
+			continue;
+		}
+		if (!quiet) printf("%x %x %lld\n", key, engine->keyout[j].flag | ((key >= K_HOME) ? KEY_E0 : 0), (long long)(time / 10));
+		typed++;
+	}
+	return typed;
+}
+
+// Prints the packets of a ~i phrase, the driver types them out in chunks, all at time here
+static ULONG PrintPhrase(const char *text, LONGLONG time) {
+	keydata keys[4];
+	ULONG total = 0;
+
+	for (; *text; text++) {
+		ULONG n = KbTextKeys(*text, keys);
+		for (ULONG j = 0; j < n && !quiet; j++) printf("%x %x %lld\n", keys[j].key, keys[j].flag, (long long)(time / 10));
+		total += n;
+	}
+	return total;
+}
+
+// What the driver does for a ~r, ~f or ~i command, returns the packets typed
+static ULONG Requests(PKB_ENGINE engine, PKB_TABLES tables, LONGLONG time) {
+	if (engine->reload) { // nothing to reload here, the config stays as it was
+		engine->reload = FALSE;
+		if (!quiet) printf("\" ~r reload at %lld\n", (long long)(time / 10));
+	}
+	if (engine->profilechange) { // a single config, no other profile to switch to
+		engine->profilechange = FALSE;
+		if (!quiet) printf("\" ~f profile %u at %lld\n", engine->profile, (long long)(time / 10));
+	}
+	engine->ncount = 0; // no app waits for notifications here
+	if (engine->play) {
+		const char *text;
+		ULONG length;
+
+		engine->play = FALSE;
+		text = PhraseText(tables->Phrases, engine->phrase, &length);
+		return text ? PrintPhrase(text, time) : 0;
+	}
+	return 0;
+}
+
+// The hold timer of the driver, fired at every wake time that passed before time while bindings are on
+static ULONG Expire(PKB_ENGINE engine, PKB_TABLES tables, LONGLONG time) {
+	LONGLONG wake;
+	ULONG outputs = 0;
+
+	while (mode == MODE_BINDING_ON && (wake = KbEngineWake(engine)) != 0 && wake <= time) {
+		KbEngineTimeout(engine, tables, wake);
+		outputs += PrintKeyout(engine, wake);
+		outputs += Requests(engine, tables, wake);
+	}
+	return outputs;
+}
+
+int main(int argc, char *argv[]) {
+	const char *config = NULL, *tracename = NULL;
+	ULONG passes = 1, count = 0;
+	unsigned long long events = 0, outputs = 0;
+	PKB_TABLES tables;
+	PTRACE_EVENT trace;
+	KB_ENGINE engine;
+	LONGLONG offset = 0, span;
+	double start, elapsed;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-q") == 0) quiet = TRUE;
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) passes = strtoul(argv[++i], NULL, 0);
+		else if (argv[i][0] == '-') usage();
+		else if (config == NULL) config = argv[i];
+		else if (tracename == NULL) tracename = argv[i];
+		else usage();
+	}
+	if (tracename == NULL || passes == 0) usage();
+
+	tables = ReadConfig(config);
+	if (tables == NULL) {
+		fprintf(stderr, "kbfsim: cannot load %s\n", config);
+		return 1;
+	}
+	trace = ReadTrace(tracename, &count);
+	if (trace == NULL) return 1;
+	if (count == 0) {
+		fprintf(stderr, "%s: no events\n", tracename);
+		return 1;
+	}
+
+	// every pass starts after the previous one, a binding timeout later
+	KbEngineInit(&engine, &tables->Settings);
+	span = trace[count - 1].time + engine.key_bind_timeout + 1;
+
+	start = Seconds();
+	for (ULONG pass = 0; pass < passes; pass++, offset += span) {
+		mode = MODE_BINDING_ON;
+		modedown = FALSE;
+		for (ULONG i = 0; i < count; i++) {
+			keydata event = trace[i].event;
+			LONGLONG time = offset + trace[i].time;
+
+			outputs += Expire(&engine, tables, time);
+
+			if (mode != MODE_BINDING_ON) {
+				if (event.key == K_SCROLLLOCK) {
+					ModeKey(event.flag, time);
+				} else if (mode == MODE_BINDING_OFF) {
+					if (!quiet) printf("%x %x %lld\n", event.key, event.flag, (long long)(time / 10));
+					outputs++;
+				}
+				continue;
+			}
+
+			if (KbEngineInput(&engine, tables, &event, time)) {
+				if (event.key == K_SCROLLLOCK) {
+					ModeKey(event.flag, time);
+				} else {
+					if (!quiet) printf("%x %x %lld\n", event.key, event.flag, (long long)(time / 10));
+					outputs++;
+				}
+			} else {
+				outputs += PrintKeyout(&engine, time);
+			}
+			outputs += Requests(&engine, tables, time);
+		}
+		outputs += Expire(&engine, tables, offset + span);
+		events += count;
+	}
+	elapsed = Seconds() - start;
+
+	fflush(stdout);
+	fprintf(stderr, "%llu events in, %llu out, %.0f events/s\n", events, outputs, elapsed > 0 ? events / elapsed : 0.0);
+
+	KbTablesFree(tables);
+	free(trace);
+	return 0;
+}